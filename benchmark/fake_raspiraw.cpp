@@ -0,0 +1,181 @@
+/*
+ Stand-in for raspiraw, streaming recorded raw frames
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+// Built as "raspiraw" and put first on the PATH of indiserver, so the driver
+// starts it, and stops it with pkill, exactly as it does the real one. It
+// takes the same arguments, uses -md, -fps and -eus, and writes a frame every
+// frame period to stdout. The period is set by -fps (or -f), as on the sensor,
+// and -eus is only the exposure inside it.
+//
+// PICAMERA_BENCH_MODE    sensor mode name, e.g. IMX219_BIN2. Without it the
+//                        first mode with the -md number is used, which is
+//                        right for the V2 camera.
+// PICAMERA_BENCH_RAW     file of whole frames as written by raspiraw -o. The
+//                        frames are played in a loop. Without it a flat frame
+//                        is sent.
+// PICAMERA_BENCH_STARTUP seconds before the first frame, for the sensor start.
+
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sensor_modes.h"
+
+#define EXPOSURE_DUTY 0.95  /* Without -fps, the exposure is taken as this fraction of the frame period, as the driver sets it */
+
+static const SensorMode *findMode(int md)
+{
+    const char *name = getenv("PICAMERA_BENCH_MODE");
+
+    for (int i = 0; i < sensorModeCount; i++) {
+
+        if (name ? !strcmp(sensorModes[i].name, name) : sensorModes[i].mode == md)
+            return &sensorModes[i];
+    }
+
+    return nullptr;
+}
+
+static bool writeAll(const unsigned char *data, long length)
+{
+    while (length > 0) {
+
+        ssize_t n = write(STDOUT_FILENO, data, length);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        data   += n;
+        length -= n;
+    }
+
+    return true;
+}
+
+static void addTime(struct timespec *t, double seconds)
+{
+    long ns = t->tv_nsec + (long)(seconds * 1e9);
+
+    t->tv_sec  += ns / 1000000000L;
+    t->tv_nsec  = ns % 1000000000L;
+}
+
+int main(int argc, char *argv[])
+{
+    int md     = 2;
+    long eus   = 1000000;
+    double fps = 0;
+
+    for (int i = 1; i + 1 < argc; i++) {
+
+        if (!strcmp(argv[i], "-md"))
+            md = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-eus"))
+            eus = atol(argv[++i]);
+        else if (!strcmp(argv[i], "-fps") || !strcmp(argv[i], "-f"))
+            fps = atof(argv[++i]);
+    }
+
+    const SensorMode *sensor = findMode(md);
+
+    if (!sensor)
+    {
+        fprintf(stderr, "raspiraw (benchmark): no sensor mode for -md %d\n", md);
+        return 1;
+    }
+
+    // ---------------------------------------------------------------------------
+    // Frames
+
+    std::vector<unsigned char> frames;
+    const char *path = getenv("PICAMERA_BENCH_RAW");
+
+    if (path)
+    {
+        FILE *file = fopen(path, "rb");
+
+        if (!file)
+        {
+            fprintf(stderr, "raspiraw (benchmark): cannot open %s\n", path);
+            return 1;
+        }
+
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+
+        // Whole frames only
+        size -= size % sensor->blocksize;
+
+        frames.resize(size);
+
+        if (size == 0 || fread(frames.data(), 1, size, file) != (size_t)size)
+        {
+            fprintf(stderr, "raspiraw (benchmark): %s holds no whole %ld byte frame\n", path, sensor->blocksize);
+            fclose(file);
+            return 1;
+        }
+
+        fclose(file);
+    }else{
+
+        // Packed bytes all 0x20 read back a little above the black level at either bit depth
+        frames.assign(sensor->blocksize, 0x20);
+    }
+
+    long count = frames.size() / sensor->blocksize;
+
+    // ---------------------------------------------------------------------------
+    // Stream at the frame period until killed
+
+    double period = fps > 0 ? 1 / fps : eus / 1e6 / EXPOSURE_DUTY;
+
+    // The sensor stretches the frame for an exposure longer than the period
+    period = std::max(period, eus / 1e6);
+
+    const char *startup = getenv("PICAMERA_BENCH_STARTUP");
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    addTime(&next, startup ? atof(startup) : 0);
+
+    for (long frame = 0;; frame++) {
+
+        // Each frame is written once its exposure would have been read out
+        addTime(&next, period);
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr) == EINTR) {
+        }
+
+        if (!writeAll(&frames[(frame % count) * sensor->blocksize], sensor->blocksize))
+            break;
+    }
+
+    return 0;
+}
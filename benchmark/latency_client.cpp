@@ -0,0 +1,586 @@
+/*
+ End to end latency benchmark client
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+// Scripts exposures over every combination of the given lengths, subframes
+// and binnings, and times each from the exposure request to the image BLOB
+// arriving. The driver's EXPOSURE_TIMING splits each one into stream start,
+// integration, finalize and send. Every exposure and a summary of each
+// combination are written as one JSON object per line.
+//
+// With -g it first checks, for each exposure length, that an exposure carried
+// over by a gapless sequence sums the same as a fresh one. This needs the flat
+// frames of the stand-in raspiraw (PICAMERA_BENCH_RAW unset).
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "baseclient.h"
+#include "basedevice.h"
+
+struct Roi
+{
+    bool full;
+    int x, y, w, h;
+};
+
+struct Run
+{
+    double total;       // request to BLOB, at the client
+    double timing[5];   // EXPOSURE_TIMING of the driver
+    long bytes;
+};
+
+static double now()
+{
+    struct timeval t;
+    gettimeofday(&t, nullptr);
+
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+// -------------------------------------------------------------------------------------------
+
+class LatencyClient : public INDI::BaseClient
+{
+    public:
+
+    LatencyClient()
+    {
+        pthread_mutex_init(&mutex, nullptr);
+        pthread_cond_init(&cv, nullptr);
+    }
+
+    std::string device;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+
+    // Counted by the listener thread, waited on by the script
+    int blobs { 0 };
+    int timings { 0 };
+    int frames { 0 };
+    int binnings { 0 };
+    int statistics { 0 };
+
+    double blobTime { 0 };
+    long blobBytes { 0 };
+    double timing[5] {};
+    double stats[4] {};     // min, max, mean, median of IMAGE_STATISTICS
+
+    // Wait until counter passes count, false on timeout
+    bool waitFor(int *counter, int count, double timeout)
+    {
+        double end = now() + timeout;
+
+        pthread_mutex_lock(&mutex);
+
+        while (*counter < count && now() < end)
+        {
+            struct timespec wake;
+            wake.tv_sec  = (time_t)(now() + 0.1);
+            wake.tv_nsec = (long)((now() + 0.1 - wake.tv_sec) * 1e9);
+
+            pthread_cond_timedwait(&cv, &mutex, &wake);
+        }
+
+        bool reached = *counter >= count;
+
+        pthread_mutex_unlock(&mutex);
+
+        return reached;
+    }
+
+    protected:
+
+    void newDevice(INDI::BaseDevice *) override {}
+    void removeDevice(INDI::BaseDevice *) override {}
+    void newProperty(INDI::Property *) override {}
+    void removeProperty(INDI::Property *) override {}
+    void newSwitch(ISwitchVectorProperty *) override {}
+    void newText(ITextVectorProperty *) override {}
+    void newLight(ILightVectorProperty *) override {}
+    void newMessage(INDI::BaseDevice *, int) override {}
+    void serverConnected() override {}
+    void serverDisconnected(int) override {}
+
+    void newBLOB(IBLOB *bp) override
+    {
+        double t = now();
+
+        // The preview BLOB does not end the exposure
+        if (strcmp(bp->bvp->name, "CCD1"))
+            return;
+
+        pthread_mutex_lock(&mutex);
+        blobTime  = t;
+        blobBytes = bp->size;
+        blobs++;
+        pthread_cond_broadcast(&cv);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void newNumber(INumberVectorProperty *nvp) override
+    {
+        pthread_mutex_lock(&mutex);
+
+        if (!strcmp(nvp->name, "EXPOSURE_TIMING"))
+        {
+            for (int i = 0; i < 5 && i < nvp->nnp; i++) {
+                timing[i] = nvp->np[i].value;
+            }
+            timings++;
+        }
+        else if (!strcmp(nvp->name, "IMAGE_STATISTICS") && nvp->s == IPS_OK)
+        {
+            for (int i = 0; i < 4 && i < nvp->nnp; i++) {
+                stats[i] = nvp->np[i].value;
+            }
+            statistics++;
+        }
+        else if (!strcmp(nvp->name, "CCD_FRAME") && nvp->s != IPS_BUSY)
+        {
+            frames++;
+        }
+        else if (!strcmp(nvp->name, "CCD_BINNING") && nvp->s != IPS_BUSY)
+        {
+            binnings++;
+        }
+
+        pthread_cond_broadcast(&cv);
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+// -------------------------------------------------------------------------------------------
+
+static std::vector<std::string> split(const char *list)
+{
+    std::vector<std::string> items;
+    std::string item;
+
+    for (const char *p = list;; p++) {
+
+        if (*p == ',' || *p == 0)
+        {
+            if (!item.empty())
+                items.push_back(item);
+            item.clear();
+
+            if (*p == 0)
+                break;
+        }else{
+            item += *p;
+        }
+    }
+
+    return items;
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+    std::sort(values.begin(), values.end());
+
+    return values[std::min(values.size() - 1, (size_t)(p * (values.size() - 1) + 0.5))];
+}
+
+static void printDistribution(const char *name, const std::vector<double> &values)
+{
+    double sum = 0;
+
+    for (double v : values) {
+        sum += v;
+    }
+
+    printf(", \"%s\": {\"min\": %.4f, \"median\": %.4f, \"p95\": %.4f, \"max\": %.4f, \"mean\": %.4f}", name,
+           percentile(values, 0), percentile(values, 0.5), percentile(values, 0.95), percentile(values, 1),
+           sum / values.size());
+}
+
+// One exposure, returning the statistics of its sums, false on timeout
+static bool expose(LatencyClient &client, INumberVectorProperty *exposureNP, double length, double timeout,
+                   double stats[4])
+{
+    pthread_mutex_lock(&client.mutex);
+    int blobs      = client.blobs;
+    int statistics = client.statistics;
+    pthread_mutex_unlock(&client.mutex);
+
+    exposureNP->np[0].value = length;
+    client.sendNewNumber(exposureNP);
+
+    if (!client.waitFor(&client.blobs, blobs + 1, length + timeout) ||
+        !client.waitFor(&client.statistics, statistics + 1, timeout))
+        return false;
+
+    pthread_mutex_lock(&client.mutex);
+    memcpy(stats, client.stats, sizeof(client.stats));
+    pthread_mutex_unlock(&client.mutex);
+
+    return true;
+}
+
+static void setSequence(LatencyClient &client, ISwitchVectorProperty *sequenceSP, bool on)
+{
+    IUResetSwitch(sequenceSP);
+    IUFindSwitch(sequenceSP, on ? "SEQUENCE_ON" : "SEQUENCE_OFF")->s = ISS_ON;
+    client.sendNewSwitch(sequenceSP);
+
+    // Applied before the next exposure request, which follows on the same connection
+    usleep(200000);
+}
+
+// A fresh exposure, then two of a gapless sequence, the second of which starts
+// with the frames carried over from the first. All frames are the same, so
+// the carried one must sum exactly as the fresh one.
+static bool sequenceCheck(LatencyClient &client, INumberVectorProperty *exposureNP, ISwitchVectorProperty *sequenceSP,
+                          double length, double timeout)
+{
+    double fresh[4], first[4], carried[4];
+
+    setSequence(client, sequenceSP, false);
+    bool done = expose(client, exposureNP, length, timeout, fresh);
+
+    setSequence(client, sequenceSP, true);
+    done = done && expose(client, exposureNP, length, timeout, first) &&
+           expose(client, exposureNP, length, timeout, carried);
+
+    setSequence(client, sequenceSP, false);
+
+    bool same = done;
+
+    for (int i = 0; i < 4; i++) {
+        same = same && fabs(carried[i] - fresh[i]) < 1e-6;
+    }
+
+    printf("{\"type\": \"sequence_check\", \"exposure\": %g, \"completed\": %s, \"same\": %s", length,
+           done ? "true" : "false", same ? "true" : "false");
+
+    if (done)
+    {
+        printf(", \"fresh_mean\": %.3f, \"carried_mean\": %.3f, \"fresh_min\": %.f, \"carried_min\": %.f",
+               fresh[2], carried[2], fresh[0], carried[0]);
+    }
+
+    printf("}\n");
+    fflush(stdout);
+
+    return same;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -s host      indiserver host (localhost)\n"
+            "  -p port      indiserver port (7624)\n"
+            "  -d device    device name (PiAstroCam CCD)\n"
+            "  -m mode      sensor mode, set before connecting ($PICAMERA_BENCH_MODE)\n"
+            "  -e list      exposure lengths in s (1,2,5)\n"
+            "  -r list      subframes, full or WxH+X+Y (full)\n"
+            "  -b list      binnings (1,2)\n"
+            "  -n runs      exposures of each combination (5)\n"
+            "  -t timeout   seconds allowed beyond the exposure length (30)\n"
+            "  -g           check gapless sequences sum as fresh exposures, then exit\n",
+            program);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host      = "localhost";
+    int port              = 7624;
+    const char *device    = "PiAstroCam CCD";
+    const char *mode      = getenv("PICAMERA_BENCH_MODE");
+    const char *exposures = "1,2,5";
+    const char *rois      = "full";
+    const char *bins      = "1,2";
+    int runs              = 5;
+    double timeout        = 30;
+    bool gapless          = false;
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:p:d:m:e:r:b:n:t:g")) != -1) {
+
+        switch (opt)
+        {
+            case 's': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'd': device = optarg; break;
+            case 'm': mode = optarg; break;
+            case 'e': exposures = optarg; break;
+            case 'r': rois = optarg; break;
+            case 'b': bins = optarg; break;
+            case 'n': runs = atoi(optarg); break;
+            case 't': timeout = atof(optarg); break;
+            case 'g': gapless = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    std::vector<Roi> roiList;
+
+    for (const std::string &item : split(rois)) {
+
+        Roi roi {};
+        roi.full = item == "full";
+
+        if (!roi.full && sscanf(item.c_str(), "%dx%d+%d+%d", &roi.w, &roi.h, &roi.x, &roi.y) != 4)
+        {
+            fprintf(stderr, "Bad subframe %s\n", item.c_str());
+            return 1;
+        }
+
+        roiList.push_back(roi);
+    }
+
+    // ---------------------------------------------------------------------------
+    // Connect
+
+    LatencyClient client;
+    client.device = device;
+
+    client.setServer(host, port);
+    client.watchDevice(device);
+
+    if (!client.connectServer())
+    {
+        fprintf(stderr, "Cannot connect to indiserver at %s:%d\n", host, port);
+        return 1;
+    }
+
+    INDI::BaseDevice *dev = nullptr;
+    double end = now() + timeout;
+
+    while (!(dev = client.getDevice(device)) && now() < end) {
+        usleep(100000);
+    }
+
+    if (!dev)
+    {
+        fprintf(stderr, "Device %s not found\n", device);
+        return 1;
+    }
+
+    // The sensor mode must match the frames of the stand-in raspiraw
+    if (mode)
+    {
+        while (!dev->getSwitch("SENSOR_MODE") && now() < end) {
+            usleep(100000);
+        }
+
+        ISwitchVectorProperty *sensorSP = dev->getSwitch("SENSOR_MODE");
+        ISwitch *sensor = sensorSP ? IUFindSwitch(sensorSP, mode) : nullptr;
+
+        if (!sensor)
+        {
+            fprintf(stderr, "Sensor mode %s not found\n", mode);
+            return 1;
+        }
+
+        IUResetSwitch(sensorSP);
+        sensor->s = ISS_ON;
+        client.sendNewSwitch(sensorSP);
+    }
+
+    client.connectDevice(device);
+    client.setBLOBMode(B_ALSO, device, nullptr);
+
+    // The CCD properties are defined once the camera is connected
+    while ((!dev->getNumber("CCD_EXPOSURE") || !dev->getNumber("EXPOSURE_TIMING")) && now() < end) {
+        usleep(100000);
+    }
+
+    INumberVectorProperty *exposureNP = dev->getNumber("CCD_EXPOSURE");
+    INumberVectorProperty *frameNP    = dev->getNumber("CCD_FRAME");
+    INumberVectorProperty *binningNP  = dev->getNumber("CCD_BINNING");
+
+    if (!exposureNP || !frameNP || !binningNP || !dev->getNumber("EXPOSURE_TIMING"))
+    {
+        fprintf(stderr, "Device %s did not connect\n", device);
+        return 1;
+    }
+
+    // ---------------------------------------------------------------------------
+    // Gapless sequence check, on the full frame
+
+    if (gapless)
+    {
+        ISwitchVectorProperty *sequenceSP = dev->getSwitch("SEQUENCE_MODE");
+
+        if (!sequenceSP)
+        {
+            fprintf(stderr, "Device %s has no SEQUENCE_MODE\n", device);
+            return 1;
+        }
+
+        bool passed = true;
+
+        for (const std::string &exposure : split(exposures)) {
+            passed = sequenceCheck(client, exposureNP, sequenceSP, atof(exposure.c_str()), timeout) && passed;
+        }
+
+        client.disconnectDevice(device);
+        client.disconnectServer();
+
+        return passed ? 0 : 2;
+    }
+
+    // ---------------------------------------------------------------------------
+    // Every combination, runs exposures each
+
+    for (const std::string &exposure : split(exposures)) {
+        for (const Roi &roi : roiList) {
+            for (const std::string &bin : split(bins)) {
+
+                double length = atof(exposure.c_str());
+                int binning   = atoi(bin.c_str());
+
+                // Binning first, the frame is then checked against the binned size
+                pthread_mutex_lock(&client.mutex);
+                int binnings = client.binnings;
+                int frames   = client.frames;
+                pthread_mutex_unlock(&client.mutex);
+
+                IUFindNumber(binningNP, "HOR_BIN")->value = binning;
+                IUFindNumber(binningNP, "VER_BIN")->value = binning;
+                client.sendNewNumber(binningNP);
+                client.waitFor(&client.binnings, binnings + 1, timeout);
+
+                INumber *x = IUFindNumber(frameNP, "X");
+                INumber *y = IUFindNumber(frameNP, "Y");
+                INumber *w = IUFindNumber(frameNP, "WIDTH");
+                INumber *h = IUFindNumber(frameNP, "HEIGHT");
+
+                x->value = roi.full ? 0 : roi.x;
+                y->value = roi.full ? 0 : roi.y;
+                w->value = roi.full ? w->max : roi.w;
+                h->value = roi.full ? h->max : roi.h;
+
+                int fx = x->value, fy = y->value, fw = w->value, fh = h->value;
+
+                client.sendNewNumber(frameNP);
+                client.waitFor(&client.frames, frames + 1, timeout);
+
+                std::vector<Run> results;
+
+                for (int run = 0; run < runs; run++) {
+
+                    pthread_mutex_lock(&client.mutex);
+                    int blobs   = client.blobs;
+                    int timings = client.timings;
+                    pthread_mutex_unlock(&client.mutex);
+
+                    double start = now();
+
+                    exposureNP->np[0].value = length;
+                    client.sendNewNumber(exposureNP);
+
+                    // The timing follows the BLOB, once the image is sent
+                    if (!client.waitFor(&client.blobs, blobs + 1, length + timeout) ||
+                        !client.waitFor(&client.timings, timings + 1, timeout))
+                    {
+                        printf("{\"type\": \"timeout\", \"exposure\": %g, \"x\": %d, \"y\": %d, \"width\": %d, "
+                               "\"height\": %d, \"bin\": %d, \"run\": %d}\n",
+                               length, fx, fy, fw, fh, binning, run);
+                        fflush(stdout);
+                        continue;
+                    }
+
+                    Run result;
+
+                    pthread_mutex_lock(&client.mutex);
+                    result.total = client.blobTime - start;
+                    result.bytes = client.blobBytes;
+                    memcpy(result.timing, client.timing, sizeof(result.timing));
+                    pthread_mutex_unlock(&client.mutex);
+
+                    results.push_back(result);
+
+                    printf("{\"type\": \"exposure\", \"exposure\": %g, \"x\": %d, \"y\": %d, \"width\": %d, "
+                           "\"height\": %d, \"bin\": %d, \"run\": %d, \"bytes\": %ld, \"total_s\": %.4f, "
+                           "\"overhead_s\": %.4f, \"startup_s\": %.4f, \"integration_s\": %.4f, "
+                           "\"finalize_s\": %.4f, \"send_s\": %.4f}\n",
+                           length, fx, fy, fw, fh, binning, run, result.bytes, result.total, result.total - length,
+                           result.timing[0], result.timing[1], result.timing[2], result.timing[3]);
+                    fflush(stdout);
+                }
+
+                if (results.empty())
+                    continue;
+
+                // ---------------------------------------------------------------------------
+                // Summary of the combination
+
+                std::vector<double> total, overhead, startup, integration, finalize, send;
+                double bytes = 0, sendTime = 0;
+
+                for (const Run &r : results) {
+
+                    total.push_back(r.total);
+                    overhead.push_back(r.total - length);
+                    startup.push_back(r.timing[0]);
+                    integration.push_back(r.timing[1]);
+                    finalize.push_back(r.timing[2]);
+                    send.push_back(r.timing[3]);
+
+                    bytes    += r.bytes;
+                    sendTime += r.timing[3];
+                }
+
+                double sum = 0;
+
+                for (double t : total) {
+                    sum += t;
+                }
+
+                printf("{\"type\": \"summary\", \"exposure\": %g, \"x\": %d, \"y\": %d, \"width\": %d, \"height\": %d, "
+                       "\"bin\": %d, \"runs\": %d, \"completed\": %d, \"images_per_hour\": %.1f, "
+                       "\"send_mb_per_s\": %.2f",
+                       length, fx, fy, fw, fh, binning, runs, (int)results.size(), 3600 * results.size() / sum,
+                       sendTime > 0 ? bytes / sendTime / 1e6 : 0);
+
+                printDistribution("total_s", total);
+                printDistribution("overhead_s", overhead);
+                printDistribution("startup_s", startup);
+                printDistribution("integration_s", integration);
+                printDistribution("finalize_s", finalize);
+                printDistribution("send_s", send);
+
+                printf("}\n");
+                fflush(stdout);
+            }
+        }
+    }
+
+    client.disconnectDevice(device);
+    client.disconnectServer();
+
+    return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ Check of the pulse guide scheduler on mock lines
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+// Runs PulseGuider on PULSE_MOCK_CHIP lines, so it needs no GPIO: pulses on
+// both axes at once end within the tolerance of their length, a new pulse
+// on an axis cuts the running one, and stop() reports the pulses it ends.
+// Writes one JSON line per check and exits with status 2 if one fails.
+
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "pulse_guide.h"
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -t ms        allowed difference from the pulse length (1)\n",
+            program);
+}
+
+// Results of count ended pulses, or fewer after a second without one
+static std::vector<PulseResult> wait(PulseGuider &guider, size_t count)
+{
+    std::vector<PulseResult> all, some;
+
+    while (all.size() < count) {
+
+        struct pollfd fd = { guider.notifyFd(), POLLIN, 0 };
+
+        if (poll(&fd, 1, 1000) <= 0)
+            break;
+
+        uint64_t n;
+        if (read(fd.fd, &n, sizeof(n)) < 0) {
+        }
+
+        guider.completed(some);
+        all.insert(all.end(), some.begin(), some.end());
+    }
+
+    return all;
+}
+
+static const PulseResult *find(const std::vector<PulseResult> &results, PulseDirection direction)
+{
+    for (size_t i = 0; i < results.size(); i++) {
+        if (results[i].direction == direction)
+            return &results[i];
+    }
+
+    return nullptr;
+}
+
+static bool report(const char *check, const PulseResult *r, bool pass)
+{
+    printf("{\"type\": \"pulse_check\", \"check\": \"%s\", \"pass\": %s", check, pass ? "true" : "false");
+
+    if (r)
+    {
+        printf(", \"requested\": %u, \"width\": %.3f, \"cut\": %s, \"stopped\": %s", r->requested, r->width,
+               r->cut ? "true" : "false", r->stopped ? "true" : "false");
+    }
+
+    printf("}\n");
+    fflush(stdout);
+
+    return pass;
+}
+
+static bool finished(const PulseResult *r, double tolerance)
+{
+    return r && !r->cut && !r->stopped && fabs(r->width - r->requested) <= tolerance;
+}
+
+int main(int argc, char *argv[])
+{
+    double tolerance = 1;
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+
+        switch (opt)
+        {
+            case 't': tolerance = atof(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    PulseGuider guider;
+    const int offsets[4] = { 0, 1, 2, 3 };
+
+    if (guider.open(PULSE_MOCK_CHIP, offsets, false) != 0)
+    {
+        perror("pulse_check: cannot open the mock lines");
+        return 1;
+    }
+
+    bool pass = true;
+
+    // ---------------------------------------------------------------------------
+    // RA and Dec at the same time, each timed on its own
+
+    guider.pulse(PULSE_EAST, 50);
+    guider.pulse(PULSE_NORTH, 20);
+
+    std::vector<PulseResult> results = wait(guider, 2);
+
+    pass &= report("both_axes_ra", find(results, PULSE_EAST), finished(find(results, PULSE_EAST), tolerance));
+    pass &= report("both_axes_dec", find(results, PULSE_NORTH), finished(find(results, PULSE_NORTH), tolerance));
+
+    // ---------------------------------------------------------------------------
+    // A new pulse on the axis cuts the running one and runs its own length
+
+    guider.pulse(PULSE_NORTH, 200);
+    usleep(20000);
+    guider.pulse(PULSE_SOUTH, 30);
+
+    results = wait(guider, 2);
+
+    const PulseResult *cut = find(results, PULSE_NORTH);
+
+    pass &= report("cut", cut, cut && cut->cut && !cut->stopped && cut->width < cut->requested);
+    pass &= report("cut_next", find(results, PULSE_SOUTH), finished(find(results, PULSE_SOUTH), tolerance));
+
+    // ---------------------------------------------------------------------------
+    // stop() ends the pulse at once and reports it
+
+    guider.pulse(PULSE_WEST, 200);
+    usleep(10000);
+    guider.stop();
+
+    results = wait(guider, 1);
+
+    const PulseResult *stopped = find(results, PULSE_WEST);
+
+    pass &= report("stop", stopped, stopped && stopped->stopped && !stopped->cut && stopped->width < stopped->requested);
+
+    guider.close();
+
+    return pass ? 0 : 2;
+}
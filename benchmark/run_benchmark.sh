@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# End to end latency benchmark of indi_picamera_ccd
+# Part of the indi-picamera driver
+#
+# Usage: run_benchmark.sh BUILD_DIR [picamera_latency options]
+#
+# Starts indiserver with the driver from BUILD_DIR and the stand-in raspiraw
+# first on its PATH, runs picamera_latency against it and stops the server.
+# JSON lines go to stdout, the server log to BUILD_DIR/benchmark/indiserver.log.
+#
+# PICAMERA_BENCH_RAW, PICAMERA_BENCH_MODE and PICAMERA_BENCH_STARTUP are
+# passed on to the stand-in raspiraw, see fake_raspiraw.cpp.
+# PICAMERA_BENCH_PORT is the indiserver port (7624).
+
+if [ $# -lt 1 ] || [ ! -x "$1/indi_picamera_ccd" ] || [ ! -x "$1/benchmark/raspiraw" ]; then
+    echo "Usage: $0 BUILD_DIR [picamera_latency options], BUILD_DIR configured with -DPICAMERA_BENCHMARK=ON" >&2
+    exit 1
+fi
+
+build=$(cd "$1" && pwd)
+shift
+
+port=${PICAMERA_BENCH_PORT:-7624}
+
+# camera_i2c powers up the real camera, there is none here
+bin=$(mktemp -d)
+ln -s "$build/benchmark/raspiraw" "$bin/raspiraw"
+printf '#!/bin/sh\nexit 0\n' > "$bin/camera_i2c"
+chmod +x "$bin/camera_i2c"
+
+PATH="$bin:$build:$PATH" indiserver -p "$port" indi_picamera_ccd > "$build/benchmark/indiserver.log" 2>&1 &
+server=$!
+
+trap 'kill $server 2>/dev/null; pkill raspiraw; rm -rf "$bin"' EXIT INT TERM
+
+sleep 2
+
+"$build/benchmark/picamera_latency" -p "$port" "$@"
@@ -6,5 +6,7 @@
 /* Define Driver version */
 #define GENERIC_VERSION_MAJOR @GENERIC_VERSION_MAJOR@
 #define GENERIC_VERSION_MINOR @GENERIC_VERSION_MINOR@
+/* Define if libgpiod (1.x) is available for pulse guiding */
+#cmakedefine HAVE_GPIOD 1
 
 #endif // CONFIG_H
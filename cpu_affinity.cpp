@@ -0,0 +1,203 @@
+/*
+ CPU affinity and scheduling of the driver threads
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "cpu_affinity.h"
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static cpu_set_t processCpus;           // CPUs the driver was started with
+static cpu_set_t roleCpus[CPU_ROLES];
+static int captureFifo = 0;
+
+static void init()
+{
+    if (sched_getaffinity(0, sizeof(processCpus), &processCpus) != 0)
+    {
+        CPU_ZERO(&processCpus);
+
+        for (int i = 0; i < CPU_SETSIZE && i < sysconf(_SC_NPROCESSORS_ONLN); i++) {
+            CPU_SET(i, &processCpus);
+        }
+    }
+
+    for (int r = 0; r < CPU_ROLES; r++) {
+        roleCpus[r] = processCpus;
+    }
+}
+
+static int parseList(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+
+    const char *p = list;
+
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+
+    if (*p == 0)
+    {
+        *set = processCpus;
+        return 0;
+    }
+
+    while (*p)
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+
+        if (end == p)
+            return -1;
+
+        long last = first;
+        p = end;
+
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+
+            if (end == p + 1)
+                return -1;
+
+            p = end;
+        }
+
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return -1;
+
+        for (long i = first; i <= last; i++) {
+            CPU_SET(i, set);
+        }
+
+        while (isspace((unsigned char)*p) || *p == ',') {
+            p++;
+        }
+    }
+
+    // Only the CPUs the driver may run on
+    CPU_AND(set, set, &processCpus);
+
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+int cpuRoleSet(int role, const char *list)
+{
+    pthread_once(&once, init);
+
+    cpu_set_t set;
+
+    if (role < 0 || role >= CPU_ROLES || parseList(list, &set) != 0)
+        return -1;
+
+    pthread_mutex_lock(&mutex);
+    roleCpus[role] = set;
+    pthread_mutex_unlock(&mutex);
+
+    return 0;
+}
+
+void cpuCaptureFifo(int priority)
+{
+    pthread_mutex_lock(&mutex);
+    captureFifo = priority;
+    pthread_mutex_unlock(&mutex);
+}
+
+int cpuRoleApply(int role)
+{
+    return cpuRoleApplyThread(pthread_self(), role);
+}
+
+int cpuRoleApplyThread(pthread_t thread, int role)
+{
+    pthread_once(&once, init);
+
+    pthread_mutex_lock(&mutex);
+    cpu_set_t set = roleCpus[role];
+    int fifo      = role == CPU_ROLE_CAPTURE ? captureFifo : 0;
+    pthread_mutex_unlock(&mutex);
+
+    int rc = pthread_setaffinity_np(thread, sizeof(set), &set);
+
+    struct sched_param param {};
+    param.sched_priority = fifo;
+
+    // Going back to normal scheduling is always allowed
+    int rs = pthread_setschedparam(thread, fifo > 0 ? SCHED_FIFO : SCHED_OTHER, &param);
+
+    return rc ? rc : rs;
+}
+
+void cpuChildCpus(cpu_set_t *set)
+{
+    pthread_once(&once, init);
+
+    *set = processCpus;
+}
+
+void cpuChildReset(const cpu_set_t *set)
+{
+    struct sched_param param {};
+
+    sched_setscheduler(0, SCHED_OTHER, &param);
+    sched_setaffinity(0, sizeof(*set), set);
+}
+
+int cpuWorkerThreads()
+{
+    pthread_once(&once, init);
+
+    pthread_mutex_lock(&mutex);
+    int count = CPU_COUNT(&roleCpus[CPU_ROLE_WORKERS]);
+    pthread_mutex_unlock(&mutex);
+
+    return count > 0 ? count : 1;
+}
+
+int cpuWorkerCreate(pthread_t *thread, void *(*start)(void *), void *arg)
+{
+    pthread_once(&once, init);
+
+    pthread_mutex_lock(&mutex);
+    cpu_set_t set = roleCpus[CPU_ROLE_WORKERS];
+    pthread_mutex_unlock(&mutex);
+
+    // Threads would otherwise inherit the CPUs and scheduling of the thread creating them
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    struct sched_param param {};
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &param);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+    int rc = pthread_create(thread, &attr, start, arg);
+
+    pthread_attr_destroy(&attr);
+
+    return rc;
+}
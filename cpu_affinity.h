@@ -0,0 +1,68 @@
+/*
+ CPU affinity and scheduling of the driver threads
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <pthread.h>
+#include <sched.h>
+
+// Thread roles. Capture is the thread reading the frames from raspiraw, and
+// the pulse guider. The INDI event loop and raspiraw keep normal scheduling.
+// Workers are the threads processing shares of a frame. Encoder is the
+// finalization worker and the SER writer.
+enum CpuRole
+{
+    CPU_ROLE_CAPTURE,
+    CPU_ROLE_WORKERS,
+    CPU_ROLE_ENCODER,
+    CPU_ROLES
+};
+
+// Set the CPUs of a role from a list such as "0-2,3". An empty list leaves the
+// role on all the CPUs the driver started with. Returns -1 for a malformed list
+// or one without any usable CPU, leaving the role as it was.
+int cpuRoleSet(int role, const char *list);
+
+// SCHED_FIFO priority of the capture role, 1 to 99, or 0 for normal scheduling.
+void cpuCaptureFifo(int priority);
+
+// Move the calling thread to the CPUs and scheduling of its role.
+// Returns 0, or the error of the first call that failed, e.g. EPERM for SCHED_FIFO.
+int cpuRoleApply(int role);
+
+// The same for another thread of the driver.
+int cpuRoleApplyThread(pthread_t thread, int role);
+
+// CPUs the driver was started with, for children. Taken before fork.
+void cpuChildCpus(cpu_set_t *set);
+
+// Between fork and exec, give the child normal scheduling and set, whatever
+// the thread that forked it runs with. Only makes async-signal-safe calls.
+void cpuChildReset(const cpu_set_t *set);
+
+// Number of worker threads, one per CPU of the workers role.
+int cpuWorkerThreads();
+
+// pthread_create for worker threads, on the CPUs of the workers role with
+// normal scheduling, whatever the role of the calling thread.
+int cpuWorkerCreate(pthread_t *thread, void *(*start)(void *), void *arg);
+
+#endif // CPU_AFFINITY_H
@@ -0,0 +1,479 @@
+/*
+ Demosaicing and colour binning of Bayer frames
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "debayer.h"
+#include "cpu_affinity.h"
+
+// Rows and columns of mirrored border around each chunk, enough for the
+// 5x5 green interpolation at one pixel outside the chunk
+#define PAD 3
+
+// Colour sites. The column bit flips between neighbouring pixels of a row.
+enum { SITE_R = 0, SITE_GR = 1, SITE_GB = 2, SITE_B = 3 };
+
+static inline int reflect(int v, int n)
+{
+    // Mirror about the edge pixel, which keeps the Bayer colour of the pixel
+    if (v < 0)
+        v = -v;
+    if (v >= n)
+        v = 2 * (n - 1) - v;
+
+    return std::min(std::max(v, 0), n - 1);
+}
+
+static inline int clip(int v)
+{
+    return v < 0 ? 0 : (v > 65535 ? 65535 : v);
+}
+
+// The row loops below compute every candidate value at every column and pick
+// per pixel with a mask that is 0xFFFF on green sites and 0 elsewhere. They have
+// no branches and unit stride, and the outputs are restrict so the compiler
+// vectorizes them (NEON on the Pi).
+static inline unsigned short pick(unsigned short mask, int green_site, int other_site)
+{
+    return (green_site & mask) | (other_site & ~mask);
+}
+
+// -------------------------------------------------------------------------------------------
+// Bilinear. u, m and d are the raw rows above, at and below the output row.
+// RED_ROW is true for rows of red and green, false for rows of blue and green.
+
+template <bool RED_ROW>
+static void bilinearRow(const unsigned short *u, const unsigned short *m, const unsigned short *d,
+                        const unsigned short *mask, int w, unsigned short *__restrict r, unsigned short *__restrict g,
+                        unsigned short *__restrict b)
+{
+    for (int i = 0; i < w; i++)
+    {
+        int k = i + PAD;
+
+        int centre = m[k];
+        int cross  = (u[k] + d[k] + m[k - 1] + m[k + 1] + 2) >> 2;
+        int diag   = (u[k - 1] + u[k + 1] + d[k - 1] + d[k + 1] + 2) >> 2;
+        int horiz  = (m[k - 1] + m[k + 1] + 1) >> 1;
+        int vert   = (u[k] + d[k] + 1) >> 1;
+
+        g[i] = pick(mask[i], centre, cross);
+        r[i] = RED_ROW ? pick(mask[i], horiz, centre) : pick(mask[i], vert, diag);
+        b[i] = RED_ROW ? pick(mask[i], vert, diag) : pick(mask[i], horiz, centre);
+    }
+}
+
+// -------------------------------------------------------------------------------------------
+// Edge directed. Green at red and blue sites is interpolated along the
+// direction with the smaller gradient, corrected by the Laplacian of the
+// site's own colour. Red and blue are then filled in from the colour
+// differences to green, so colour edges follow the green edges.
+
+// rows are the five raw rows centred on the green row, k_1 the raw column of green column 0
+static void greenRow(const unsigned short *const *rows, int k_1, const unsigned short *mask, int w,
+                     unsigned short *__restrict green)
+{
+    const unsigned short *a = rows[0] + k_1;
+    const unsigned short *u = rows[1] + k_1;
+    const unsigned short *m = rows[2] + k_1;
+    const unsigned short *d = rows[3] + k_1;
+    const unsigned short *e = rows[4] + k_1;
+
+    for (int c = 0; c < w; c++)
+    {
+        int lapH = 2 * m[c] - m[c - 2] - m[c + 2];
+        int lapV = 2 * m[c] - a[c] - e[c];
+
+        int dH = abs(m[c - 1] - m[c + 1]) + abs(lapH);
+        int dV = abs(u[c] - d[c]) + abs(lapV);
+
+        // Four times the interpolated value
+        int gH = 2 * (m[c - 1] + m[c + 1]) + lapH;
+        int gV = 2 * (u[c] + d[c]) + lapV;
+
+        int g4 = dH < dV ? gH : (dV < dH ? gV : (gH + gV) >> 1);
+
+        green[c] = pick(mask[c], m[c], clip((g4 + 2) >> 2));
+    }
+}
+
+// gu, gm and gd are the green rows above, at and below the output row, with
+// green column i + 1 at output column i
+template <bool RED_ROW>
+static void edgeRow(const unsigned short *u, const unsigned short *m, const unsigned short *d, const unsigned short *gu,
+                    const unsigned short *gm, const unsigned short *gd, const unsigned short *mask, int w,
+                    unsigned short *__restrict r, unsigned short *__restrict g, unsigned short *__restrict b)
+{
+    for (int i = 0; i < w; i++)
+    {
+        int k = i + PAD;
+        int c = i + 1;
+
+        int centre = m[k];
+        int gc     = gm[c];
+
+        int diag  = gc + (((u[k - 1] - gu[c - 1]) + (u[k + 1] - gu[c + 1]) + (d[k - 1] - gd[c - 1]) +
+                           (d[k + 1] - gd[c + 1])) >> 2);
+        int horiz = gc + (((m[k - 1] - gm[c - 1]) + (m[k + 1] - gm[c + 1])) >> 1);
+        int vert  = gc + (((u[k] - gu[c]) + (d[k] - gd[c])) >> 1);
+
+        diag  = clip(diag);
+        horiz = clip(horiz);
+        vert  = clip(vert);
+
+        g[i] = gc;
+        r[i] = RED_ROW ? pick(mask[i], horiz, centre) : pick(mask[i], vert, diag);
+        b[i] = RED_ROW ? pick(mask[i], vert, diag) : pick(mask[i], horiz, centre);
+    }
+}
+
+// -------------------------------------------------------------------------------------------
+// Each thread takes a band of output rows and works through it in chunks of
+// DEBAYER_ROWS. The raw rows of a chunk, with a mirrored border of PAD pixels,
+// are copied into a window first, so the row loops above never check bounds.
+
+struct DebayerJob
+{
+    const unsigned short *cfa;
+    int width, height;
+    int x, y, w, h;
+    int rx, ry;             // position of red in the 2x2 pattern
+    DebayerMethod method;
+    int row_1, row_2;       // output rows of this thread
+    unsigned short *rgb;
+};
+
+static inline int siteAt(const DebayerJob *job, int vx, int vy)
+{
+    return (((vy ^ job->ry) & 1) << 1) | ((vx ^ job->rx) & 1);
+}
+
+static inline bool greenSite(int site)
+{
+    return site == SITE_GR || site == SITE_GB;
+}
+
+static void windowRow(const DebayerJob *job, int vy, unsigned short *dst)
+{
+    const unsigned short *src = job->cfa + (long)reflect(vy, job->height) * job->width;
+
+    int x_1 = job->x - PAD;
+    int x_2 = job->x + job->w + PAD;
+    int a   = std::max(0, x_1);
+    int b   = std::min(job->width, x_2);
+
+    memcpy(dst + (a - x_1), src + a, (b - a) * sizeof(unsigned short));
+
+    for (int vx = x_1; vx < a; vx++)
+        dst[vx - x_1] = src[reflect(vx, job->width)];
+
+    for (int vx = b; vx < x_2; vx++)
+        dst[vx - x_1] = src[reflect(vx, job->width)];
+}
+
+static void *debayerWorker(void *context)
+{
+    DebayerJob *job = (DebayerJob *)context;
+
+    int w  = job->w;
+    int ww = w + 2 * PAD;
+    int gw = w + 2;
+
+    long plane = (long)job->w * job->h;
+
+    std::vector<unsigned short> window((DEBAYER_ROWS + 2 * PAD) * ww);
+    std::vector<unsigned short> green(job->method == DEBAYER_EDGE ? (DEBAYER_ROWS + 2) * gw : 0);
+
+    // Green site masks. A row starting on a green site uses the mask from element 1.
+    std::vector<unsigned short> mask(gw + 1);
+
+    for (int i = 0; i < gw + 1; i++)
+        mask[i] = (i & 1) ? 0xFFFF : 0;
+
+    for (int row_1 = job->row_1; row_1 < job->row_2; row_1 += DEBAYER_ROWS)
+    {
+        int rows = std::min(DEBAYER_ROWS, job->row_2 - row_1);
+
+        // Window row j holds virtual row y + row_1 - PAD + j
+        int vy_1 = job->y + row_1 - PAD;
+
+        for (int j = 0; j < rows + 2 * PAD; j++)
+            windowRow(job, vy_1 + j, &window[j * ww]);
+
+        if (job->method == DEBAYER_EDGE)
+        {
+            // Green of the chunk and one pixel around it. Green row t is at
+            // virtual row vy_1 + 2 + t and column c at virtual column x - 1 + c.
+            for (int t = 0; t < rows + 2; t++)
+            {
+                const unsigned short *rows5[5];
+
+                for (int j = 0; j < 5; j++)
+                    rows5[j] = &window[(t + j) * ww];
+
+                int site = siteAt(job, job->x - 1, vy_1 + 2 + t);
+
+                greenRow(rows5, PAD - 1, &mask[greenSite(site)], gw, &green[t * gw]);
+            }
+        }
+
+        for (int j = 0; j < rows; j++)
+        {
+            const unsigned short *u = &window[(j + PAD - 1) * ww];
+            const unsigned short *m = &window[(j + PAD) * ww];
+            const unsigned short *d = &window[(j + PAD + 1) * ww];
+
+            long offset       = (long)(row_1 + j) * w;
+            unsigned short *r = job->rgb + offset;
+            unsigned short *g = r + plane;
+            unsigned short *b = g + plane;
+
+            int site                   = siteAt(job, job->x, job->y + row_1 + j);
+            bool red_row               = (site == SITE_R || site == SITE_GR);
+            const unsigned short *mrow = &mask[greenSite(site)];
+
+            if (job->method == DEBAYER_EDGE)
+            {
+                const unsigned short *gu = &green[j * gw];
+                const unsigned short *gm = &green[(j + 1) * gw];
+                const unsigned short *gd = &green[(j + 2) * gw];
+
+                if (red_row)
+                    edgeRow<true>(u, m, d, gu, gm, gd, mrow, w, r, g, b);
+                else
+                    edgeRow<false>(u, m, d, gu, gm, gd, mrow, w, r, g, b);
+            }
+            else
+            {
+                if (red_row)
+                    bilinearRow<true>(u, m, d, mrow, w, r, g, b);
+                else
+                    bilinearRow<false>(u, m, d, mrow, w, r, g, b);
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+// Index of red in the 2x2 pattern, or -1 if the pattern is not a Bayer pattern
+static int redSite(const char *pattern)
+{
+    // Red and blue on one diagonal of the 2x2 pattern, green on the other
+    const char *red = pattern ? strchr(pattern, 'R') : nullptr;
+
+    if (!red || strlen(pattern) != 4)
+        return -1;
+
+    int site = red - pattern;
+
+    if (pattern[3 - site] != 'B' || pattern[site ^ 1] != 'G' || pattern[site ^ 2] != 'G')
+        return -1;
+
+    return site;
+}
+
+int debayerFrame(const unsigned short *cfa, int width, int height, int x, int y, int w, int h,
+                 const char *pattern, DebayerMethod method, int nthreads, unsigned short *rgb){
+
+    int site = redSite(pattern);
+
+    if (site < 0)
+        return -1;
+
+    if (nthreads < 1)
+        nthreads = 1;
+
+    nthreads = std::min(nthreads, std::max(1, h / DEBAYER_ROWS));
+
+    std::vector<DebayerJob> jobs(nthreads);
+    std::vector<pthread_t> threads(nthreads);
+
+    for (int t = 0; t < nthreads; t++) {
+
+        jobs[t].cfa    = cfa;
+        jobs[t].width  = width;
+        jobs[t].height = height;
+        jobs[t].x      = x;
+        jobs[t].y      = y;
+        jobs[t].w      = w;
+        jobs[t].h      = h;
+        jobs[t].rx     = site & 1;
+        jobs[t].ry     = site >> 1;
+        jobs[t].method = method;
+        jobs[t].row_1  = (long)h * t / nthreads;
+        jobs[t].row_2  = (long)h * (t + 1) / nthreads;
+        jobs[t].rgb    = rgb;
+    }
+
+    // The calling thread takes the first band
+    int started = 1;
+
+    for (int t = 1; t < nthreads; t++) {
+
+        if (cpuWorkerCreate(&threads[t], &debayerWorker, &jobs[t]) != 0)
+            break;
+
+        started++;
+    }
+
+    // Bands whose thread could not be started are done here
+    for (int t = started; t < nthreads; t++) {
+        debayerWorker(&jobs[t]);
+    }
+
+    debayerWorker(&jobs[0]);
+
+    for (int t = 1; t < started; t++) {
+        pthread_join(threads[t], nullptr);
+    }
+
+    return 0;
+
+}
+
+// -------------------------------------------------------------------------------------------
+// Colour binning. Both read the region straight from the full frame, so
+// subframe extraction and binning are one pass over the pixels used.
+
+void cfaBinFrame(const unsigned short *cfa, int width, int x, int y, int w, int h, int binx, int biny,
+                 unsigned short *out){
+
+    // Output pixel X, Y has the colour of region pixel X & 1, Y & 1. Its sums
+    // come from every second column and row of a block of 2 x binx by 2 x biny.
+    int bw = w / binx;
+    int bh = h / biny;
+
+    std::vector<uint32_t> sum(bw);
+
+    for (int Y = 0; Y < bh; Y++)
+    {
+        std::fill(sum.begin(), sum.end(), 0);
+
+        int rows = 0;
+
+        for (int j = 0; j < biny; j++)
+        {
+            int sy = (Y >> 1) * 2 * biny + (Y & 1) + 2 * j;
+
+            if (sy >= h)
+                break;
+
+            const unsigned short *src = cfa + (long)(y + sy) * width + x;
+            rows++;
+
+            for (int X = 0; X < bw; X++)
+            {
+                int sx_1 = (X >> 1) * 2 * binx + (X & 1);
+                int sx_2 = std::min(sx_1 + 2 * binx, w);
+
+                for (int sx = sx_1; sx < sx_2; sx += 2)
+                    sum[X] += src[sx];
+            }
+        }
+
+        unsigned short *dst = out + (long)Y * bw;
+
+        for (int X = 0; X < bw; X++)
+        {
+            int sx_1 = (X >> 1) * 2 * binx + (X & 1);
+            int cols = (std::min(sx_1 + 2 * binx, w) - sx_1 + 1) / 2;
+
+            // Blocks cut short by the edge of an odd sized region are scaled up
+            uint64_t v = sum[X];
+
+            if (rows * cols < binx * biny && rows * cols > 0)
+                v = v * binx * biny / (rows * cols);
+
+            dst[X] = v > 65535 ? 65535 : v;
+        }
+    }
+}
+
+int superpixelFrame(const unsigned short *cfa, int width, int x, int y, int w, int h, int binx, int biny,
+                    const char *pattern, unsigned short *rgb){
+
+    int site = redSite(pattern);
+
+    if (site < 0 || (binx & 1) || (biny & 1))
+        return -1;
+
+    int bw = w / binx;
+    int bh = h / biny;
+
+    long plane = (long)bw * bh;
+
+    // Every block starts on the colour of the region origin, so the four
+    // sums of each block are in the same order for the whole region
+    int rx = (x ^ site) & 1;
+    int ry = (y ^ (site >> 1)) & 1;
+
+    // sums[phase][X], phase = row parity * 2 + column parity
+    std::vector<uint32_t> sums(4 * bw);
+
+    for (int Y = 0; Y < bh; Y++)
+    {
+        std::fill(sums.begin(), sums.end(), 0);
+
+        for (int j = 0; j < biny; j++)
+        {
+            const unsigned short *src = cfa + (long)(y + Y * biny + j) * width + x;
+            uint32_t *even            = &sums[(j & 1) * 2 * bw];
+            uint32_t *odd             = even + bw;
+
+            for (int X = 0; X < bw; X++)
+            {
+                const unsigned short *p = src + X * binx;
+
+                for (int i = 0; i < binx; i += 2)
+                {
+                    even[X] += p[i];
+                    odd[X] += p[i + 1];
+                }
+            }
+        }
+
+        const uint32_t *red   = &sums[(ry * 2 + rx) * bw];
+        const uint32_t *blue  = &sums[((ry ^ 1) * 2 + (rx ^ 1)) * bw];
+        const uint32_t *green = &sums[(ry * 2 + (rx ^ 1)) * bw];
+        const uint32_t *green2 = &sums[((ry ^ 1) * 2 + rx) * bw];
+
+        unsigned short *r = rgb + (long)Y * bw;
+        unsigned short *g = r + plane;
+        unsigned short *b = g + plane;
+
+        for (int X = 0; X < bw; X++)
+        {
+            uint32_t gv = (green[X] + green2[X] + 1) >> 1;
+
+            r[X] = red[X] > 65535 ? 65535 : red[X];
+            g[X] = gv > 65535 ? 65535 : gv;
+            b[X] = blue[X] > 65535 ? 65535 : blue[X];
+        }
+    }
+
+    return 0;
+
+}
@@ -0,0 +1,53 @@
+/*
+ Demosaicing and colour binning of Bayer frames
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#ifndef DEBAYER_H
+#define DEBAYER_H
+
+#define DEBAYER_ROWS 32     /* Output rows demosaiced per chunk */
+
+enum DebayerMethod
+{
+    DEBAYER_BILINEAR,
+    DEBAYER_EDGE        // Hamilton-Adams edge directed green, colour differences for red and blue
+};
+
+// Demosaic the region x, y, w, h of a full width x height Bayer frame into
+// three planes (R, G, B) of w x h pixels each. The colour of each pixel is
+// taken from its position in the full frame, so regions may start on any
+// row or column. Pixels outside the frame are mirrored from inside it.
+// pattern is the colour of the top left 2x2 pixels, e.g. "BGGR".
+// Row bands are spread over nthreads threads. Returns -1 for an unknown pattern.
+int debayerFrame(const unsigned short *cfa, int width, int height, int x, int y, int w, int h,
+                 const char *pattern, DebayerMethod method, int nthreads, unsigned short *rgb);
+
+// Bin the region x, y, w, h of a Bayer frame of the given width, summing
+// binx x biny photosites of the same colour, so the binned frame keeps the
+// Bayer pattern of the region. out is w / binx x h / biny, saturating at 65535.
+void cfaBinFrame(const unsigned short *cfa, int width, int x, int y, int w, int h, int binx, int biny,
+                 unsigned short *out);
+
+// Superpixel binning of the region x, y, w, h. Each binx x biny block (both
+// even) becomes one pixel of three planes (R, G, B). Red and blue are summed,
+// green is summed and halved. Returns -1 for an unknown pattern or odd binning.
+int superpixelFrame(const unsigned short *cfa, int width, int x, int y, int w, int h, int binx, int biny,
+                    const char *pattern, unsigned short *rgb);
+
+#endif // DEBAYER_H
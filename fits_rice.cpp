@@ -0,0 +1,227 @@
+/*
+ Rice compression for tiled FITS images
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "fits_rice.h"
+#include "cpu_affinity.h"
+
+#define FSBITS 4    // bits used for the split code of each block (16-bit pixels)
+#define FSMAX  14   // largest split before a block is stored raw
+#define BBITS  16   // bits per raw pixel
+
+// -------------------------------------------------------------------------------------------
+// Bit writer, most significant bit first as the FITS Rice convention requires
+
+struct RiceBits
+{
+    std::vector<unsigned char> &out;
+    uint32_t acc;
+    int nbits;
+
+    RiceBits(std::vector<unsigned char> &o) : out(o), acc(0), nbits(0) {}
+
+    void put(uint32_t value, int n){    // n <= 16
+
+        acc = (acc << n) | (value & ((1u << n) - 1));
+        nbits += n;
+
+        while (nbits >= 8) {
+            nbits -= 8;
+            out.push_back((unsigned char)(acc >> nbits));
+        }
+
+        acc &= (1u << nbits) - 1;
+    }
+
+    void zeros(uint32_t n){
+
+        while (n >= 16) {
+            put(0, 16);
+            n -= 16;
+        }
+
+        put(0, n);
+    }
+
+    void flush(){
+
+        if (nbits > 0)
+            out.push_back((unsigned char)(acc << (8 - nbits)));
+
+        acc = 0;
+        nbits = 0;
+    }
+};
+
+// -------------------------------------------------------------------------------------------
+
+int riceEncode(const unsigned short *pixels, int count, std::vector<unsigned char> &out){
+
+    uint32_t diff[RICE_BLOCKSIZE];
+
+    RiceBits bits(out);
+
+    out.clear();
+    out.reserve(count * 2 + 16);
+
+    if (count <= 0)
+        return 0;
+
+    // First pixel is written raw, as the signed value stored with BZERO = 32768
+    uint16_t lastpix = pixels[0] ^ 0x8000;
+    bits.put(lastpix, BBITS);
+
+    for (int i = 0; i < count; i += RICE_BLOCKSIZE) {
+
+        int thisblock = (count - i < RICE_BLOCKSIZE) ? count - i : RICE_BLOCKSIZE;
+
+        // Map differences to unsigned, small magnitudes first
+        double pixelsum = 0;
+
+        for (int j = 0; j < thisblock; j++) {
+
+            uint16_t nextpix = pixels[i + j] ^ 0x8000;
+            int16_t pdiff = (int16_t)(uint16_t)(nextpix - lastpix);
+
+            diff[j] = (pdiff < 0) ? ((uint32_t)(-(int32_t)pdiff) << 1) - 1 : (uint32_t)pdiff << 1;
+            pixelsum += diff[j];
+            lastpix = nextpix;
+        }
+
+        // Split position from the mean mapped difference
+        double dpsum = (pixelsum - (thisblock / 2) - 1) / thisblock;
+        if (dpsum < 0)
+            dpsum = 0;
+
+        uint32_t psum = ((uint32_t)dpsum) >> 1;
+        int fs;
+        for (fs = 0; psum > 0; fs++)
+            psum >>= 1;
+
+        if (fs >= FSMAX)
+        {
+            // High entropy, store the differences raw
+            bits.put(FSMAX + 1, FSBITS);
+
+            for (int j = 0; j < thisblock; j++)
+                bits.put(diff[j], BBITS);
+        }
+        else if (fs == 0 && pixelsum == 0)
+        {
+            // Flat block, every difference is zero
+            bits.put(0, FSBITS);
+        }
+        else
+        {
+            bits.put(fs + 1, FSBITS);
+
+            for (int j = 0; j < thisblock; j++) {
+                bits.zeros(diff[j] >> fs);  // top bits in unary
+                bits.put(1, 1);
+                bits.put(diff[j], fs);      // bottom fs bits
+            }
+        }
+    }
+
+    bits.flush();
+
+    return out.size();
+
+}
+
+// -------------------------------------------------------------------------------------------
+// Row tiles are dealt out round robin so every thread gets a similar share of the image
+
+struct RiceJob
+{
+    const unsigned short *image;
+    int width;
+    int height;
+    int first;
+    int step;
+    std::vector<std::vector<unsigned char>> *tiles;
+};
+
+static void *riceWorker(void *context){
+
+    RiceJob *job = (RiceJob *)context;
+
+    for (int row = job->first; row < job->height; row += job->step) {
+        riceEncode(job->image + (long)row * job->width, job->width, (*job->tiles)[row]);
+    }
+
+    return nullptr;
+
+}
+
+int riceCompressRows(const unsigned short *image, int width, int height, int nthreads,
+                     std::vector<std::vector<unsigned char>> &tiles){
+
+    if (nthreads < 1)
+        nthreads = 1;
+
+    tiles.resize(height);
+
+    std::vector<RiceJob> jobs(nthreads);
+    std::vector<pthread_t> threads(nthreads);
+
+    for (int t = 0; t < nthreads; t++) {
+
+        jobs[t].image  = image;
+        jobs[t].width  = width;
+        jobs[t].height = height;
+        jobs[t].first  = t;
+        jobs[t].step   = nthreads;
+        jobs[t].tiles  = &tiles;
+    }
+
+    // The calling thread takes the first share
+    int started = 1;
+
+    for (int t = 1; t < nthreads; t++) {
+
+        if (cpuWorkerCreate(&threads[t], &riceWorker, &jobs[t]) != 0)
+            break;
+
+        started++;
+    }
+
+    // Shares whose thread could not be started are done here
+    for (int t = started; t < nthreads; t++) {
+        riceWorker(&jobs[t]);
+    }
+
+    riceWorker(&jobs[0]);
+
+    for (int t = 1; t < started; t++) {
+        pthread_join(threads[t], nullptr);
+    }
+
+    long total = 0;
+
+    for (int row = 0; row < height; row++) {
+        total += tiles[row].size();
+    }
+
+    return total;
+
+}
@@ -0,0 +1,37 @@
+/*
+ Rice compression for tiled FITS images
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#ifndef FITS_RICE_H
+#define FITS_RICE_H
+
+#include <vector>
+
+#define RICE_BLOCKSIZE 32   /* Pixels per Rice block (ZVAL1 of the FITS header) */
+
+// Rice code one tile of unsigned 16-bit pixels as RICE_1 with BYTEPIX = 2.
+// Pixels are stored with BZERO = 32768, the same as cfitsio does for USHORT_IMG.
+int riceEncode(const unsigned short *pixels, int count, std::vector<unsigned char> &out);
+
+// Rice code an image one row per tile, spread over nthreads threads.
+// tiles[row] receives the compressed bytes of each row.
+int riceCompressRows(const unsigned short *image, int width, int height, int nthreads,
+                     std::vector<std::vector<unsigned char>> &tiles);
+
+#endif // FITS_RICE_H
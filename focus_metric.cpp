@@ -0,0 +1,350 @@
+/*
+ Star detection and focus metrics
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "focus_metric.h"
+#include "cpu_affinity.h"
+
+#define FOCUS_SAMPLES 20000     /* Quads sampled for the background */
+
+struct FocusStar
+{
+    double flux;
+    double hfr;
+    double fwhm;
+};
+
+// -------------------------------------------------------------------------------------------
+// Work is dealt out round robin, by quad rows for the quad sums and by tiles
+// for the search, so every thread gets a similar share of the region.
+
+struct FocusJob
+{
+    const unsigned short *image;
+    int width;
+    int x, y;
+    int saturation;
+
+    uint32_t *quads;            // quad sums, qw x qh
+    int qw, qh;
+
+    double background;
+    double noise;
+    double threshold;
+
+    int first;
+    int step;
+
+    std::vector<FocusStar> stars;
+};
+
+static void *quadWorker(void *context){
+
+    FocusJob *job = (FocusJob *)context;
+
+    for (int j = job->first; j < job->qh; j += job->step) {
+
+        const unsigned short *r0 = job->image + (long)(job->y + 2 * j) * job->width + job->x;
+        const unsigned short *r1 = r0 + job->width;
+        uint32_t *dst = job->quads + (long)j * job->qw;
+
+        for (int i = 0; i < job->qw; i++) {
+            dst[i] = r0[2 * i] + r0[2 * i + 1] + r1[2 * i] + r1[2 * i + 1];
+        }
+    }
+
+    return nullptr;
+
+}
+
+// Background subtracted moments of the quads more than 3 sigma above the
+// background in the window around a peak. HFR is the flux weighted mean
+// distance from the centroid, as for the guide star, and FWHM comes from the
+// second moment as for a Gaussian profile.
+static bool measureStar(const FocusJob *job, int pi, int pj, FocusStar *star){
+
+    double flux = 0, sx = 0, sy = 0;
+    int npix = 0;
+
+    for (int j = pj - FOCUS_RADIUS; j <= pj + FOCUS_RADIUS; j++) {
+
+        const uint32_t *row = job->quads + (long)j * job->qw;
+
+        for (int i = pi - FOCUS_RADIUS; i <= pi + FOCUS_RADIUS; i++) {
+
+            double v = row[i] - job->background;
+
+            if (v > 3 * job->noise)
+            {
+                flux += v;
+                sx   += v * i;
+                sy   += v * j;
+                npix++;
+            }
+        }
+    }
+
+    // Single hot quads and noise spikes
+    if (npix < 3 || flux <= 0)
+        return false;
+
+    double cx = sx / flux;
+    double cy = sy / flux;
+
+    double sr = 0, sr2 = 0;
+
+    for (int j = pj - FOCUS_RADIUS; j <= pj + FOCUS_RADIUS; j++) {
+
+        const uint32_t *row = job->quads + (long)j * job->qw;
+
+        for (int i = pi - FOCUS_RADIUS; i <= pi + FOCUS_RADIUS; i++) {
+
+            double v = row[i] - job->background;
+
+            if (v > 3 * job->noise)
+            {
+                double r2 = (i - cx) * (i - cx) + (j - cy) * (j - cy);
+                sr  += v * sqrt(r2);
+                sr2 += v * r2;
+            }
+        }
+    }
+
+    // Quads are two pixels across
+    star->flux = flux;
+    star->hfr  = 2 * sr / flux;
+    star->fwhm = 2 * 2.3548 * sqrt(sr2 / flux / 2);
+
+    return true;
+
+}
+
+static void *searchWorker(void *context){
+
+    FocusJob *job = (FocusJob *)context;
+
+    int tilesX = (job->qw + FOCUS_TILE - 1) / FOCUS_TILE;
+    int tilesY = (job->qh + FOCUS_TILE - 1) / FOCUS_TILE;
+
+    for (int t = job->first; t < tilesX * tilesY; t += job->step) {
+
+        // Peaks close to the region edge are skipped, so every window is whole
+        int i_1 = std::max(FOCUS_RADIUS, (t % tilesX) * FOCUS_TILE);
+        int j_1 = std::max(FOCUS_RADIUS, (t / tilesX) * FOCUS_TILE);
+        int i_2 = std::min(job->qw - FOCUS_RADIUS, (t % tilesX + 1) * FOCUS_TILE);
+        int j_2 = std::min(job->qh - FOCUS_RADIUS, (t / tilesX + 1) * FOCUS_TILE);
+
+        for (int j = j_1; j < j_2; j++) {
+
+            const uint32_t *row = job->quads + (long)j * job->qw;
+
+            for (int i = i_1; i < i_2; i++) {
+
+                uint32_t v = row[i];
+
+                if (v <= job->threshold)
+                    continue;
+
+                // Local maximum of the 5x5 quads around it. Equal values
+                // before it in raster order win, so a flat top counts once.
+                bool peak = true;
+
+                for (int dj = -2; dj <= 2 && peak; dj++) {
+
+                    const uint32_t *r = row + dj * job->qw;
+
+                    for (int di = -2; di <= 2; di++) {
+
+                        if (di == 0 && dj == 0)
+                            continue;
+
+                        bool before = dj < 0 || (dj == 0 && di < 0);
+
+                        if (r[i + di] > v || (before && r[i + di] == v))
+                        {
+                            peak = false;
+                            break;
+                        }
+                    }
+                }
+
+                if (!peak)
+                    continue;
+
+                // Saturated stars have flat tops and measure too wide
+                const unsigned short *p = job->image + (long)(job->y + 2 * j) * job->width + job->x + 2 * i;
+
+                if (std::max(std::max(p[0], p[1]), std::max(p[job->width], p[job->width + 1])) >= job->saturation)
+                    continue;
+
+                FocusStar star;
+
+                if (measureStar(job, i, j, &star))
+                    job->stars.push_back(star);
+            }
+        }
+    }
+
+    return nullptr;
+
+}
+
+static void runJobs(std::vector<FocusJob> &jobs, void *(*worker)(void *)){
+
+    int nthreads = jobs.size();
+    std::vector<pthread_t> threads(nthreads);
+
+    // The calling thread takes the first share
+    int started = 1;
+
+    for (int t = 1; t < nthreads; t++) {
+
+        if (cpuWorkerCreate(&threads[t], worker, &jobs[t]) != 0)
+            break;
+
+        started++;
+    }
+
+    // Shares whose thread could not be started are done here
+    for (int t = started; t < nthreads; t++) {
+        worker(&jobs[t]);
+    }
+
+    worker(&jobs[0]);
+
+    for (int t = 1; t < started; t++) {
+        pthread_join(threads[t], nullptr);
+    }
+
+}
+
+static double median(std::vector<double> &values){
+
+    std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+
+    return values[values.size() / 2];
+
+}
+
+int focusMeasure(const unsigned short *image, int width, int x, int y, int w, int h, double sigma, int saturation,
+                 int maxstars, int nthreads, FocusResult *result){
+
+    result->stars = 0;
+    result->hfr   = 0;
+    result->fwhm  = 0;
+
+    int qw = w / 2;
+    int qh = h / 2;
+
+    if (qw <= 2 * FOCUS_RADIUS || qh <= 2 * FOCUS_RADIUS)
+        return 0;
+
+    if (nthreads < 1)
+        nthreads = 1;
+
+    std::vector<uint32_t> quads((long)qw * qh);
+    std::vector<FocusJob> jobs(nthreads);
+
+    for (int t = 0; t < nthreads; t++) {
+
+        jobs[t].image      = image;
+        jobs[t].width      = width;
+        jobs[t].x          = x;
+        jobs[t].y          = y;
+        jobs[t].saturation = saturation;
+        jobs[t].quads      = quads.data();
+        jobs[t].qw         = qw;
+        jobs[t].qh         = qh;
+        jobs[t].first      = t;
+        jobs[t].step       = nthreads;
+    }
+
+    runJobs(jobs, &quadWorker);
+
+    // ---------------------------------------------------------------------------
+    // Background and noise from a sparse sample of the quads. The odd step
+    // keeps the sample from lining up with rows.
+
+    long count = (long)qw * qh;
+    long step  = std::max(1L, count / FOCUS_SAMPLES) | 1;
+
+    std::vector<uint32_t> sample;
+    sample.reserve(count / step + 1);
+
+    for (long i = 0; i < count; i += step) {
+        sample.push_back(quads[i]);
+    }
+
+    std::nth_element(sample.begin(), sample.begin() + sample.size() / 2, sample.end());
+    double background = sample[sample.size() / 2];
+
+    for (size_t i = 0; i < sample.size(); i++) {
+        sample[i] = fabs(sample[i] - background);
+    }
+
+    std::nth_element(sample.begin(), sample.begin() + sample.size() / 2, sample.end());
+    double noise = std::max(1.0, 1.4826 * sample[sample.size() / 2]);
+
+    // ---------------------------------------------------------------------------
+    // Tile search
+
+    for (int t = 0; t < nthreads; t++) {
+
+        jobs[t].background = background;
+        jobs[t].noise      = noise;
+        jobs[t].threshold  = background + sigma * noise;
+    }
+
+    runJobs(jobs, &searchWorker);
+
+    std::vector<FocusStar> stars;
+
+    for (int t = 0; t < nthreads; t++) {
+        stars.insert(stars.end(), jobs[t].stars.begin(), jobs[t].stars.end());
+    }
+
+    if (stars.empty())
+        return 0;
+
+    // Brightest stars first, they measure best
+    std::sort(stars.begin(), stars.end(), [](const FocusStar &a, const FocusStar &b) { return a.flux > b.flux; });
+
+    if (maxstars > 0 && (int)stars.size() > maxstars)
+        stars.resize(maxstars);
+
+    std::vector<double> hfr, fwhm;
+
+    for (size_t i = 0; i < stars.size(); i++) {
+        hfr.push_back(stars[i].hfr);
+        fwhm.push_back(stars[i].fwhm);
+    }
+
+    result->stars = stars.size();
+    result->hfr   = median(hfr);
+    result->fwhm  = median(fwhm);
+
+    return result->stars;
+
+}
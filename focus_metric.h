@@ -0,0 +1,43 @@
+/*
+ Star detection and focus metrics
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#ifndef FOCUS_METRIC_H
+#define FOCUS_METRIC_H
+
+#define FOCUS_TILE   64     /* Tile size of the star search, in Bayer quads */
+#define FOCUS_RADIUS 8      /* Measuring radius around each star, in Bayer quads */
+
+struct FocusResult
+{
+    int stars;      // stars measured
+    double hfr;     // median half flux radius (px)
+    double fwhm;    // median full width at half maximum (px)
+};
+
+// Find stars in the region x, y, w, h of a Bayer frame and measure them.
+// The search runs on 2x2 quad sums, so the colour pattern does not matter,
+// and is split into tiles spread over nthreads threads. Stars are peaks more
+// than sigma times the background noise above the background. Peaks at or above
+// saturation are skipped. The brightest maxstars are kept.
+// Returns the number of stars measured.
+int focusMeasure(const unsigned short *image, int width, int x, int y, int w, int h, double sigma, int saturation,
+                 int maxstars, int nthreads, FocusResult *result);
+
+#endif // FOCUS_METRIC_H
@@ -0,0 +1,250 @@
+/*
+ Tiled frame pipeline
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#ifndef FRAME_PIPELINE_H
+#define FRAME_PIPELINE_H
+
+#include <algorithm>
+#include <stdint.h>
+
+#include "sensor_modes.h"
+
+// Unpacked pixels of one tile. With the raw, dark and sum rows of the same
+// tile that is under 256 KB, inside the L2 cache of every Pi.
+#define PIPELINE_TILE_BYTES 65536
+
+// One pass over rows [row_1, row_2) of a raw frame. The rows are taken a
+// tile at a time and every enabled stage runs on a tile before the next is
+// unpacked, so each raw, dark and sum byte comes from memory once per frame.
+// Rows are frame rows throughout.
+struct PipelineJob
+{
+    const unsigned char *raw;       // packed rows, the first is frame row rawRow
+    int rawRow;
+    unsigned short *image;          // unpacked rows are kept here, the first is frame row imageRow,
+    int imageRow;                   // or nullptr to unpack each tile into scratch
+    unsigned short *scratch;        // PIPELINE_TILE_BYTES
+    int row_1, row_2;
+
+    const unsigned short *dark;     // dark signal of one frame to subtract, whole frame, or nullptr
+    const uint32_t *defects;        // hot pixels as row * width + col, sorted, or nullptr
+    long defectCount;
+
+    unsigned short *sum;            // whole frame sums the frame is added to, or nullptr
+    uint32_t *histogram;            // 65536 bins counting the sums of columns [x_1, x_2) of
+    int x_1, x_2, y_1, y_2;         // rows [y_1, y_2), or nullptr
+};
+
+// -------------------------------------------------------------------------------------------
+// Stages. Each is given a tile holding frame rows [row_1, row_2).
+
+template <int BITS, int WIDTH, int STRIDE>
+struct UnpackStage
+{
+    static_assert(WIDTH % RawFormat<BITS>::PIXELS == 0, "width must be whole pixel groups");
+    static_assert(STRIDE >= WIDTH / RawFormat<BITS>::PIXELS * RawFormat<BITS>::BYTES, "stride too short");
+
+    static inline void run(const PipelineJob &job, unsigned short *tile, int row_1, int row_2)
+    {
+        for (int row = row_1; row < row_2; row++)
+        {
+            const unsigned char *p = job.raw + (long)(row - job.rawRow) * STRIDE;
+            unsigned short *o      = tile + (long)(row - row_1) * WIDTH;
+
+            for (int col = 0; col < WIDTH; col += RawFormat<BITS>::PIXELS)
+            {
+                RawFormat<BITS>::unpack(p, o + col);
+                p += RawFormat<BITS>::BYTES;
+            }
+        }
+    }
+};
+
+// The dark signal is above the black level, which stays in the frame
+template <int WIDTH>
+struct DarkStage
+{
+    static inline void run(const PipelineJob &job, unsigned short *tile, int row_1, int row_2)
+    {
+        const unsigned short *d = job.dark + (long)row_1 * WIDTH;
+        long count              = (long)(row_2 - row_1) * WIDTH;
+
+        for (long i = 0; i < count; i++)
+            tile[i] = tile[i] > d[i] ? tile[i] - d[i] : 0;
+    }
+};
+
+// A hot pixel takes the mean of the nearest pixels of its colour in the row,
+// so the tile needs no rows of its neighbours
+template <int WIDTH>
+struct DefectStage
+{
+    static_assert(WIDTH > 4, "row too short");
+
+    static inline void run(const PipelineJob &job, unsigned short *tile, int row_1, int row_2)
+    {
+        uint32_t first = (uint32_t)row_1 * WIDTH;
+        uint32_t last  = (uint32_t)row_2 * WIDTH;
+
+        const uint32_t *end = job.defects + job.defectCount;
+        const uint32_t *d   = std::lower_bound(job.defects, end, first);
+
+        for (; d < end && *d < last; d++)
+        {
+            long i  = *d - first;
+            int col = *d % WIDTH;
+
+            unsigned left  = tile[col >= 2 ? i - 2 : i + 2];
+            unsigned right = tile[col + 2 < WIDTH ? i + 2 : i - 2];
+
+            tile[i] = (left + right + 1) / 2;
+        }
+    }
+};
+
+template <int WIDTH>
+struct AccumulateStage
+{
+    static inline void run(const PipelineJob &job, unsigned short *tile, int row_1, int row_2)
+    {
+        unsigned short *dst = job.sum + (long)row_1 * WIDTH;
+        long count          = (long)(row_2 - row_1) * WIDTH;
+
+        for (long i = 0; i < count; i++)
+        {
+            uint32_t v = dst[i] + tile[i];
+            dst[i]     = v > 65535 ? 65535 : v;
+        }
+    }
+};
+
+// Follows AccumulateStage, counting the new sums while they are in cache
+template <int WIDTH>
+struct StatsStage
+{
+    static inline void run(const PipelineJob &job, unsigned short *, int row_1, int row_2)
+    {
+        int y_1 = std::max(job.y_1, row_1);
+        int y_2 = std::min(job.y_2, row_2);
+
+        for (int row = y_1; row < y_2; row++)
+        {
+            const unsigned short *src = job.sum + (long)row * WIDTH;
+
+            for (int col = job.x_1; col < job.x_2; col++)
+                job.histogram[src[col]]++;
+        }
+    }
+};
+
+struct NoStage
+{
+    static inline void run(const PipelineJob &, unsigned short *, int, int) {}
+};
+
+// -------------------------------------------------------------------------------------------
+// Composition. A pipeline is a list of stages fixed at compile time, so the
+// calls inline into one loop nest per combination and disabled stages cost
+// nothing.
+
+template <bool ENABLED, class STAGE>
+struct Optional
+{
+    typedef STAGE type;
+};
+
+template <class STAGE>
+struct Optional<false, STAGE>
+{
+    typedef NoStage type;
+};
+
+template <class... STAGES>
+struct Stages;
+
+template <>
+struct Stages<>
+{
+    static inline void run(const PipelineJob &, unsigned short *, int, int) {}
+};
+
+template <class FIRST, class... REST>
+struct Stages<FIRST, REST...>
+{
+    static inline void run(const PipelineJob &job, unsigned short *tile, int row_1, int row_2)
+    {
+        FIRST::run(job, tile, row_1, row_2);
+        Stages<REST...>::run(job, tile, row_1, row_2);
+    }
+};
+
+template <int BITS, int WIDTH, int STRIDE, bool DARK, bool DEFECTS, bool SUM, bool STATS>
+void pipelineTiles(const PipelineJob &job)
+{
+    typedef Stages<UnpackStage<BITS, WIDTH, STRIDE>, typename Optional<DARK, DarkStage<WIDTH>>::type,
+                   typename Optional<DEFECTS, DefectStage<WIDTH>>::type,
+                   typename Optional<SUM, AccumulateStage<WIDTH>>::type,
+                   typename Optional<STATS, StatsStage<WIDTH>>::type>
+        Pipeline;
+
+    enum { ROWS = PIPELINE_TILE_BYTES / (2 * WIDTH) > 0 ? PIPELINE_TILE_BYTES / (2 * WIDTH) : 1 };
+
+    for (int row = job.row_1; row < job.row_2; row += ROWS)
+    {
+        int end = std::min(row + (int)ROWS, job.row_2);
+
+        unsigned short *tile = job.image ? job.image + (long)(row - job.imageRow) * WIDTH : job.scratch;
+
+        Pipeline::run(job, tile, row, end);
+    }
+}
+
+// The stages of a job are picked once per call, from the pointers it sets
+
+template <int BITS, int WIDTH, int STRIDE, bool DARK, bool DEFECTS>
+void pipelineSum(const PipelineJob &job)
+{
+    if (!job.sum)
+        pipelineTiles<BITS, WIDTH, STRIDE, DARK, DEFECTS, false, false>(job);
+    else if (!job.histogram)
+        pipelineTiles<BITS, WIDTH, STRIDE, DARK, DEFECTS, true, false>(job);
+    else
+        pipelineTiles<BITS, WIDTH, STRIDE, DARK, DEFECTS, true, true>(job);
+}
+
+template <int BITS, int WIDTH, int STRIDE, bool DARK>
+void pipelineDefects(const PipelineJob &job)
+{
+    if (job.defects && job.defectCount > 0)
+        pipelineSum<BITS, WIDTH, STRIDE, DARK, true>(job);
+    else
+        pipelineSum<BITS, WIDTH, STRIDE, DARK, false>(job);
+}
+
+template <int BITS, int WIDTH, int STRIDE>
+void pipelineRows(const PipelineJob &job)
+{
+    if (job.dark)
+        pipelineDefects<BITS, WIDTH, STRIDE, true>(job);
+    else
+        pipelineDefects<BITS, WIDTH, STRIDE, false>(job);
+}
+
+#endif // FRAME_PIPELINE_H
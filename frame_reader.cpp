@@ -0,0 +1,297 @@
+/*
+ Capture thread reading the raw frames from raspiraw
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <algorithm>
+
+#include "frame_reader.h"
+#include "cpu_affinity.h"
+
+FrameReader::FrameReader()
+{
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&space, nullptr);
+
+    // Made once, so the driver can keep its callback across streams
+    notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+FrameReader::~FrameReader()
+{
+    close();
+
+    if (notify >= 0)
+        ::close(notify);
+
+    pthread_cond_destroy(&space);
+    pthread_mutex_destroy(&mutex);
+}
+
+int FrameReader::open(const char *command, size_t capacity)
+{
+    close();
+
+    int fds[2];
+
+    if (capacity == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (pipe2(fds, O_CLOEXEC) != 0)
+        return -1;
+
+    // A larger pipe takes a frame in fewer wakeups. Not fatal if refused.
+    fcntl(fds[0], F_SETPIPE_SZ, 1 << 20);
+
+    // Taken here, the child may only make async-signal-safe calls
+    cpu_set_t cpus;
+    cpuChildCpus(&cpus);
+
+    pid_t pid = fork();
+
+    if (pid < 0)
+    {
+        int e = errno;
+        ::close(fds[0]);
+        ::close(fds[1]);
+        errno = e;
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        // Not the CPUs or priority of whichever thread started it
+        cpuChildReset(&cpus);
+
+        // Its own process group, so close() stops the shell and the command
+        setpgid(0, 0);
+
+        dup2(fds[1], STDOUT_FILENO);
+        execl("/bin/sh", "sh", "-c", command, (char *)nullptr);
+        _exit(127);
+    }
+
+    // Also here, in case close() comes before the child has run
+    setpgid(pid, pid);
+
+    ::close(fds[1]);
+
+    if (ring.size() != capacity)
+    {
+        std::vector<unsigned char>(capacity).swap(ring);
+    }
+
+    head     = 0;
+    count    = 0;
+    eof      = false;
+    stopping = false;
+    child    = pid;
+    output   = fds[0];
+    wake     = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (wake < 0 || pthread_create(&thread, nullptr, &captureHelper, this) != 0)
+    {
+        int e = errno;
+
+        kill(-child, SIGTERM);
+        ::close(output);
+        waitpid(child, nullptr, 0);
+
+        if (wake >= 0)
+            ::close(wake);
+
+        child  = -1;
+        output = wake = -1;
+
+        errno = e;
+        return -1;
+    }
+
+    running = true;
+
+    return 0;
+}
+
+void FrameReader::close()
+{
+    if (!running)
+        return;
+
+    kill(-child, SIGTERM);
+
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&space);
+    pthread_mutex_unlock(&mutex);
+
+    uint64_t one = 1;
+    if (write(wake, &one, sizeof(one)) < 0) {
+    }
+
+    pthread_join(thread, nullptr);
+
+    // A command still writing ends on the closed pipe
+    ::close(output);
+    ::close(wake);
+    output = wake = -1;
+
+    waitpid(child, nullptr, 0);
+    child = -1;
+
+    running = false;
+    head    = 0;
+    count   = 0;
+    eof     = false;
+
+    // Arrivals of this stream are not reported to the next
+    uint64_t arrived;
+    if (::read(notify, &arrived, sizeof(arrived)) < 0) {
+    }
+}
+
+int FrameReader::applyRole(int role)
+{
+    return running ? cpuRoleApplyThread(thread, role) : 0;
+}
+
+size_t FrameReader::read(void *data, size_t size)
+{
+    pthread_mutex_lock(&mutex);
+    size_t start = head;
+    size_t n     = std::min(size, count);
+    pthread_mutex_unlock(&mutex);
+
+    if (n == 0)
+        return 0;
+
+    // The capture thread only writes the free part of the buffer, so the
+    // bytes waiting are copied without the lock
+    size_t first = std::min(n, ring.size() - start);
+
+    memcpy(data, &ring[start], first);
+    memcpy((unsigned char *)data + first, &ring[0], n - first);
+
+    pthread_mutex_lock(&mutex);
+    head   = (head + n) % ring.size();
+    count -= n;
+    pthread_cond_signal(&space);
+    pthread_mutex_unlock(&mutex);
+
+    return n;
+}
+
+size_t FrameReader::queued()
+{
+    pthread_mutex_lock(&mutex);
+    size_t n = count;
+    pthread_mutex_unlock(&mutex);
+
+    return n;
+}
+
+bool FrameReader::ended()
+{
+    pthread_mutex_lock(&mutex);
+    bool done = eof && count == 0;
+    pthread_mutex_unlock(&mutex);
+
+    return done;
+}
+
+void FrameReader::signal()
+{
+    uint64_t one = 1;
+    if (write(notify, &one, sizeof(one)) < 0) {
+    }
+}
+
+void *FrameReader::captureHelper(void *context)
+{
+    ((FrameReader *)context)->capture();
+    return nullptr;
+}
+
+void FrameReader::capture()
+{
+    struct pollfd fds[2] = { { output, POLLIN, 0 }, { wake, POLLIN, 0 } };
+
+    while (true)
+    {
+        pthread_mutex_lock(&mutex);
+
+        // While the buffer is full the pipe fills, then the command waits
+        while (!stopping && count == ring.size()) {
+            pthread_cond_wait(&space, &mutex);
+        }
+
+        if (stopping)
+        {
+            pthread_mutex_unlock(&mutex);
+            return;
+        }
+
+        size_t tail = (head + count) % ring.size();
+        size_t room = std::min(ring.size() - count, ring.size() - tail);
+
+        pthread_mutex_unlock(&mutex);
+
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents)
+            return;
+
+        // Into the free part of the buffer, which the event loop does not read
+        ssize_t n = ::read(output, &ring[tail], room);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            break;
+
+        pthread_mutex_lock(&mutex);
+        count += n;
+        pthread_mutex_unlock(&mutex);
+
+        signal();
+    }
+
+    // The command has ended or its pipe failed
+    pthread_mutex_lock(&mutex);
+    eof = true;
+    pthread_mutex_unlock(&mutex);
+
+    signal();
+}
@@ -0,0 +1,93 @@
+/*
+ Capture thread reading the raw frames from raspiraw
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#ifndef FRAME_READER_H
+#define FRAME_READER_H
+
+#include <vector>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Runs a command, such as raspiraw, with its output on a pipe. A capture
+// thread reads the pipe as data arrives into a buffer, which the event loop
+// takes from without blocking. Only the capture thread needs the CPUs and
+// priority of the capture role. The command starts with normal scheduling
+// and the CPUs the driver started with.
+class FrameReader
+{
+    public:
+
+    FrameReader();
+    ~FrameReader();
+
+    // Start command through /bin/sh, buffering up to capacity bytes of its
+    // output. When the buffer is full the capture thread stops reading, and
+    // the command waits on the pipe. Returns 0, or -1 with errno set.
+    int open(const char *command, size_t capacity);
+
+    // Stop the command and the capture thread. Output not read is dropped.
+    void close();
+
+    bool isOpen() const { return running; }
+
+    // Move the capture thread to the CPUs and scheduling of role. Returns 0,
+    // also when closed, or the error as cpuRoleApply.
+    int applyRole(int role);
+
+    // Copy up to size bytes of output. Returns the number copied, 0 when none are waiting.
+    size_t read(void *data, size_t size);
+
+    // Bytes waiting to be read
+    size_t queued();
+
+    // The command has closed its output, and all of it was read
+    bool ended();
+
+    // Readable when output arrived or ended. Read the counter, then the output.
+    int notifyFd() const { return notify; }
+
+    private:
+
+    static void *captureHelper(void *context);
+    void capture();
+
+    void signal();
+
+    std::vector<unsigned char> ring;
+    size_t head { 0 };      // first byte waiting
+    size_t count { 0 };     // bytes waiting
+    bool eof { false };
+
+    pid_t child { -1 };
+    int output { -1 };      // read end of the pipe from the command
+
+    pthread_t thread;
+    bool running { false };
+    bool stopping { false };
+
+    int wake { -1 };        // eventfd, stops the capture thread
+    int notify { -1 };      // eventfd, counts arrivals
+
+    pthread_mutex_t mutex;
+    pthread_cond_t space;   // the event loop read from a full buffer
+};
+
+#endif // FRAME_READER_H
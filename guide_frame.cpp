@@ -0,0 +1,156 @@
+/*
+ Compact 8 bit guide frames
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#include <algorithm>
+#include <string.h>
+#include <zlib.h>
+
+#include "guide_frame.h"
+
+static void putInt16(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void putInt32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) {
+        p[i] = v >> (8 * i);
+    }
+}
+
+void GuideFrameEncoder::reset()
+{
+    haveKey = false;
+}
+
+int GuideFrameEncoder::encode(const unsigned short *image, int width, int height, int x, int y, int binX, int binY,
+                              double exposure, bool delta, std::vector<unsigned char> &out)
+{
+    long count = (long)width * height;
+
+    if (count <= 0 || width > 65535 || height > 65535)
+        return -1;
+
+    bool key = !delta || !haveKey || sinceKey >= GUIDE_FRAME_KEY - 1 || width != previousWidth ||
+               height != previousHeight;
+
+    // ---------------------------------------------------------------------------
+    // Scale, from the pixel range of whole frames. Stars keep their shape as
+    // the mapping is linear, only the faint end of the range is lost.
+
+    if (key)
+    {
+        unsigned short lo = 65535, hi = 0;
+
+        for (long i = 0; i < count; i++) {
+            lo = std::min(lo, image[i]);
+            hi = std::max(hi, image[i]);
+        }
+
+        black = lo;
+        shift = 0;
+
+        while (((unsigned)(hi - lo) >> shift) > 255) {
+            shift++;
+        }
+    }
+
+    pixels.resize(count);
+
+    for (long i = 0; i < count; i++) {
+
+        unsigned v = image[i] > black ? (image[i] - black) >> shift : 0;
+        pixels[i]  = std::min(v, 255u);
+    }
+
+    // ---------------------------------------------------------------------------
+    // Pixels
+
+    uint8_t flags = 0;
+    const unsigned char *data = pixels.data();
+    std::vector<unsigned char> work;
+
+    if (delta)
+    {
+        flags |= GUIDE_FRAME_DEFLATE;
+
+        // A still sky differs little between frames, so the differences deflate well
+        if (!key)
+        {
+            flags |= GUIDE_FRAME_DELTA;
+            work.resize(count);
+
+            for (long i = 0; i < count; i++) {
+                work[i] = pixels[i] - previous[i];
+            }
+
+            data = work.data();
+        }
+    }
+
+    uLongf size = count;
+    std::vector<unsigned char> deflated;
+
+    if (flags & GUIDE_FRAME_DEFLATE)
+    {
+        size = compressBound(count);
+        deflated.resize(size);
+
+        if (compress2(deflated.data(), &size, data, count, Z_BEST_SPEED) != Z_OK)
+            return -1;
+
+        data = deflated.data();
+    }
+
+    // ---------------------------------------------------------------------------
+    // Header
+
+    out.resize(GUIDE_FRAME_HEADER + size);
+    unsigned char *h = out.data();
+
+    memset(h, 0, GUIDE_FRAME_HEADER);
+    memcpy(h, "PCG1", 4);
+    putInt16(h + 4, width);
+    putInt16(h + 6, height);
+    putInt16(h + 8, x);
+    putInt16(h + 10, y);
+    h[12] = binX;
+    h[13] = binY;
+    h[14] = flags;
+    h[15] = shift;
+    putInt16(h + 16, black);
+    putInt32(h + 20, ++sequence);
+    putInt32(h + 24, exposure * 1e6);
+    putInt32(h + 28, size);
+
+    memcpy(h + GUIDE_FRAME_HEADER, data, size);
+
+    // ---------------------------------------------------------------------------
+
+    previous.swap(pixels);
+    previousWidth  = width;
+    previousHeight = height;
+    haveKey        = true;
+    sinceKey       = key ? 0 : sinceKey + 1;
+
+    return 0;
+}
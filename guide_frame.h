@@ -0,0 +1,77 @@
+/*
+ Compact 8 bit guide frames
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#ifndef GUIDE_FRAME_H
+#define GUIDE_FRAME_H
+
+#include <vector>
+#include <stdint.h>
+
+#define GUIDE_FRAME_HEADER   32     /* Bytes of the header before the pixels */
+#define GUIDE_FRAME_KEY      10     /* Most frames between frames sent whole in delta mode */
+
+#define GUIDE_FRAME_DELTA    0x01   /* Pixels are differences from the previous frame, modulo 256 */
+#define GUIDE_FRAME_DEFLATE  0x02   /* Pixels are zlib compressed */
+
+// A frame is a header, all little endian, then width x height 8 bit pixels:
+//   0  "PCG1"
+//   4  uint16 width, uint16 height
+//   8  uint16 x, uint16 y          region origin on the sensor, unbinned pixels
+//  12  uint8 binX, uint8 binY
+//  14  uint8 flags                 GUIDE_FRAME_DELTA, GUIDE_FRAME_DEFLATE
+//  15  uint8 shift
+//  16  uint16 black, uint16 0
+//  20  uint32 sequence             counts every frame sent, a gap means a lost frame
+//  24  uint32 exposure (us)
+//  28  uint32 bytes of pixel data that follow
+// Pixel p stands for black + (p << shift) ADU. Undo the deflate, then add
+// each delta to the pixel of the previous frame. A delta frame can only be
+// decoded with its previous frame, so after a gap wait for a whole frame.
+// The scale only changes on whole frames.
+
+// Encodes the guide frames of one guide chip. Every GUIDE_FRAME_KEY frames,
+// and when the size changes, a whole frame is sent and the scale is found
+// again from the pixel range.
+class GuideFrameEncoder
+{
+    public:
+
+    // Encode a 16 bit frame of width x height pixels, which is the region x, y
+    // binned binX x binY. With delta, frames after the first are sent as
+    // differences from the previous one, deflated. Returns 0, or -1 on failure.
+    int encode(const unsigned short *image, int width, int height, int x, int y, int binX, int binY, double exposure,
+               bool delta, std::vector<unsigned char> &out);
+
+    // Make the next frame a whole frame
+    void reset();
+
+    private:
+
+    std::vector<unsigned char> previous;
+    std::vector<unsigned char> pixels;
+    int previousWidth { 0 }, previousHeight { 0 };
+    uint32_t sequence { 0 };
+    int sinceKey { 0 };
+    bool haveKey { false };
+    unsigned black { 0 };
+    int shift { 0 };
+};
+
+#endif // GUIDE_FRAME_H
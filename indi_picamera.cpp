@@ -21,16 +21,28 @@
  */
 
 #include <memory>
+#include <algorithm>
+#include <functional>
 #include <time.h>
 #include <math.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <errno.h>
 
 #include "config.h"
 #include "indidevapi.h"
 #include "eventloop.h"
 
 #include "indi_picamera.h"
+#include "fits_rice.h"
+#include "sensor_modes.h"
+#include "frame_pipeline.h"
+#include "debayer.h"
+#include "preview_image.h"
+#include "focus_metric.h"
+#include "ser_recorder.h"
+#include "cpu_affinity.h"
+#include "frame_reader.h"
 
 
 
@@ -42,6 +54,35 @@
 #define TEMP_THRESHOLD .25  /* Differential temperature threshold (C)*/
 #define MAX_DEVICES    20   /* Max device cameraCount */
 
+#define PROCESSING_TAB "Processing"
+#define GUIDE_STAR_TAB "Guide Star"
+#define PREVIEW_TAB    "Preview"
+#define DIAGNOSTICS_TAB "Diagnostics"
+#define STATISTICS_TAB "Statistics"
+#define FOCUS_TAB      "Focus"
+#define RECORDING_TAB  "Recording"
+#define EXPORT_TAB     "Shared Memory"
+#define GUIDE_PORT_TAB "Guide Port"
+
+#define LUCKY_POOL_MAX (128 * 1024 * 1024) /* Max bytes held by kept lucky frames */
+#define LIVE_POOL_MAX  (128 * 1024 * 1024) /* Max bytes held by the live stack window */
+
+#define EXPOSURE_DUTY  0.95 /* Exposure of each frame as a fraction of the frame period */
+#define SKY_MAX_FILL   0.25 /* Largest part of the pixel range the sky may fill in one sub */
+
+#define LOWMEM_ROWS    16   /* Raw rows staged at a time in low memory mode */
+
+#define STATS_BINS     16   /* Bins of the published histogram, from 0 to saturation */
+
+#define RECORD_DRAIN   16   /* Most frames read per timer tick while recording between exposures */
+
+#define CAPTURE_FRAMES 2    /* Raw frames the capture thread holds for the event loop */
+#define CAPTURE_LOWMEM (1 << 20) /* Bytes it holds in low memory mode */
+
+#define JITTER_FRAMES  30   /* Frames between diagnostics updates while streaming between exposures */
+
+#define PULSE_WARN     1.0  /* Guide pulse width error (ms) that is warned about */
+
 static int cameraCount;
 static PiCameraCCD *cameras[MAX_DEVICES];
 
@@ -53,6 +94,9 @@ static PiCameraCCD *cameras[MAX_DEVICES];
 static pthread_cond_t cv         = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t condMutex = PTHREAD_MUTEX_INITIALIZER;
 
+static pthread_cond_t finalizeCv         = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t finalizeMutex     = PTHREAD_MUTEX_INITIALIZER;
+
 // -------------------------------------------------------------------------------------------
 
 #include <memory>
@@ -63,27 +107,17 @@ static pthread_mutex_t condMutex = PTHREAD_MUTEX_INITIALIZER;
 #include <sstream>
 
 #include <fcntl.h>
+#include <sys/eventfd.h>
 
-#define HEADERSIZE 0    //32768
 #define IDSIZE 4    // number of bytes in raw header ID string
 
-//#define RAWBLOCKSIZE 6404096 on OV5647 sensor
-//#define ROWSIZE 3264 // number of bytes per row of pixels, including 24 'other' bytes at end (OV5647 sensor)
-//#define HPIXELS 2592   // number of horizontal pixels on OV5647 sensor
-//#define VPIXELS 1944   // number of vertical pixels on OV5647 sensor
-
-#define RAWBLOCKSIZE 10171392   //10270208   // IMX219 sensor
-#define ROWSIZE 4128    // (IMX219 sensor)
-#define HPIXELS 3280   // number of horizontal pixels on IMX219 sensor
-#define VPIXELS 2464  // number of vertical pixels on IMX219 sensor
+// Frame geometry, raw block size and row stride of each sensor mode are in sensor_modes.cpp
 
 int file_length;
 
 int framecount;
 int numOfFrames;
 
-FILE *imageFileStreamPipe;
-
 const char* cmd = "cat /home/jdhill/Development/rawtest/image_s25000_a16_d2.jpg";
 
 int fullframe = 1;
@@ -269,9 +303,305 @@ bool PiCameraCCD::initProperties()
     // Most cameras have this by default, so let's set it as default.
     IUSaveText(&BayerT[2], "BGGR");
 
-    uint32_t cap = CCD_CAN_ABORT | CCD_CAN_BIN | CCD_CAN_SUBFRAME | CCD_HAS_BAYER /*| CCD_HAS_GUIDE_HEAD | CCD_HAS_STREAMING | CCD_HAS_COOLER | CCD_HAS_SHUTTER | CCD_HAS_ST4_PORT*/;
+    // Sensor mode, chosen before connecting
+    SensorS.resize(sensorModeCount);
+    for (int i = 0; i < sensorModeCount; i++)
+    {
+        IUFillSwitch(&SensorS[i], sensorModes[i].name, sensorModes[i].label, i == 0 ? ISS_ON : ISS_OFF);
+    }
+    IUFillSwitchVector(&SensorSP, SensorS.data(), sensorModeCount, getDeviceName(), "SENSOR_MODE", "Sensor Mode",
+                       MAIN_CONTROL_TAB, IP_RW, ISR_1OFMANY, 60, IPS_IDLE);
+
+    // Sensor start up
+    IUFillText(&SensorStateT[0], "SENSOR_STATE_VALUE", "State", "Off");
+    IUFillTextVector(&SensorStateTP, SensorStateT, 1, getDeviceName(), "SENSOR_STATE", "Sensor", MAIN_CONTROL_TAB,
+                     IP_RO, 60, IPS_IDLE);
+
+    // Low memory streaming, chosen before connecting
+    IUFillSwitch(&LowMemoryS[0], "LOW_MEMORY_ON", "On", ISS_OFF);
+    IUFillSwitch(&LowMemoryS[1], "LOW_MEMORY_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&LowMemorySP, LowMemoryS, 2, getDeviceName(), "LOW_MEMORY", "Low Memory", OPTIONS_TAB, IP_RW,
+                       ISR_1OFMANY, 60, IPS_IDLE);
+
+    // Diagnostics
+    IUFillNumber(&DiagnosticsN[DIAG_RSS], "DIAG_RSS", "Memory (MB)", "%.1f", 0, 1e6, 0, 0);
+    IUFillNumber(&DiagnosticsN[DIAG_PEAK_RSS], "DIAG_PEAK_RSS", "Peak memory (MB)", "%.1f", 0, 1e6, 0, 0);
+    IUFillNumber(&DiagnosticsN[DIAG_JITTER_RMS], "DIAG_JITTER_RMS", "Frame jitter RMS (ms)", "%.1f", 0, 1e6, 0, 0);
+    IUFillNumber(&DiagnosticsN[DIAG_JITTER_MAX], "DIAG_JITTER_MAX", "Frame jitter max (ms)", "%.1f", 0, 1e6, 0, 0);
+    IUFillNumber(&DiagnosticsN[DIAG_BACKLOG], "DIAG_BACKLOG", "Pipe backlog max (frames)", "%.2f", 0, 1e6, 0, 0);
+    IUFillNumberVector(&DiagnosticsNP, DiagnosticsN, 5, getDeviceName(), "DIAGNOSTICS", "Diagnostics", DIAGNOSTICS_TAB,
+                       IP_RO, 60, IPS_IDLE);
+
+    // Thread CPUs, e.g. "3" or "0-2", empty for all
+    IUFillText(&CpusT[CPUS_CAPTURE], "CPUS_CAPTURE", "Capture", "");
+    IUFillText(&CpusT[CPUS_WORKERS], "CPUS_WORKERS", "Processing", "");
+    IUFillText(&CpusT[CPUS_ENCODER], "CPUS_ENCODER", "Encoder", "");
+    IUFillTextVector(&CpusTP, CpusT, 3, getDeviceName(), "THREAD_CPUS", "Thread CPUs", OPTIONS_TAB, IP_RW, 60,
+                     IPS_IDLE);
+
+    IUFillNumber(&CapturePriorityN[0], "CAPTURE_FIFO", "SCHED_FIFO (0 off)", "%.f", 0, 99, 1, 0);
+    IUFillNumberVector(&CapturePriorityNP, CapturePriorityN, 1, getDeviceName(), "CAPTURE_PRIORITY", "Capture Priority",
+                       OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+    // Exposure timing
+    IUFillNumber(&TimingN[TIMING_STARTUP], "TIMING_STARTUP", "Stream start (s)", "%.3f", 0, 1e6, 0, 0);
+    IUFillNumber(&TimingN[TIMING_INTEGRATION], "TIMING_INTEGRATION", "Integration (s)", "%.3f", 0, 1e6, 0, 0);
+    IUFillNumber(&TimingN[TIMING_FINALIZE], "TIMING_FINALIZE", "Finalize (s)", "%.3f", 0, 1e6, 0, 0);
+    IUFillNumber(&TimingN[TIMING_SEND], "TIMING_SEND", "Send (s)", "%.3f", 0, 1e6, 0, 0);
+    IUFillNumber(&TimingN[TIMING_TOTAL], "TIMING_TOTAL", "Total (s)", "%.3f", 0, 1e6, 0, 0);
+    IUFillNumberVector(&TimingNP, TimingN, 5, getDeviceName(), "EXPOSURE_TIMING", "Exposure Timing", DIAGNOSTICS_TAB,
+                       IP_RO, 60, IPS_IDLE);
+
+    // Image statistics
+    IUFillNumber(&StatsN[STATS_MIN], "STATS_MIN", "Min (ADU)", "%.f", 0, 65535, 0, 0);
+    IUFillNumber(&StatsN[STATS_MAX], "STATS_MAX", "Max (ADU)", "%.f", 0, 65535, 0, 0);
+    IUFillNumber(&StatsN[STATS_MEAN], "STATS_MEAN", "Mean (ADU)", "%.1f", 0, 65535, 0, 0);
+    IUFillNumber(&StatsN[STATS_MEDIAN], "STATS_MEDIAN", "Median (ADU)", "%.f", 0, 65535, 0, 0);
+    IUFillNumber(&StatsN[STATS_STDDEV], "STATS_STDDEV", "Std dev (ADU)", "%.1f", 0, 65535, 0, 0);
+    IUFillNumber(&StatsN[STATS_SATURATED], "STATS_SATURATED", "Saturated (px)", "%.f", 0, 1e9, 0, 0);
+    IUFillNumber(&StatsN[STATS_SATURATED_PCT], "STATS_SATURATED_PCT", "Saturated (%)", "%.3f", 0, 100, 0, 0);
+    IUFillNumberVector(&StatsNP, StatsN, 7, getDeviceName(), "IMAGE_STATISTICS", "Statistics", STATISTICS_TAB, IP_RO, 60,
+                       IPS_IDLE);
+
+    for (int i = 0; i < STATS_BINS; i++)
+    {
+        char binName[MAXINDINAME], binLabel[MAXINDILABEL];
+        snprintf(binName, MAXINDINAME, "HIST_%02d", i + 1);
+        snprintf(binLabel, MAXINDILABEL, "%.0f-%.0f%% of full", 100.0 * i / STATS_BINS, 100.0 * (i + 1) / STATS_BINS);
+        IUFillNumber(&HistogramN[i], binName, binLabel, "%.2f", 0, 100, 0, 0);
+    }
+    IUFillNumberVector(&HistogramNP, HistogramN, STATS_BINS, getDeviceName(), "IMAGE_HISTOGRAM", "Histogram (% of px)",
+                       STATISTICS_TAB, IP_RO, 60, IPS_IDLE);
+
+    uint32_t cap = CCD_CAN_ABORT | CCD_CAN_BIN | CCD_CAN_SUBFRAME | CCD_HAS_BAYER | CCD_HAS_GUIDE_HEAD | CCD_HAS_ST4_PORT /*| CCD_HAS_STREAMING | CCD_HAS_COOLER | CCD_HAS_SHUTTER*/;
     SetCCDCapability(cap);
 
+    // Lucky imaging
+    IUFillSwitch(&LuckyS[0], "LUCKY_ON", "On", ISS_OFF);
+    IUFillSwitch(&LuckyS[1], "LUCKY_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&LuckySP, LuckyS, 2, getDeviceName(), "LUCKY_IMAGING", "Lucky Imaging", PROCESSING_TAB, IP_RW,
+                       ISR_1OFMANY, 60, IPS_IDLE);
+
+    IUFillNumber(&LuckyN[LUCKY_KEEP], "LUCKY_KEEP", "Keep best (frames)", "%.f", 1, 1000, 1, 10);
+    IUFillNumber(&LuckyN[LUCKY_WINDOW], "LUCKY_WINDOW", "Score window (px)", "%.f", 32, 1024, 32, 256);
+    IUFillNumberVector(&LuckyNP, LuckyN, 2, getDeviceName(), "LUCKY_SETTINGS", "Lucky Settings", PROCESSING_TAB, IP_RW,
+                       60, IPS_IDLE);
+
+    // Calibration
+    IUFillSwitch(&CalibrationS[CALIBRATION_DARK], "CALIBRATION_DARK", "Subtract dark", ISS_OFF);
+    IUFillSwitch(&CalibrationS[CALIBRATION_DEFECTS], "CALIBRATION_DEFECTS", "Fix hot pixels", ISS_OFF);
+    IUFillSwitchVector(&CalibrationSP, CalibrationS, 2, getDeviceName(), "CALIBRATION", "Calibration", PROCESSING_TAB,
+                       IP_RW, ISR_NOFMANY, 60, IPS_IDLE);
+
+    IUFillText(&CalibrationT[0], "MASTER_DARK", "Master dark", "");
+    IUFillTextVector(&CalibrationTP, CalibrationT, 1, getDeviceName(), "CALIBRATION_FILE", "Calibration File",
+                     PROCESSING_TAB, IP_RW, 60, IPS_IDLE);
+
+    IUFillNumber(&CalibrationN[0], "HOT_LEVEL", "Hot pixel (ADU over median)", "%.f", 1, 4095, 1, 100);
+    IUFillNumberVector(&CalibrationNP, CalibrationN, 1, getDeviceName(), "CALIBRATION_SETTINGS", "Calibration Settings",
+                       PROCESSING_TAB, IP_RW, 60, IPS_IDLE);
+
+    // Guide star centroiding
+    IUFillSwitch(&GuideCentroidS[0], "GUIDE_CENTROID_ON", "On", ISS_OFF);
+    IUFillSwitch(&GuideCentroidS[1], "GUIDE_CENTROID_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&GuideCentroidSP, GuideCentroidS, 2, getDeviceName(), "GUIDE_CENTROID", "Track Star", GUIDE_STAR_TAB,
+                       IP_RW, ISR_1OFMANY, 60, IPS_IDLE);
+
+    IUFillNumber(&GuideCentroidN[GUIDE_WINDOW], "GUIDE_WINDOW", "Window (px)", "%.f", 8, 128, 2, 32);
+    IUFillNumber(&GuideCentroidN[GUIDE_MIN_SNR], "GUIDE_MIN_SNR", "Min SNR", "%.1f", 1, 100, 1, 6);
+    IUFillNumberVector(&GuideCentroidNP, GuideCentroidN, 2, getDeviceName(), "GUIDE_CENTROID_SETTINGS", "Settings",
+                       GUIDE_STAR_TAB, IP_RW, 60, IPS_IDLE);
+
+    IUFillNumber(&GuideStarN[GUIDE_STAR_X], "GUIDE_STAR_X", "X (px)", "%.2f", 0, MAX_PIXELS, 0, 0);
+    IUFillNumber(&GuideStarN[GUIDE_STAR_Y], "GUIDE_STAR_Y", "Y (px)", "%.2f", 0, MAX_PIXELS, 0, 0);
+    IUFillNumber(&GuideStarN[GUIDE_STAR_SNR], "GUIDE_STAR_SNR", "SNR", "%.1f", 0, 100000, 0, 0);
+    IUFillNumber(&GuideStarN[GUIDE_STAR_HFR], "GUIDE_STAR_HFR", "HFR (px)", "%.2f", 0, 128, 0, 0);
+    IUFillNumber(&GuideStarN[GUIDE_STAR_FLUX], "GUIDE_STAR_FLUX", "Flux (ADU)", "%.f", 0, 1e9, 0, 0);
+    IUFillNumberVector(&GuideStarNP, GuideStarN, 5, getDeviceName(), "GUIDE_STAR", "Guide Star", GUIDE_STAR_TAB, IP_RO,
+                       60, IPS_IDLE);
+
+    // Guide head frames
+    IUFillSwitch(&GuideFormatS[GUIDE_FORMAT_FITS], "GUIDE_FORMAT_FITS", "FITS", ISS_ON);
+    IUFillSwitch(&GuideFormatS[GUIDE_FORMAT_COMPACT], "GUIDE_FORMAT_COMPACT", "8 bit", ISS_OFF);
+    IUFillSwitch(&GuideFormatS[GUIDE_FORMAT_DELTA], "GUIDE_FORMAT_DELTA", "8 bit delta", ISS_OFF);
+    IUFillSwitchVector(&GuideFormatSP, GuideFormatS, 3, getDeviceName(), "GUIDE_FRAME_FORMAT", "Guide Frames",
+                       GUIDE_STAR_TAB, IP_RW, ISR_1OFMANY, 60, IPS_IDLE);
+
+    IUFillBLOB(&GuideCompactB[0], "GUIDE_COMPACT_FRAME", "Frame", "");
+    IUFillBLOBVector(&GuideCompactBP, GuideCompactB, 1, getDeviceName(), "CCD_GUIDE_COMPACT", "Compact Guide Frame",
+                     GUIDE_STAR_TAB, IP_RO, 60, IPS_IDLE);
+
+    // ST-4 guide port
+    IUFillText(&GpioT[0], "GPIO_CHIP", "Chip", "gpiochip0");
+    IUFillTextVector(&GpioTP, GpioT, 1, getDeviceName(), "GUIDE_PORT_CHIP", "GPIO Chip", GUIDE_PORT_TAB, IP_RW, 60,
+                     IPS_IDLE);
+
+    IUFillNumber(&GpioN[GPIO_NORTH], "GPIO_NORTH", "North line", "%.f", 0, 511, 1, 17);
+    IUFillNumber(&GpioN[GPIO_SOUTH], "GPIO_SOUTH", "South line", "%.f", 0, 511, 1, 18);
+    IUFillNumber(&GpioN[GPIO_EAST], "GPIO_EAST", "East line", "%.f", 0, 511, 1, 27);
+    IUFillNumber(&GpioN[GPIO_WEST], "GPIO_WEST", "West line", "%.f", 0, 511, 1, 22);
+    IUFillNumberVector(&GpioNP, GpioN, 4, getDeviceName(), "GUIDE_PORT_LINES", "GPIO Lines", GUIDE_PORT_TAB, IP_RW,
+                       60, IPS_IDLE);
+
+    IUFillSwitch(&GpioActiveS[0], "GPIO_ACTIVE_HIGH", "High", ISS_ON);
+    IUFillSwitch(&GpioActiveS[1], "GPIO_ACTIVE_LOW", "Low", ISS_OFF);
+    IUFillSwitchVector(&GpioActiveSP, GpioActiveS, 2, getDeviceName(), "GUIDE_PORT_ACTIVE", "Active", GUIDE_PORT_TAB,
+                       IP_RW, ISR_1OFMANY, 60, IPS_IDLE);
+
+    IUFillNumber(&PulseN[PULSE_LAST], "PULSE_LAST", "Last error (ms)", "%.3f", -1e6, 1e6, 0, 0);
+    IUFillNumber(&PulseN[PULSE_RMS], "PULSE_RMS", "RMS error (ms)", "%.3f", 0, 1e6, 0, 0);
+    IUFillNumber(&PulseN[PULSE_MAX], "PULSE_MAX", "Max error (ms)", "%.3f", 0, 1e6, 0, 0);
+    IUFillNumber(&PulseN[PULSE_COUNT], "PULSE_COUNT", "Pulses", "%.f", 0, 1e12, 0, 0);
+    IUFillNumberVector(&PulseNP, PulseN, 4, getDeviceName(), "GUIDE_PULSE_ERROR", "Pulse Width", GUIDE_PORT_TAB, IP_RO,
+                       60, IPS_IDLE);
+
+    // Stays registered, pulses end on the scheduler thread
+    if (guider.notifyFd() >= 0)
+    {
+        IEAddCallback(guider.notifyFd(), &guidePulseHelper, this);
+    }
+
+    // Focus metric
+    IUFillSwitch(&FocusS[0], "FOCUS_METRIC_ON", "On", ISS_OFF);
+    IUFillSwitch(&FocusS[1], "FOCUS_METRIC_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&FocusSP, FocusS, 2, getDeviceName(), "FOCUS_METRIC", "Focus Metric", FOCUS_TAB, IP_RW, ISR_1OFMANY,
+                       60, IPS_IDLE);
+
+    IUFillNumber(&FocusN[FOCUS_SIGMA], "FOCUS_SIGMA", "Detection (sigma)", "%.1f", 2, 50, 0.5, 5);
+    IUFillNumber(&FocusN[FOCUS_MAX_STARS], "FOCUS_MAX_STARS", "Max stars", "%.f", 1, 1000, 1, 50);
+    IUFillNumberVector(&FocusNP, FocusN, 2, getDeviceName(), "FOCUS_METRIC_SETTINGS", "Settings", FOCUS_TAB, IP_RW, 60,
+                       IPS_IDLE);
+
+    IUFillNumber(&FocusValuesN[FOCUS_HFR], "FOCUS_HFR", "HFR (px)", "%.2f", 0, 100, 0, 0);
+    IUFillNumber(&FocusValuesN[FOCUS_FWHM], "FOCUS_FWHM", "FWHM (px)", "%.2f", 0, 100, 0, 0);
+    IUFillNumber(&FocusValuesN[FOCUS_STARS], "FOCUS_STARS", "Stars", "%.f", 0, 1e6, 0, 0);
+    IUFillNumber(&FocusValuesN[FOCUS_FRAME], "FOCUS_FRAME", "Frame", "%.f", 0, 1e9, 0, 0);
+    IUFillNumberVector(&FocusValuesNP, FocusValuesN, 4, getDeviceName(), "FOCUS_METRIC_VALUES", "Focus", FOCUS_TAB, IP_RO,
+                       60, IPS_IDLE);
+
+    // SER recording
+    IUFillSwitch(&RecordS[0], "SER_RECORD_ON", "On", ISS_OFF);
+    IUFillSwitch(&RecordS[1], "SER_RECORD_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&RecordSP, RecordS, 2, getDeviceName(), "SER_RECORD", "Record SER", RECORDING_TAB, IP_RW,
+                       ISR_1OFMANY, 60, IPS_IDLE);
+
+    IUFillSwitch(&RecordDepthS[0], "SER_DEPTH_8", "8 bit", ISS_OFF);
+    IUFillSwitch(&RecordDepthS[1], "SER_DEPTH_16", "16 bit", ISS_ON);
+    IUFillSwitchVector(&RecordDepthSP, RecordDepthS, 2, getDeviceName(), "SER_DEPTH", "Depth", RECORDING_TAB, IP_RW,
+                       ISR_1OFMANY, 60, IPS_IDLE);
+
+    IUFillText(&RecordT[0], "SER_DIR", "Directory", getenv("HOME") ? getenv("HOME") : "/tmp");
+    IUFillText(&RecordT[1], "SER_PREFIX", "Prefix", "picamera");
+    IUFillTextVector(&RecordTP, RecordT, 2, getDeviceName(), "SER_FILE", "File", RECORDING_TAB, IP_RW, 60, IPS_IDLE);
+
+    IUFillNumber(&RecordN[RECORD_FRAMES], "SER_FRAMES", "Frames", "%.f", 0, 1e9, 0, 0);
+    IUFillNumber(&RecordN[RECORD_DROPPED], "SER_DROPPED", "Dropped", "%.f", 0, 1e9, 0, 0);
+    IUFillNumber(&RecordN[RECORD_SIZE], "SER_SIZE", "Size (MB)", "%.1f", 0, 1e9, 0, 0);
+    IUFillNumber(&RecordN[RECORD_RATE], "SER_RATE", "Rate (fps)", "%.2f", 0, 1e6, 0, 0);
+    IUFillNumberVector(&RecordNP, RecordN, 4, getDeviceName(), "SER_STATUS", "Status", RECORDING_TAB, IP_RO, 60,
+                       IPS_IDLE);
+
+    // Shared memory export
+    IUFillSwitch(&ShmS[SHM_OFF], "SHM_EXPORT_OFF", "Off", ISS_ON);
+    IUFillSwitch(&ShmS[SHM_FRAMES], "SHM_EXPORT_FRAMES", "Frames", ISS_OFF);
+    IUFillSwitch(&ShmS[SHM_IMAGES], "SHM_EXPORT_IMAGES", "Images", ISS_OFF);
+    IUFillSwitchVector(&ShmSP, ShmS, 3, getDeviceName(), "SHM_EXPORT", "Export", EXPORT_TAB, IP_RW, ISR_1OFMANY, 60,
+                       IPS_IDLE);
+
+    IUFillText(&ShmT[0], "SHM_NAME", "Name", "/indi_picamera");
+    IUFillTextVector(&ShmTP, ShmT, 1, getDeviceName(), "SHM_SETTINGS", "Shared Memory", EXPORT_TAB, IP_RW, 60, IPS_IDLE);
+
+    IUFillNumber(&ShmN[0], "SHM_SLOTS", "Slots", "%.f", 2, 64, 1, 4);
+    IUFillNumberVector(&ShmNP, ShmN, 1, getDeviceName(), "SHM_RING", "Ring", EXPORT_TAB, IP_RW, 60, IPS_IDLE);
+
+    IUFillNumber(&ShmStatusN[0], "SHM_PUBLISHED", "Published", "%.f", 0, 1e12, 0, 0);
+    IUFillNumberVector(&ShmStatusNP, ShmStatusN, 1, getDeviceName(), "SHM_STATUS", "Status", EXPORT_TAB, IP_RO, 60,
+                       IPS_IDLE);
+
+    // Tile compressed FITS
+    IUFillSwitch(&RiceS[0], "RICE_ON", "On", ISS_OFF);
+    IUFillSwitch(&RiceS[1], "RICE_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&RiceSP, RiceS, 2, getDeviceName(), "RICE_COMPRESSION", "Rice FITS", OPTIONS_TAB, IP_RW,
+                       ISR_1OFMANY, 60, IPS_IDLE);
+
+    // Demosaicing
+    IUFillSwitch(&DebayerS[0], "DEBAYER_OFF", "Off", ISS_ON);
+    IUFillSwitch(&DebayerS[1], "DEBAYER_BILINEAR", "Bilinear", ISS_OFF);
+    IUFillSwitch(&DebayerS[2], "DEBAYER_EDGE", "Edge aware", ISS_OFF);
+    IUFillSwitchVector(&DebayerSP, DebayerS, 3, getDeviceName(), "DEBAYER", "Debayer", PROCESSING_TAB, IP_RW, ISR_1OFMANY,
+                       60, IPS_IDLE);
+
+    // Colour binning
+    IUFillSwitch(&CfaBinS[CFA_BIN_OFF], "CFA_BIN_OFF", "Off", ISS_ON);
+    IUFillSwitch(&CfaBinS[CFA_BIN_SAME], "CFA_BIN_SAME", "Same colour", ISS_OFF);
+    IUFillSwitch(&CfaBinS[CFA_BIN_SUPERPIXEL], "CFA_BIN_SUPERPIXEL", "Superpixel RGB", ISS_OFF);
+    IUFillSwitchVector(&CfaBinSP, CfaBinS, 3, getDeviceName(), "CFA_BINNING", "Colour Binning", PROCESSING_TAB, IP_RW,
+                       ISR_1OFMANY, 60, IPS_IDLE);
+
+    // Progressive preview
+    IUFillSwitch(&PreviewS[0], "PREVIEW_ON", "On", ISS_OFF);
+    IUFillSwitch(&PreviewS[1], "PREVIEW_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&PreviewSP, PreviewS, 2, getDeviceName(), "PREVIEW", "Preview", PREVIEW_TAB, IP_RW, ISR_1OFMANY, 60,
+                       IPS_IDLE);
+
+    IUFillNumber(&PreviewN[PREVIEW_FRAMES], "PREVIEW_FRAMES", "Every (frames)", "%.f", 0, 3600, 1, 10);
+    IUFillNumber(&PreviewN[PREVIEW_SECONDS], "PREVIEW_SECONDS", "Every (s)", "%.f", 0, 3600, 1, 0);
+    IUFillNumber(&PreviewN[PREVIEW_WIDTH], "PREVIEW_WIDTH", "Width (px)", "%.f", 64, 1640, 16, 640);
+    IUFillNumberVector(&PreviewNP, PreviewN, 3, getDeviceName(), "PREVIEW_SETTINGS", "Settings", PREVIEW_TAB, IP_RW, 60,
+                       IPS_IDLE);
+
+    IUFillSwitch(&FinalPreviewS[FINAL_PREVIEW_OFF], "FINAL_PREVIEW_OFF", "Off", ISS_ON);
+    IUFillSwitch(&FinalPreviewS[FINAL_PREVIEW_WITH_FITS], "FINAL_PREVIEW_WITH_FITS", "PNG with FITS", ISS_OFF);
+    IUFillSwitch(&FinalPreviewS[FINAL_PREVIEW_ONLY], "FINAL_PREVIEW_ONLY", "PNG only", ISS_OFF);
+    IUFillSwitchVector(&FinalPreviewSP, FinalPreviewS, 3, getDeviceName(), "FINAL_PREVIEW", "Final Image", PREVIEW_TAB,
+                       IP_RW, ISR_1OFMANY, 60, IPS_IDLE);
+
+    IUFillBLOB(&PreviewB[0], "PREVIEW_IMAGE", "Image", "");
+    IUFillBLOBVector(&PreviewBP, PreviewB, 1, getDeviceName(), "CCD_PREVIEW", "Preview", PREVIEW_TAB, IP_RO, 60, IPS_IDLE);
+
+    // Live stacking
+    IUFillSwitch(&LiveStackS[0], "LIVE_STACK_ON", "On", ISS_OFF);
+    IUFillSwitch(&LiveStackS[1], "LIVE_STACK_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&LiveStackSP, LiveStackS, 2, getDeviceName(), "LIVE_STACK", "Live Stack", PREVIEW_TAB, IP_RW,
+                       ISR_1OFMANY, 60, IPS_IDLE);
+
+    IUFillSwitch(&LiveModeS[LIVE_SUM], "LIVE_STACK_SUM", "Sum", ISS_OFF);
+    IUFillSwitch(&LiveModeS[LIVE_MEAN], "LIVE_STACK_MEAN", "Mean", ISS_ON);
+    IUFillSwitchVector(&LiveModeSP, LiveModeS, 2, getDeviceName(), "LIVE_STACK_MODE", "Stack", PREVIEW_TAB, IP_RW,
+                       ISR_1OFMANY, 60, IPS_IDLE);
+
+    IUFillNumber(&LiveStackN[LIVE_WINDOW], "LIVE_WINDOW", "Last (frames)", "%.f", 1, 256, 1, 10);
+    IUFillNumber(&LiveStackN[LIVE_EVERY], "LIVE_EVERY", "Send every (frames)", "%.f", 1, 3600, 1, 1);
+    IUFillNumberVector(&LiveStackNP, LiveStackN, 2, getDeviceName(), "LIVE_STACK_SETTINGS", "Live Settings", PREVIEW_TAB,
+                       IP_RW, 60, IPS_IDLE);
+
+    IUFillBLOB(&LiveB[0], "LIVE_STACK_IMAGE", "Image", "");
+    IUFillBLOBVector(&LiveBP, LiveB, 1, getDeviceName(), "CCD_LIVE_STACK", "Live Stack", PREVIEW_TAB, IP_RO, 60, IPS_IDLE);
+
+    // Back to back sequences
+    IUFillSwitch(&SequenceS[0], "SEQUENCE_ON", "On", ISS_OFF);
+    IUFillSwitch(&SequenceS[1], "SEQUENCE_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&SequenceSP, SequenceS, 2, getDeviceName(), "SEQUENCE_MODE", "Gapless Sequence", OPTIONS_TAB, IP_RW,
+                       ISR_1OFMANY, 60, IPS_IDLE);
+
+    // Sub-exposure planner
+    IUFillSwitch(&SubPlanS[0], "SUB_PLANNER_ON", "On", ISS_OFF);
+    IUFillSwitch(&SubPlanS[1], "SUB_PLANNER_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&SubPlanSP, SubPlanS, 2, getDeviceName(), "SUB_PLANNER", "Sub Planner", PROCESSING_TAB, IP_RW,
+                       ISR_1OFMANY, 60, IPS_IDLE);
+
+    IUFillNumber(&SubPlanN[PLAN_READ_NOISE], "PLAN_READ_NOISE", "Read noise (e-)", "%.2f", 0.1, 100, 0.1, 1.5);
+    IUFillNumber(&SubPlanN[PLAN_TOLERANCE], "PLAN_TOLERANCE", "Noise increase (%)", "%.f", 1, 50, 1, 5);
+    IUFillNumber(&SubPlanN[PLAN_MIN_SUB], "PLAN_MIN_SUB", "Min sub (s)", "%.1f", 1, 60, 0.5, 1);
+    IUFillNumber(&SubPlanN[PLAN_MAX_SUB], "PLAN_MAX_SUB", "Max sub (s)", "%.1f", 1, 60, 0.5, 10);
+    IUFillNumberVector(&SubPlanNP, SubPlanN, 4, getDeviceName(), "SUB_PLANNER_SETTINGS", "Planner Settings",
+                       PROCESSING_TAB, IP_RW, 60, IPS_IDLE);
+
+    IUFillNumber(&PlanN[PLAN_SKY_RATE], "PLAN_SKY_RATE", "Sky (ADU/s)", "%.2f", 0, 1e6, 0, 0);
+    IUFillNumber(&PlanN[PLAN_SUB], "PLAN_SUB", "Sub (s)", "%.2f", 0, 3600, 0, 1);
+    IUFillNumber(&PlanN[PLAN_FRAMES], "PLAN_FRAMES", "Frames", "%.f", 0, 1e6, 0, 0);
+    IUFillNumberVector(&PlanNP, PlanN, 3, getDeviceName(), "SUB_PLAN", "Sub Plan", PROCESSING_TAB, IP_RO, 60, IPS_IDLE);
+
     addConfigurationControl();
     addDebugControl();
     return true;
@@ -280,6 +610,12 @@ bool PiCameraCCD::initProperties()
 void PiCameraCCD::ISGetProperties(const char *dev)
 {
     INDI::CCD::ISGetProperties(dev);
+
+    defineSwitch(&SensorSP);
+    loadConfig(true, SensorSP.name);
+
+    defineSwitch(&LowMemorySP);
+    loadConfig(true, LowMemorySP.name);
 }
 
 bool PiCameraCCD::updateProperties()
@@ -291,937 +627,4566 @@ bool PiCameraCCD::updateProperties()
         // Let's get parameters now from CCD
         setupParams();
 
-        timerID = SetTimer(POLLMS);
-    }
-    else
-    {
-        rmTimer(timerID);
-    }
+        defineText(&SensorStateTP);
+        sensorPublish();
 
-    return true;
-}
+        defineSwitch(&LuckySP);
+        defineNumber(&LuckyNP);
 
-bool PiCameraCCD::Connect()
-{
-    LOG_INFO("Attempting to find PiCamera...");
+        defineSwitch(&CalibrationSP);
+        defineText(&CalibrationTP);
+        defineNumber(&CalibrationNP);
 
-    /**********************************************************
-   *
-   *
-   *
-   *  IMPORRANT: Put here your CCD Connect function
-   *  If you encameraCounter an error, send the client a message
-   *  e.g.
-   *  LOG_INFO( "Error, unable to connect due to ...");
-   *  return false;
-   *
-   *
-   **********************************************************/
+        defineSwitch(&GuideCentroidSP);
+        defineNumber(&GuideCentroidNP);
+        defineNumber(&GuideStarNP);
+        defineSwitch(&GuideFormatSP);
+        defineBLOB(&GuideCompactBP);
 
-    /* Success! */
-    LOG_INFO("Camera is online. Retrieving basic data.");
+        defineText(&GpioTP);
+        defineNumber(&GpioNP);
+        defineSwitch(&GpioActiveSP);
+        defineNumber(&PulseNP);
 
-/*
+        defineSwitch(&FocusSP);
+        defineNumber(&FocusNP);
+        defineNumber(&FocusValuesNP);
 
-    streamPredicate = 0;
-    terminateThread = false;
-    pthread_create(&primary_thread, nullptr, &streamVideoHelper, this);
+        defineSwitch(&RecordSP);
+        defineSwitch(&RecordDepthSP);
+        defineText(&RecordTP);
+        defineNumber(&RecordNP);
 
-*/
+        defineSwitch(&ShmSP);
+        defineText(&ShmTP);
+        defineNumber(&ShmNP);
+        defineNumber(&ShmStatusNP);
 
+        defineSwitch(&RiceSP);
 
-    if(!testing){
-        system("camera_i2c");
-    }
+        defineSwitch(&DebayerSP);
+        defineSwitch(&CfaBinSP);
 
+        defineSwitch(&PreviewSP);
+        defineNumber(&PreviewNP);
+        defineSwitch(&FinalPreviewSP);
+        defineBLOB(&PreviewBP);
 
-    return true;
-}
+        defineSwitch(&LiveStackSP);
+        defineSwitch(&LiveModeSP);
+        defineNumber(&LiveStackNP);
+        defineBLOB(&LiveBP);
 
-bool PiCameraCCD::Disconnect()
-{
-    /**********************************************************
-   *
-   *
-   *
-   *  IMPORRANT: Put here your CCD disonnect function
-   *  If you encameraCounter an error, send the client a message
-   *  e.g.
-   *  LOG_INFO( "Error, unable to disconnect due to ...");
-   *  return false;
-   *
-   *
-   **********************************************************/
-/*
-    pthread_mutex_lock(&condMutex);
-    streamPredicate = 1;
-    terminateThread = true;
-    pthread_cond_signal(&cv);
-    pthread_mutex_unlock(&condMutex);
-*/
+        defineSwitch(&SequenceSP);
 
-    terminateFrameStream();
+        defineText(&CpusTP);
+        defineNumber(&CapturePriorityNP);
+        applyThreads();
 
-    free(image);
-    free(buffer);
-    delete(pData);
+        defineNumber(&DiagnosticsNP);
+        updateDiagnostics();
+        defineNumber(&TimingNP);
 
-    LOG_INFO("Camera is offline.");
-    return true;
-}
+        defineNumber(&StatsNP);
+        defineNumber(&HistogramNP);
 
-bool PiCameraCCD::setupParams()
-{
-    float x_pixel_size, y_pixel_size;
-    int bit_depth = 10;
-    int x_1, y_1, x_2, y_2;
+        defineSwitch(&SubPlanSP);
+        defineNumber(&SubPlanNP);
+        defineNumber(&PlanNP);
 
-    /**********************************************************
-   *
-   *
-   *
-   *  IMPORRANT: Get basic CCD parameters here such as
-   *  + Pixel Size X
-   *  + Pixel Size Y
-   *  + Bit Depth?
-   *  + X, Y, W, H of frame
-   *  + Temperature
-   *  + ...etc
-   *
-   *
-   *
-   **********************************************************/
+        streamSchedule(POLLMS);
+    }
+    else
+    {
+        deleteProperty(SensorStateTP.name);
 
-    ///////////////////////////
-    // 1. Get Pixel size
-    ///////////////////////////
-    // Actucal CALL to CCD to get pixel size here
-    x_pixel_size = 1.12;  // was 5.4;
-    y_pixel_size = 1.12; // was 5.4;
+        deleteProperty(LuckySP.name);
+        deleteProperty(LuckyNP.name);
 
-    ///////////////////////////
-    // 2. Get Frame
-    ///////////////////////////
+        deleteProperty(CalibrationSP.name);
+        deleteProperty(CalibrationTP.name);
+        deleteProperty(CalibrationNP.name);
 
-    // Actucal CALL to CCD to get frame information here
-    x_1 = y_1 = 0;
-    x_2       = HPIXELS;    //was 1280;
-    y_2       = VPIXELS;    //was 1024;
+        deleteProperty(GuideCentroidSP.name);
+        deleteProperty(GuideCentroidNP.name);
+        deleteProperty(GuideStarNP.name);
+        deleteProperty(GuideFormatSP.name);
+        deleteProperty(GuideCompactBP.name);
 
-    ///////////////////////////
-    // 3. Get temperature
-    ///////////////////////////
-    // Setting sample temperature -- MAKE CALL TO API FUNCTION TO GET TEMPERATURE IN REAL DRIVER
-    TemperatureN[0].value = 25.0;
-//    LOGF_INFO("The CCD Temperature is %f", TemperatureN[0].value);
-    IDSetNumber(&TemperatureNP, nullptr);
+        deleteProperty(GpioTP.name);
+        deleteProperty(GpioNP.name);
+        deleteProperty(GpioActiveSP.name);
+        deleteProperty(PulseNP.name);
 
-    ///////////////////////////
-    // 4. Get temperature
-    ///////////////////////////
-    bit_depth = 16;
-    SetCCDParams(x_2 - x_1, y_2 - y_1, bit_depth, x_pixel_size, y_pixel_size);
+        deleteProperty(FocusSP.name);
+        deleteProperty(FocusNP.name);
+        deleteProperty(FocusValuesNP.name);
 
+        deleteProperty(RecordSP.name);
+        deleteProperty(RecordDepthSP.name);
+        deleteProperty(RecordTP.name);
+        deleteProperty(RecordNP.name);
 
-/*
-    Streamer->setPixelFormat(INDI_MONO, 16);
-    Streamer->setSize(PrimaryCCD.getXRes(), PrimaryCCD.getYRes());
-*/
+        deleteProperty(ShmSP.name);
+        deleteProperty(ShmTP.name);
+        deleteProperty(ShmNP.name);
+        deleteProperty(ShmStatusNP.name);
 
-    // Now we usually do the following in the hardware
-    // Set Frame to LIGHT or NORMAL
-    // Set Binning to 1x1
-    /* Default frame type is NORMAL */
+        deleteProperty(RiceSP.name);
 
-    // Let's calculate required buffer
-    int nbuf;
-    nbuf = PrimaryCCD.getXRes() * PrimaryCCD.getYRes() * PrimaryCCD.getBPP() / 8; //  this is pixel cameraCount
-    nbuf += 512;                                                                  //  leave a little extra at the end
-    PrimaryCCD.setFrameBufferSize(nbuf);
+        deleteProperty(DebayerSP.name);
+        deleteProperty(CfaBinSP.name);
 
-    // ---------------------------------------------------------------------------
-    // Allocate memory
+        deleteProperty(PreviewSP.name);
+        deleteProperty(PreviewNP.name);
+        deleteProperty(FinalPreviewSP.name);
+        deleteProperty(PreviewBP.name);
 
-    pData = new char[15 * 1024 * 1024];
-    image = (unsigned short *)malloc((HPIXELS*VPIXELS) * sizeof(unsigned short));
-    buffer = (unsigned short *)malloc((HPIXELS*VPIXELS) * sizeof(unsigned short));
+        deleteProperty(LiveStackSP.name);
+        deleteProperty(LiveModeSP.name);
+        deleteProperty(LiveStackNP.name);
+        deleteProperty(LiveBP.name);
 
-    // ---------------------------------------------------------------------------
+        deleteProperty(SequenceSP.name);
 
+        deleteProperty(CpusTP.name);
+        deleteProperty(CapturePriorityNP.name);
 
-    return true;
-}
+        deleteProperty(DiagnosticsNP.name);
+        deleteProperty(TimingNP.name);
 
-int PiCameraCCD::SetTemperature(double temperature)
-{
-    // If there difference, for example, is less than 0.1 degrees, let's immediately return OK.
-    if (fabs(temperature - TemperatureN[0].value) < TEMP_THRESHOLD)
-        return 1;
+        deleteProperty(StatsNP.name);
+        deleteProperty(HistogramNP.name);
 
-    /**********************************************************
-     *
-     *  IMPORRANT: Put here your CCD Set Temperature Function
-     *  We return 0 if setting the temperature will take some time
-     *  If the requested is the same as current temperature, or very
-     *  close, we return 1 and INDI::CCD will mark the temperature status as OK
-     *  If we return 0, INDI::CCD will mark the temperature status as BUSY
-     **********************************************************/
+        deleteProperty(SubPlanSP.name);
+        deleteProperty(SubPlanNP.name);
+        deleteProperty(PlanNP.name);
 
-    // Otherwise, we set the temperature request and we update the status in TimerHit() function.
-    TemperatureRequest = temperature;
-    LOGF_INFO("Setting CCD temperature to %+06.2f C", temperature);
-    return 0;
+        if (timerID >= 0)
+        {
+            rmTimer(timerID);
+            timerID = -1;
+        }
+    }
+
+    return true;
 }
 
-bool PiCameraCCD::StartExposure(float duration)
+bool PiCameraCCD::ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n)
 {
-        minDuration = 1;
-
-        if (duration < minDuration)
+    if (dev != nullptr && !strcmp(dev, getDeviceName()))
+    {
+        if (!strcmp(name, SensorSP.name))
         {
-            DEBUGF(INDI::Logger::DBG_WARNING,
-                   "Exposure shorter than minimum duration %g s requested. \n Setting exposure time to %g s.", minDuration,
-                   minDuration);
-            duration = minDuration;
-        }
+            if (isConnected())
+            {
+                SensorSP.s = IPS_ALERT;
+                IDSetSwitch(&SensorSP, nullptr);
+                LOG_WARN("Disconnect before changing the sensor mode.");
+                return false;
+            }
 
-        if (imageFrameType == INDI::CCDChip::BIAS_FRAME)
-        {
-            duration = minDuration;
-            LOGF_INFO("Bias Frame (s) : %g\n", minDuration);
+            IUUpdateSwitch(&SensorSP, states, names, n);
+            SensorSP.s = IPS_OK;
+            IDSetSwitch(&SensorSP, nullptr);
+            return true;
         }
 
-        /**********************************************************
-       *
-       *
-       *
-       *  IMPORRANT: Put here your CCD start exposure here
-       *  Please note that duration passed is in seconds.
-       *  If there is an error, report it back to client
-       *  e.g.
-       *  LOG_INFO( "Error, unable to start exposure due to ...");
-       *  return -1;
-       *
-       *
-       **********************************************************/
+        if (!strcmp(name, LowMemorySP.name))
+        {
+            if (isConnected())
+            {
+                LowMemorySP.s = IPS_ALERT;
+                IDSetSwitch(&LowMemorySP, nullptr);
+                LOG_WARN("Disconnect before changing low memory mode.");
+                return false;
+            }
 
-        // ---------------------------------------------------------------------------
+            IUUpdateSwitch(&LowMemorySP, states, names, n);
+            LowMemorySP.s = IPS_OK;
+            IDSetSwitch(&LowMemorySP, nullptr);
+            return true;
+        }
 
-        // Clear summing buffer
-        memset(buffer, 0, (HPIXELS*VPIXELS) * sizeof(unsigned short));
+        // Lucky imaging, star tracking, the focus metric, recording and live
+        // stacking need whole unpacked frames. The request is tried on a copy,
+        // so a refused one leaves the switches as they were.
+        ISwitchVectorProperty *wholeFrames[] = { &LuckySP, &GuideCentroidSP, &FocusSP, &RecordSP, &LiveStackSP };
 
-        //  Set Bayer
-        if (fullframe && !binned && bayer)
+        for (ISwitchVectorProperty *svp : wholeFrames)
         {
-            // Has Bayer
-            SetCCDCapability(GetCCDCapability() | CCD_HAS_BAYER);
-        }else{
-            // No Bayer when subframed or binned
-            SetCCDCapability(GetCCDCapability() & ~CCD_HAS_BAYER);
-        }
+            if (strcmp(name, svp->name) || !lowMemory || !isConnected())
+                continue;
 
-         // ---------------------------------------------------------------------------
+            std::vector<ISwitch> switches(svp->sp, svp->sp + svp->nsp);
+            ISwitchVectorProperty request = *svp;
+            request.sp = switches.data();
 
-        //Start Frames
-        if(!FrameStreamIsRunning){
-            startFrameStream(); // Add error checking . Don't set "FrameStreamIsRunning = true" unless succesful.
+            // Index 0 is On in each of them
+            if (IUUpdateSwitch(&request, states, names, n) == 0 && IUFindOnSwitchIndex(&request) == 0)
+            {
+                svp->s = IPS_ALERT;
+                IDSetSwitch(svp, "%s is not available in low memory mode.", svp->label);
+                return true;
+            }
         }
 
-        FrameStreamIsRunning = true;
+        if (!strcmp(name, LuckySP.name))
+        {
+            if (InExposure)
+            {
+                LuckySP.s = IPS_ALERT;
+                IDSetSwitch(&LuckySP, nullptr);
+                LOG_WARN("Cannot change lucky imaging during an exposure.");
+                return false;
+            }
 
-        // ---------------------------------------------------------------------------
+            IUUpdateSwitch(&LuckySP, states, names, n);
+            LuckySP.s = IPS_OK;
+            IDSetSwitch(&LuckySP, nullptr);
 
-        // Set number of frames to collect
-        numOfFrames = duration;
+            LOGF_INFO("Lucky imaging %s.", LuckyS[0].s == ISS_ON ? "enabled" : "disabled");
+            return true;
+        }
 
-        PrimaryCCD.setExposureDuration(duration);
-        ExposureRequest = duration;
+        if (!strcmp(name, CalibrationSP.name))
+        {
+            IUUpdateSwitch(&CalibrationSP, states, names, n);
+            CalibrationSP.s = IPS_OK;
 
-        gettimeofday(&ExpStart, nullptr);
-        LOGF_INFO("Taking a %g second image...", ExposureRequest);
+            // The master dark is read when first needed
+            if ((CalibrationS[CALIBRATION_DARK].s == ISS_ON || CalibrationS[CALIBRATION_DEFECTS].s == ISS_ON) &&
+                masterDark.empty() && calibrationLoad() != 0)
+            {
+                CalibrationSP.s = IPS_ALERT;
+            }
 
-        InExposure = true;
+            IDSetSwitch(&CalibrationSP, nullptr);
+            return true;
+        }
 
-        // Reset frame count
-        framecount = 0;
+        if (!strcmp(name, GuideCentroidSP.name))
+        {
+            IUUpdateSwitch(&GuideCentroidSP, states, names, n);
+            GuideCentroidSP.s = IPS_OK;
+            IDSetSwitch(&GuideCentroidSP, nullptr);
 
-    return true;
-}
+            // Search for a new star whenever tracking is switched on
+            guideLocked = false;
 
+            if (GuideCentroidS[0].s == ISS_ON)
+            {
+                // Frames are read between exposures while tracking
+                if(!FrameStreamIsRunning){
+                    startFrameStream();
+                }
 
-int PiCameraCCD::terminateFrameStream(){
+                FrameStreamIsRunning = true;
 
-    // Terminate frame stream & close pipe
+                LOG_INFO("Guide star tracking enabled.");
+            }
+            else
+            {
+                GuideStarNP.s = IPS_IDLE;
+                IDSetNumber(&GuideStarNP, nullptr);
 
-    if(FrameStreamIsRunning){
+                LOG_INFO("Guide star tracking disabled.");
+            }
 
-        if(testing){
-            system("pkill streamraw");
-        }else{
-            system("pkill raspiraw");
+            return true;
         }
 
-        FrameStreamIsRunning = false;
-        LOG_INFO("Stream Closed");
+        if (!strcmp(name, FocusSP.name))
+        {
+            IUUpdateSwitch(&FocusSP, states, names, n);
+            FocusSP.s = IPS_OK;
+            IDSetSwitch(&FocusSP, nullptr);
 
-        pclose(imageFileStreamPipe);
+            if (FocusS[0].s == ISS_ON)
+            {
+                // Frames are read between exposures while focusing
+                if(!FrameStreamIsRunning){
+                    startFrameStream();
+                }
 
-        LOG_INFO("Pipe Closed");
+                FrameStreamIsRunning = true;
+                focusFrames = 0;
 
-        InExposure = false;
+                LOG_INFO("Focus metric enabled.");
+            }
+            else
+            {
+                FocusValuesNP.s = IPS_IDLE;
+                IDSetNumber(&FocusValuesNP, nullptr);
 
-    }
+                LOG_INFO("Focus metric disabled.");
+            }
 
-    return 0;
+            return true;
+        }
 
-}
+        if (!strcmp(name, RecordSP.name))
+        {
+            IUUpdateSwitch(&RecordSP, states, names, n);
+
+            if (RecordS[0].s == ISS_ON)
+            {
+                if (!recorder.isOpen() && recordOpen() != 0)
+                {
+                    IUResetSwitch(&RecordSP);
+                    RecordS[1].s = ISS_ON;
+                    RecordSP.s = IPS_ALERT;
+                    IDSetSwitch(&RecordSP, nullptr);
+                    return false;
+                }
+
+                // Frames are read between exposures while recording
+                if(!FrameStreamIsRunning){
+                    startFrameStream();
+                }
+
+                FrameStreamIsRunning = true;
+
+                RecordSP.s = IPS_BUSY;
+            }
+            else
+            {
+                recordClose();
+                RecordSP.s = IPS_OK;
+            }
+
+            IDSetSwitch(&RecordSP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, ShmSP.name))
+        {
+            IUUpdateSwitch(&ShmSP, states, names, n);
+
+            if (ShmS[SHM_FRAMES].s == ISS_ON && lowMemory)
+            {
+                LOG_WARN("Exporting frames is not available in low memory mode.");
+                IUResetSwitch(&ShmSP);
+                ShmS[SHM_OFF].s = ISS_ON;
+                ShmSP.s = IPS_ALERT;
+                IDSetSwitch(&ShmSP, nullptr);
+                return false;
+            }
+
+            if (ShmS[SHM_OFF].s == ISS_ON)
+            {
+                shmExport.close();
+                ShmSP.s = IPS_OK;
+            }
+            else if (shmOpen() != 0)
+            {
+                IUResetSwitch(&ShmSP);
+                ShmS[SHM_OFF].s = ISS_ON;
+                ShmSP.s = IPS_ALERT;
+                IDSetSwitch(&ShmSP, nullptr);
+                return false;
+            }else{
+
+                // Frames are read between exposures while exporting them
+                if (ShmS[SHM_FRAMES].s == ISS_ON)
+                {
+                    if(!FrameStreamIsRunning){
+                        startFrameStream();
+                    }
+
+                    FrameStreamIsRunning = true;
+                }
+
+                ShmSP.s = IPS_BUSY;
+            }
+
+            shmStatus(true);
+
+            IDSetSwitch(&ShmSP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, RecordDepthSP.name))
+        {
+            if (recorder.isOpen())
+            {
+                RecordDepthSP.s = IPS_ALERT;
+                IDSetSwitch(&RecordDepthSP, nullptr);
+                LOG_WARN("Stop recording before changing the depth.");
+                return false;
+            }
+
+            IUUpdateSwitch(&RecordDepthSP, states, names, n);
+            RecordDepthSP.s = IPS_OK;
+            IDSetSwitch(&RecordDepthSP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, GuideFormatSP.name))
+        {
+            IUUpdateSwitch(&GuideFormatSP, states, names, n);
+            GuideFormatSP.s = IPS_OK;
+            IDSetSwitch(&GuideFormatSP, nullptr);
+
+            // Deltas start again from a whole frame
+            guideEncoder.reset();
+            return true;
+        }
+
+        if (!strcmp(name, GpioActiveSP.name))
+        {
+            IUUpdateSwitch(&GpioActiveSP, states, names, n);
+            GpioActiveSP.s = (isConnected() && guidePortOpen() != 0) ? IPS_ALERT : IPS_OK;
+            IDSetSwitch(&GpioActiveSP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, RiceSP.name))
+        {
+            IUUpdateSwitch(&RiceSP, states, names, n);
+            RiceSP.s = IPS_OK;
+            IDSetSwitch(&RiceSP, nullptr);
+
+            if (RiceS[0].s == ISS_ON && PrimaryCCD.isCompressed())
+            {
+                LOG_WARN("Rice FITS is already compressed, consider turning off image compression.");
+            }
+
+            return true;
+        }
+
+        if (!strcmp(name, DebayerSP.name))
+        {
+            // The frame buffer triples in size for RGB
+            finalizeWait();
+
+            IUUpdateSwitch(&DebayerSP, states, names, n);
+            DebayerSP.s = IPS_OK;
+            IDSetSwitch(&DebayerSP, nullptr);
+
+            UpdateCCDFrame(PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(), PrimaryCCD.getSubH());
+            return true;
+        }
+
+        if (!strcmp(name, CfaBinSP.name))
+        {
+            // Superpixel binning changes the number of planes
+            finalizeWait();
+
+            IUUpdateSwitch(&CfaBinSP, states, names, n);
+            CfaBinSP.s = IPS_OK;
+            IDSetSwitch(&CfaBinSP, nullptr);
+
+            UpdateCCDFrame(PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(), PrimaryCCD.getSubH());
+            return true;
+        }
+
+        if (!strcmp(name, PreviewSP.name))
+        {
+            IUUpdateSwitch(&PreviewSP, states, names, n);
+            PreviewSP.s = IPS_OK;
+            IDSetSwitch(&PreviewSP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, FinalPreviewSP.name))
+        {
+            IUUpdateSwitch(&FinalPreviewSP, states, names, n);
+            FinalPreviewSP.s = IPS_OK;
+            IDSetSwitch(&FinalPreviewSP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, LiveStackSP.name))
+        {
+            IUUpdateSwitch(&LiveStackSP, states, names, n);
+
+            if (LiveStackS[0].s == ISS_ON)
+            {
+                liveBegin();
+
+                // Frames are read between exposures while live stacking
+                if(!FrameStreamIsRunning){
+                    startFrameStream();
+                }
+
+                FrameStreamIsRunning = true;
+
+                LiveStackSP.s = IPS_BUSY;
+                LOG_INFO("Live stacking enabled.");
+            }
+            else
+            {
+                // Give the window back
+                std::vector<unsigned short>().swap(liveRing);
+                std::vector<uint32_t>().swap(liveSum);
+                std::vector<unsigned short>().swap(liveImage);
+
+                LiveStackSP.s = IPS_OK;
+                LOG_INFO("Live stacking disabled.");
+            }
+
+            IDSetSwitch(&LiveStackSP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, LiveModeSP.name))
+        {
+            IUUpdateSwitch(&LiveModeSP, states, names, n);
+            LiveModeSP.s = IPS_OK;
+            IDSetSwitch(&LiveModeSP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, SubPlanSP.name))
+        {
+            IUUpdateSwitch(&SubPlanSP, states, names, n);
+            SubPlanSP.s = IPS_OK;
+            IDSetSwitch(&SubPlanSP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, SequenceSP.name))
+        {
+            IUUpdateSwitch(&SequenceSP, states, names, n);
+            SequenceSP.s = IPS_OK;
+            IDSetSwitch(&SequenceSP, nullptr);
+
+            if (SequenceS[0].s != ISS_ON)
+            {
+                carrying = false;
+            }
+
+            return true;
+        }
+    }
+
+    return INDI::CCD::ISNewSwitch(dev, name, states, names, n);
+}
+
+bool PiCameraCCD::ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n)
+{
+    if (dev != nullptr && !strcmp(dev, getDeviceName()))
+    {
+        if (!strcmp(name, LuckyNP.name))
+        {
+            IUUpdateNumber(&LuckyNP, values, names, n);
+            LuckyNP.s = IPS_OK;
+            IDSetNumber(&LuckyNP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, GpioNP.name))
+        {
+            IUUpdateNumber(&GpioNP, values, names, n);
+            GpioNP.s = (isConnected() && guidePortOpen() != 0) ? IPS_ALERT : IPS_OK;
+            IDSetNumber(&GpioNP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, CalibrationNP.name))
+        {
+            IUUpdateNumber(&CalibrationNP, values, names, n);
+            CalibrationNP.s = IPS_OK;
+            IDSetNumber(&CalibrationNP, nullptr);
+
+            if (!masterDark.empty())
+            {
+                calibrationDefects();
+            }
+            return true;
+        }
+
+        if (!strcmp(name, GuideCentroidNP.name))
+        {
+            IUUpdateNumber(&GuideCentroidNP, values, names, n);
+            GuideCentroidNP.s = IPS_OK;
+            IDSetNumber(&GuideCentroidNP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, FocusNP.name))
+        {
+            IUUpdateNumber(&FocusNP, values, names, n);
+            FocusNP.s = IPS_OK;
+            IDSetNumber(&FocusNP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, SubPlanNP.name))
+        {
+            IUUpdateNumber(&SubPlanNP, values, names, n);
+            SubPlanNP.s = IPS_OK;
+            IDSetNumber(&SubPlanNP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, LiveStackNP.name))
+        {
+            int window = LiveStackN[LIVE_WINDOW].value;
+
+            IUUpdateNumber(&LiveStackNP, values, names, n);
+            LiveStackNP.s = IPS_OK;
+            IDSetNumber(&LiveStackNP, nullptr);
+
+            // A new window starts from empty
+            if (LiveStackS[0].s == ISS_ON && window != (int)LiveStackN[LIVE_WINDOW].value)
+            {
+                liveBegin();
+            }
+
+            return true;
+        }
+
+        if (!strcmp(name, PreviewNP.name))
+        {
+            IUUpdateNumber(&PreviewNP, values, names, n);
+            PreviewNP.s = IPS_OK;
+            IDSetNumber(&PreviewNP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, ShmNP.name))
+        {
+            IUUpdateNumber(&ShmNP, values, names, n);
+            ShmNP.s = IPS_OK;
+
+            // Readers see the old ring closed and open the new one
+            if (shmExport.isOpen() && shmOpen() != 0)
+            {
+                ShmNP.s = IPS_ALERT;
+            }
+
+            IDSetNumber(&ShmNP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, CapturePriorityNP.name))
+        {
+            IUUpdateNumber(&CapturePriorityNP, values, names, n);
+            applyThreads();
+            return true;
+        }
+    }
+
+    return INDI::CCD::ISNewNumber(dev, name, values, names, n);
+}
+
+bool PiCameraCCD::ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n)
+{
+    if (dev != nullptr && !strcmp(dev, getDeviceName()))
+    {
+        if (!strcmp(name, RecordTP.name))
+        {
+            IUUpdateText(&RecordTP, texts, names, n);
+            RecordTP.s = IPS_OK;
+            IDSetText(&RecordTP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, GpioTP.name))
+        {
+            IUUpdateText(&GpioTP, texts, names, n);
+            GpioTP.s = (isConnected() && guidePortOpen() != 0) ? IPS_ALERT : IPS_OK;
+            IDSetText(&GpioTP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, CalibrationTP.name))
+        {
+            IUUpdateText(&CalibrationTP, texts, names, n);
+            CalibrationTP.s = IPS_OK;
+
+            masterDark.clear();
+            darkFrame.clear();
+            hotPixels.clear();
+
+            if ((CalibrationS[CALIBRATION_DARK].s == ISS_ON || CalibrationS[CALIBRATION_DEFECTS].s == ISS_ON) &&
+                calibrationLoad() != 0)
+            {
+                CalibrationTP.s = IPS_ALERT;
+            }
+
+            IDSetText(&CalibrationTP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, ShmTP.name))
+        {
+            // The old name is removed before the new one is made
+            IUUpdateText(&ShmTP, texts, names, n);
+            ShmTP.s = IPS_OK;
+
+            if (shmExport.isOpen() && shmOpen() != 0)
+            {
+                ShmTP.s = IPS_ALERT;
+            }
+
+            IDSetText(&ShmTP, nullptr);
+            return true;
+        }
+
+        if (!strcmp(name, CpusTP.name))
+        {
+            IUUpdateText(&CpusTP, texts, names, n);
+            applyThreads();
+            return true;
+        }
+    }
+
+    return INDI::CCD::ISNewText(dev, name, texts, names, n);
+}
+
+bool PiCameraCCD::saveConfigItems(FILE *fp)
+{
+    INDI::CCD::saveConfigItems(fp);
+
+    IUSaveConfigSwitch(fp, &SensorSP);
+    IUSaveConfigSwitch(fp, &LowMemorySP);
+
+    IUSaveConfigText(fp, &CpusTP);
+    IUSaveConfigNumber(fp, &CapturePriorityNP);
+
+    IUSaveConfigSwitch(fp, &LuckySP);
+    IUSaveConfigNumber(fp, &LuckyNP);
+
+    // The file first, so it is there when the switches are loaded
+    IUSaveConfigText(fp, &CalibrationTP);
+    IUSaveConfigNumber(fp, &CalibrationNP);
+    IUSaveConfigSwitch(fp, &CalibrationSP);
+
+    IUSaveConfigNumber(fp, &GuideCentroidNP);
+    IUSaveConfigSwitch(fp, &GuideFormatSP);
+
+    IUSaveConfigText(fp, &GpioTP);
+    IUSaveConfigNumber(fp, &GpioNP);
+    IUSaveConfigSwitch(fp, &GpioActiveSP);
+
+    IUSaveConfigNumber(fp, &FocusNP);
+
+    IUSaveConfigSwitch(fp, &RecordDepthSP);
+    IUSaveConfigText(fp, &RecordTP);
+
+    IUSaveConfigText(fp, &ShmTP);
+    IUSaveConfigNumber(fp, &ShmNP);
+
+    IUSaveConfigSwitch(fp, &RiceSP);
+
+    IUSaveConfigSwitch(fp, &DebayerSP);
+    IUSaveConfigSwitch(fp, &CfaBinSP);
+
+    IUSaveConfigSwitch(fp, &PreviewSP);
+    IUSaveConfigNumber(fp, &PreviewNP);
+    IUSaveConfigSwitch(fp, &FinalPreviewSP);
+
+    IUSaveConfigSwitch(fp, &LiveModeSP);
+    IUSaveConfigNumber(fp, &LiveStackNP);
+
+    IUSaveConfigSwitch(fp, &SequenceSP);
+
+    IUSaveConfigSwitch(fp, &SubPlanSP);
+    IUSaveConfigNumber(fp, &SubPlanNP);
+
+    return true;
+}
+
+bool PiCameraCCD::Connect()
+{
+    LOG_INFO("Attempting to find PiCamera...");
+
+    /**********************************************************
+   *
+   *
+   *
+   *  IMPORRANT: Put here your CCD Connect function
+   *  If you encameraCounter an error, send the client a message
+   *  e.g.
+   *  LOG_INFO( "Error, unable to connect due to ...");
+   *  return false;
+   *
+   *
+   **********************************************************/
+
+    // Geometry, raw format and kernels of the selected mode
+    int mode = IUFindOnSwitchIndex(&SensorSP);
+    sensor = &sensorModes[mode < 0 ? 0 : mode];
+
+    lowMemory = (LowMemoryS[0].s == ISS_ON);
+
+    if (lowMemory)
+    {
+        // These need whole frames in memory
+        IUResetSwitch(&LuckySP);
+        LuckyS[1].s = ISS_ON;
+        IUResetSwitch(&GuideCentroidSP);
+        GuideCentroidS[1].s = ISS_ON;
+        IUResetSwitch(&FocusSP);
+        FocusS[1].s = ISS_ON;
+        IUResetSwitch(&RecordSP);
+        RecordS[1].s = ISS_ON;
+        IUResetSwitch(&LiveStackSP);
+        LiveStackS[1].s = ISS_ON;
+
+        // Finished images may still be exported
+        if (ShmS[SHM_FRAMES].s == ISS_ON)
+        {
+            IUResetSwitch(&ShmSP);
+            ShmS[SHM_OFF].s = ISS_ON;
+        }
+    }
+
+    /* Success! */
+    LOG_INFO("Camera is online. Retrieving basic data.");
+    LOGF_INFO("Sensor mode %s, %d bit%s.", sensor->label, sensor->bits, lowMemory ? ", low memory" : "");
+
+/*
+
+    streamPredicate = 0;
+    terminateThread = false;
+    pthread_create(&primary_thread, nullptr, &streamVideoHelper, this);
+
+*/
+
+    // Powers up the sensor while the buffers are set up
+    sensorInitStart();
+
+    // Guiding works without the guide port, so a failure is only reported
+    guidePortOpen();
+
+    return true;
+}
+
+bool PiCameraCCD::Disconnect()
+{
+    /**********************************************************
+   *
+   *
+   *
+   *  IMPORRANT: Put here your CCD disonnect function
+   *  If you encameraCounter an error, send the client a message
+   *  e.g.
+   *  LOG_INFO( "Error, unable to disconnect due to ...");
+   *  return false;
+   *
+   *
+   **********************************************************/
+/*
+    pthread_mutex_lock(&condMutex);
+    streamPredicate = 1;
+    terminateThread = true;
+    pthread_cond_signal(&cv);
+    pthread_mutex_unlock(&condMutex);
+*/
+
+    if (recorder.isOpen())
+    {
+        recordClose();
+
+        IUResetSwitch(&RecordSP);
+        RecordS[1].s = ISS_ON;
+        RecordSP.s = IPS_IDLE;
+    }
+
+    guideExposing = false;
+
+    // Lines go inactive and are released. Pulses it stopped are completed now,
+    // so neither axis is left busy.
+    guider.close();
+    guidePulseDone();
+
+    if (shmExport.isOpen())
+    {
+        shmExport.close();
+
+        IUResetSwitch(&ShmSP);
+        ShmS[SHM_OFF].s = ISS_ON;
+        ShmSP.s = IPS_IDLE;
+    }
+
+    terminateFrameStream();
+
+    // Let the last image go out before its buffer is freed
+    finalizeStop();
+
+    free(image);
+    if (finalbuffer != buffer)
+    {
+        free(finalbuffer);
+    }
+    free(buffer);
+    delete(pData);
+
+    LOG_INFO("Camera is offline.");
+    return true;
+}
+
+bool PiCameraCCD::setupParams()
+{
+    float x_pixel_size, y_pixel_size;
+    int bit_depth = 10;
+    int x_1, y_1, x_2, y_2;
+
+    /**********************************************************
+   *
+   *
+   *
+   *  IMPORRANT: Get basic CCD parameters here such as
+   *  + Pixel Size X
+   *  + Pixel Size Y
+   *  + Bit Depth?
+   *  + X, Y, W, H of frame
+   *  + Temperature
+   *  + ...etc
+   *
+   *
+   *
+   **********************************************************/
+
+    ///////////////////////////
+    // 1. Get Pixel size
+    ///////////////////////////
+    // Actucal CALL to CCD to get pixel size here
+    x_pixel_size = sensor->pixelsize;  // was 5.4;
+    y_pixel_size = sensor->pixelsize; // was 5.4;
+
+    ///////////////////////////
+    // 2. Get Frame
+    ///////////////////////////
+
+    // Actucal CALL to CCD to get frame information here
+    x_1 = y_1 = 0;
+    x_2       = sensor->width;    //was 1280;
+    y_2       = sensor->height;    //was 1024;
+
+    ///////////////////////////
+    // 3. Get temperature
+    ///////////////////////////
+    // Setting sample temperature -- MAKE CALL TO API FUNCTION TO GET TEMPERATURE IN REAL DRIVER
+    TemperatureN[0].value = 25.0;
+//    LOGF_INFO("The CCD Temperature is %f", TemperatureN[0].value);
+    IDSetNumber(&TemperatureNP, nullptr);
+
+    ///////////////////////////
+    // 4. Get temperature
+    ///////////////////////////
+    bit_depth = 16;
+    SetCCDParams(x_2 - x_1, y_2 - y_1, bit_depth, x_pixel_size, y_pixel_size);
+
+    // The guide head is the same sensor. Its buffer is sized when it exposes.
+    SetGuiderParams(x_2 - x_1, y_2 - y_1, bit_depth, x_pixel_size, y_pixel_size);
+
+
+/*
+    Streamer->setPixelFormat(INDI_MONO, 16);
+    Streamer->setSize(PrimaryCCD.getXRes(), PrimaryCCD.getYRes());
+*/
+
+    // Now we usually do the following in the hardware
+    // Set Frame to LIGHT or NORMAL
+    // Set Binning to 1x1
+    /* Default frame type is NORMAL */
+
+    // Let's calculate required buffer
+    int nbuf;
+    nbuf = PrimaryCCD.getXRes() * PrimaryCCD.getYRes() * PrimaryCCD.getBPP() / 8; //  this is pixel cameraCount
+
+    // Three planes when debayered
+    if (DebayerS[0].s != ISS_ON)
+    {
+        nbuf *= 3;
+    }
+
+    nbuf += 512;                                                                  //  leave a little extra at the end
+    PrimaryCCD.setFrameBufferSize(nbuf);
+    PrimaryCCD.setNAxis(DebayerS[0].s != ISS_ON || superpixelBinning() ? 3 : 2);
+
+    // ---------------------------------------------------------------------------
+    // Allocate memory
+
+    long npixels = (long)sensor->width * sensor->height;
+
+    if (lowMemory)
+    {
+        // A few rows are staged and unpacked at a time, and the worker
+        // finalizes from the one accumulator before the next exposure starts
+        stagingSize = LOWMEM_ROWS * sensor->stride;
+
+        pData = new char[stagingSize];
+        image = (unsigned short *)malloc(LOWMEM_ROWS * sensor->width * sizeof(unsigned short));
+        buffer = (unsigned short *)malloc(npixels * sizeof(unsigned short));
+        finalbuffer = buffer;
+    }
+    else
+    {
+        stagingSize = sensor->blocksize;
+
+        pData = new char[sensor->blocksize];
+        image = (unsigned short *)malloc(npixels * sizeof(unsigned short));
+        buffer = (unsigned short *)malloc(npixels * sizeof(unsigned short));
+        finalbuffer = (unsigned short *)calloc(npixels, sizeof(unsigned short));
+    }
+
+    // ---------------------------------------------------------------------------
+    // Finalization worker
+
+    finalizePending   = false;
+    finalizeReady     = false;
+    finalizeTerminate = false;
+
+    // Finished images are sent from the event loop when this is written
+    finalizeNotify     = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    finalizeCallbackID = IEAddCallback(finalizeNotify, &finalizeReadyHelper, this);
+
+    pthread_create(&finalize_thread, nullptr, &finalizeHelper, this);
+
+    // ---------------------------------------------------------------------------
+
+
+    return true;
+}
+
+int PiCameraCCD::SetTemperature(double temperature)
+{
+    // If there difference, for example, is less than 0.1 degrees, let's immediately return OK.
+    if (fabs(temperature - TemperatureN[0].value) < TEMP_THRESHOLD)
+        return 1;
+
+    /**********************************************************
+     *
+     *  IMPORRANT: Put here your CCD Set Temperature Function
+     *  We return 0 if setting the temperature will take some time
+     *  If the requested is the same as current temperature, or very
+     *  close, we return 1 and INDI::CCD will mark the temperature status as OK
+     *  If we return 0, INDI::CCD will mark the temperature status as BUSY
+     **********************************************************/
+
+    // Otherwise, we set the temperature request and we update the status in TimerHit() function.
+    TemperatureRequest = temperature;
+    LOGF_INFO("Setting CCD temperature to %+06.2f C", temperature);
+    return 0;
+}
+
+bool PiCameraCCD::StartExposure(float duration)
+{
+        gettimeofday(&timingRequest, nullptr);
+
+        // The previous image goes out with the exposure and Bayer settings it was taken with.
+        // Clients ask for the next exposure after receiving it, so this rarely waits.
+        finalizeWait();
+
+        minDuration = 1;
+
+        if (duration < minDuration)
+        {
+            DEBUGF(INDI::Logger::DBG_WARNING,
+                   "Exposure shorter than minimum duration %g s requested. \n Setting exposure time to %g s.", minDuration,
+                   minDuration);
+            duration = minDuration;
+        }
+
+        if (imageFrameType == INDI::CCDChip::BIAS_FRAME)
+        {
+            duration = minDuration;
+            LOGF_INFO("Bias Frame (s) : %g\n", minDuration);
+        }
+
+        /**********************************************************
+       *
+       *
+       *
+       *  IMPORRANT: Put here your CCD start exposure here
+       *  Please note that duration passed is in seconds.
+       *  If there is an error, report it back to client
+       *  e.g.
+       *  LOG_INFO( "Error, unable to start exposure due to ...");
+       *  return -1;
+       *
+       *
+       **********************************************************/
+
+        // ---------------------------------------------------------------------------
+
+        // Sub-exposure length and number of frames
+        double sub = 1.0;
+        int frames = duration;
+
+        if (SubPlanS[0].s == ISS_ON && LuckyS[0].s != ISS_ON)
+        {
+            planSubs(duration, &sub, &frames);
+        }
+
+        // Frames can only be as long as the mode's frame rates allow
+        double period = sensorFramePeriod(sensor, sub);
+
+        if (fabs(period - sub) >= 0.001)
+        {
+            LOGF_INFO("Sub of %g s is outside the sensor mode, using %g s.", sub, period);
+            sub    = period;
+            frames = std::max(1, (int)ceil(duration / sub - 0.001));
+        }
+
+        // Sequence - frames read since the last exposure are already summed
+        bool carried = carrying && framecount > 0 && framecount <= frames && fabs(sub - streamSubLength) < 0.001;
+        carrying = false;
+
+        // The sub length is fixed when raspiraw starts
+        subLength = sub;
+
+        if (FrameStreamIsRunning && fabs(subLength - streamSubLength) >= 0.001)
+        {
+            terminateFrameStream();
+        }
+
+        // Sky is measured on the first frame of each light
+        skyPending = (PrimaryCCD.getFrameType() == INDI::CCDChip::LIGHT_FRAME);
+
+        if ((CalibrationS[CALIBRATION_DARK].s == ISS_ON || CalibrationS[CALIBRATION_DEFECTS].s == ISS_ON) &&
+            (long)masterDark.size() != (long)sensor->width * sensor->height)
+        {
+            LOG_WARN("Calibration: no master dark of this sensor mode, frames are not calibrated.");
+        }
+
+        if (!carried)
+        {
+            // Clear summing buffer
+            memset(buffer, 0, ((long)sensor->width * sensor->height) * sizeof(unsigned short));
+            statsCollected = false;
+
+            // Reset frame count
+            framecount = 0;
+            frameLastValid = false;
+        }
+
+        // Reset kept frames
+        if (LuckyS[0].s == ISS_ON)
+        {
+            luckyBegin();
+        }
+
+        //  Set Bayer
+        bool cfaBinned = CfaBinS[CFA_BIN_SAME].s == ISS_ON ||
+                         (CfaBinS[CFA_BIN_SUPERPIXEL].s == ISS_ON && !superpixelBinning());
+
+        if (bayer && DebayerS[0].s == ISS_ON && ((fullframe && !binned) || cfaBinned))
+        {
+            // Has Bayer, starting at the colour of the subframe origin
+            char offsetX[8], offsetY[8];
+            snprintf(offsetX, sizeof(offsetX), "%d", PrimaryCCD.getSubX() & 1);
+            snprintf(offsetY, sizeof(offsetY), "%d", PrimaryCCD.getSubY() & 1);
+
+            if (strcmp(BayerT[0].text, offsetX) || strcmp(BayerT[1].text, offsetY))
+            {
+                IUSaveText(&BayerT[0], offsetX);
+                IUSaveText(&BayerT[1], offsetY);
+                IDSetText(&BayerTP, nullptr);
+            }
+
+            SetCCDCapability(GetCCDCapability() | CCD_HAS_BAYER);
+        }else{
+            // No Bayer when subframed, binned, or already debayered
+            SetCCDCapability(GetCCDCapability() & ~CCD_HAS_BAYER);
+        }
+
+         // ---------------------------------------------------------------------------
+
+        //Start Frames
+        if(!FrameStreamIsRunning){
+            startFrameStream(); // Add error checking . Don't set "FrameStreamIsRunning = true" unless succesful.
+        }
+
+        FrameStreamIsRunning = true;
+
+        // ---------------------------------------------------------------------------
+
+        // Set number of frames to collect
+        numOfFrames = frames;
+
+        PrimaryCCD.setExposureDuration(duration);
+        ExposureRequest = duration;
+
+        if (carried)
+        {
+            // Integration began when the previous exposure ended
+            ExpStart = carryStart;
+            timingFirstFrame = timingRequest;
+            LOGF_INFO("Taking a %g second image (%i frames already summed)...", ExposureRequest, framecount);
+        }else{
+            gettimeofday(&ExpStart, nullptr);
+            LOGF_INFO("Taking a %g second image...", ExposureRequest);
+        }
+
+        InExposure = true;
+
+        previewFrame = 0;
+        previewTime  = ExpStart;
+
+        // Progress and completion, frames are read as they arrive
+        streamSchedule(POLLMS);
+
+    return true;
+}
+
+
+int PiCameraCCD::terminateFrameStream(){
+
+    // Terminate frame stream & close pipe
+
+    if(FrameStreamIsRunning){
+
+        FrameStreamIsRunning = false;
+        LOG_INFO("Stream Closed");
+
+        if (streamCallbackID >= 0)
+        {
+            IERmCallback(streamCallbackID);
+            streamCallbackID = -1;
+        }
+
+        // Stops raspiraw, or nothing while waiting for the sensor
+        frameReader.close();
+
+        streamDeferred = false;
+
+        LOG_INFO("Pipe Closed");
+
+        InExposure = false;
+
+    }
+
+    return 0;
+
+}
 
 
 int PiCameraCCD::startFrameStream(){  // Add arguments for exposure and framerate. Maybe set in indi console later.
 
 
-    // ---------------------------------------------------------------------------
-    // Initialize frames
+    // ---------------------------------------------------------------------------
+    // Initialize frames
+
+    if(FrameStreamIsRunning){
+        return 0;
+    }
+
+    // Opened by sensorReady once camera_i2c is done. Until then the stream
+    // counts as running without a pipe, and reads nothing.
+    if (sensorInitState() == SENSOR_STARTING)
+    {
+        if (!streamDeferred)
+            LOG_INFO("Waiting for the sensor to start...");
+
+        streamDeferred = true;
+        return 0;
+    }
+
+    // ---------------------------------------------------------------------------
+    // ===================================================================================
+    // For Raspi
+
+    std::string command;
+
+    if(!testing){
+
+        // Create command
+        ostringstream cmd;
+
+        // The frame rate sets the frame period, the exposure is most of it
+        subLength = sensorFramePeriod(sensor, subLength);
+
+        cmd << "raspiraw -md " << sensor->mode << " -o /dev/stdout -t 9999999 -sr 1 -eus " << (long)(subLength * EXPOSURE_DUTY * 1e6) << " -g " << sensor->gain << " -fps " << 1.0 / subLength;
+
+        ///LOGF_INFO("cmd : %s\n", cmd.str().c_str());
+
+        command = cmd.str();
+
+    }
+
+    // --------------------------------------------------------------------------------------
+    // For testing
+
+    if(testing){
+
+        command = "'/home/jdhill/Link to Pictures/Astro/rawtest/test1/./streamraw'"; // used for testing with cat file
+
+    }
+
+    streamSubLength = subLength;
+    frameOffset     = 0;
+    frameLastValid  = false;
+
+    // Frames of a guide exposure are counted at the period of the stream
+    if (guideExposing)
+        guideHeadPlan();
+
+    // ===================================================================================
+
+    // Start raspiraw and the capture thread
+    size_t capacity = lowMemory ? CAPTURE_LOWMEM : CAPTURE_FRAMES * sensor->blocksize;
+
+    if (frameReader.open(command.c_str(), capacity) != 0){
+
+        LOGF_INFO("Runtime Error - cannot start raspiraw (%s)! Please Check Camera", strerror(errno));
+
+    }else{
+
+        // Only the capture thread runs with the capture CPUs and priority
+        int rc = frameReader.applyRole(CPU_ROLE_CAPTURE);
+
+        if (rc != 0)
+        {
+            LOGF_WARN("Cannot set the capture thread CPUs or priority (%s).", strerror(rc));
+        }
+
+        // Frames are taken from the capture thread as they arrive, on the INDI event loop
+        streamCallbackID = IEAddCallback(frameReader.notifyFd(), &streamCallbackHelper, this);
+
+        LOG_INFO("Pipe Opened!");
+
+    }
+
+    // ===================================================================================
+
+
+    return 0;
+
+}
+
+bool PiCameraCCD::AbortExposure()
+{
+    /**********************************************************
+   *
+   *
+   *
+   *  IMPORRANT: Put here your CCD abort exposure here
+   *  If there is an error, report it back to client
+   *  e.g.
+   *  LOG_INFO( "Error, unable to abort exposure due to ...");
+   *  return false;
+   *
+   *
+   **********************************************************/
+
+    InExposure = false;
+    carrying   = false;
+
+    terminateFrameStream();
+
+    // A guide exposure, tracking or focusing restart the stream from the timer
+    streamSchedule(POLLMS);
+
+    return true;
+}
+
+
+bool PiCameraCCD::StartGuideExposure(float duration)
+{
+    // Guide frames are summed from whole unpacked frames
+    if (lowMemory)
+    {
+        LOG_WARN("The guide head is not available in low memory mode.");
+        return false;
+    }
+
+    // Region and binning are fixed for the exposure
+    guideHeadX    = GuideCCD.getSubX();
+    guideHeadY    = GuideCCD.getSubY();
+    guideHeadW    = GuideCCD.getSubW();
+    guideHeadH    = GuideCCD.getSubH();
+    guideHeadBinX = GuideCCD.getBinX();
+    guideHeadBinY = GuideCCD.getBinY();
+
+    // Only as large as the binned region
+    int nbuf = (guideHeadW / guideHeadBinX) * (guideHeadH / guideHeadBinY) * GuideCCD.getBPP() / 8;
+
+    nbuf += 512;                                               //  leave a little extra at the end
+    GuideCCD.setFrameBufferSize(nbuf);
+
+    GuideCCD.setExposureDuration(duration);
+    GuideExposureRequest = duration;
+    gettimeofday(&guideHeadStart, nullptr);
+
+    guideExposing = true;
+
+    // Without a primary exposure the stream runs at the guide exposure, up to the usual 1 s frames.
+    // The frames are planned once the stream starts.
+    if (!FrameStreamIsRunning)
+    {
+        subLength = std::min(1.0, (double)duration);
+        startFrameStream();
+        FrameStreamIsRunning = true;
+    }
+    else if (!streamDeferred)
+    {
+        guideHeadPlan();
+    }
+
+    streamSchedule(POLLMS);
+
+    return true;
+}
+
+
+bool PiCameraCCD::AbortGuideExposure()
+{
+    guideExposing = false;
+
+    return true;
+}
+
+
+bool PiCameraCCD::UpdateGuiderFrame(int x, int y, int w, int h)
+{
+    if (x + w > GuideCCD.getXRes() || y + h > GuideCCD.getYRes() || w <= 0 || h <= 0)
+    {
+        LOGF_INFO("Error: invalid guide frame requested %dx%d at %d,%d", w, h, x, y);
+        return false;
+    }
+
+    // The sum in progress is for the old region
+    if (guideExposing)
+    {
+        guideExposing = false;
+        GuideCCD.setExposureFailed();
+        LOG_WARN("Guide exposure aborted, the guide frame changed.");
+    }
+
+    GuideCCD.setFrame(x, y, w, h);
+    guideEncoder.reset();
+
+    return true;
+}
+
+
+bool PiCameraCCD::UpdateGuiderBin(int binx, int biny)
+{
+    GuideCCD.setBin(binx, biny);
+
+    return UpdateGuiderFrame(GuideCCD.getSubX(), GuideCCD.getSubY(), GuideCCD.getSubW(), GuideCCD.getSubH());
+}
+
+
+bool PiCameraCCD::UpdateCCDFrameType(INDI::CCDChip::CCD_FRAME fType)
+{
+    INDI::CCDChip::CCD_FRAME imageFrameType = PrimaryCCD.getFrameType();
+
+    if (fType == imageFrameType)
+        return true;
+
+    switch (imageFrameType)
+    {
+        case INDI::CCDChip::BIAS_FRAME:
+        case INDI::CCDChip::DARK_FRAME:
+            /**********************************************************
+     *
+     *
+     *
+     *  IMPORRANT: Put here your CCD Frame type here
+     *  BIAS and DARK are taken with shutter closed, so _usually_
+     *  most CCD this is a call to let the CCD know next exposure shutter
+     *  must be closed. Customize as appropiate for the hardware
+     *  If there is an error, report it back to client
+     *  e.g.
+     *  LOG_INFO( "Error, unable to set frame type to ...");
+     *  return false;
+     *
+     *
+     **********************************************************/
+            break;
+
+        case INDI::CCDChip::LIGHT_FRAME:
+        case INDI::CCDChip::FLAT_FRAME:
+            /**********************************************************
+     *
+     *
+     *
+     *  IMPORRANT: Put here your CCD Frame type here
+     *  LIGHT and FLAT are taken with shutter open, so _usually_
+     *  most CCD this is a call to let the CCD know next exposure shutter
+     *  must be open. Customize as appropiate for the hardware
+     *  If there is an error, report it back to client
+     *  e.g.
+     *  LOG_INFO( "Error, unable to set frame type to ...");
+     *  return false;
+     *
+     *
+     **********************************************************/
+            break;
+    }
+
+    PrimaryCCD.setFrameType(fType);
+
+    return true;
+}
+
+bool PiCameraCCD::UpdateCCDFrame(int x, int y, int w, int h)
+{
+    // The frame buffer is resized below, so the previous image must be out
+    finalizeWait();
+
+    /* Add the X and Y offsets */
+    long x_1 = x;
+    long y_1 = y;
+
+    long bin_width  = x_1 + (w/* / PrimaryCCD.getBinX()*/);
+    long bin_height = y_1 + (h/* / PrimaryCCD.getBinY()*/);
+
+    if (bin_width > PrimaryCCD.getXRes()/* / PrimaryCCD.getBinX()*/)
+    {
+        LOGF_INFO("Error: invalid width requested %d", w);
+        return false;
+    }
+    else if (bin_height > PrimaryCCD.getYRes()/* / PrimaryCCD.getBinY()*/)
+    {
+        LOGF_INFO("Error: invalid height request %d", h);
+        return false;
+    }
+
+    /**********************************************************
+   *
+   *
+   *
+   *  IMPORRANT: Put here your CCD Frame dimension call
+   *  The values calculated above are BINNED width and height
+   *  which is what most CCD APIs require, but in case your
+   *  CCD API implementation is different, don't forget to change
+   *  the above calculations.
+   *  If there is an error, report it back to client
+   *  e.g.
+   *  LOG_INFO( "Error, unable to set frame to ...");
+   *  return false;
+   *
+   *
+   **********************************************************/
+
+    if ((x_1 == 0) && (y_1 == 0) && (w == sensor->width) && (h == sensor->height))
+    {
+        // Is fullframe image
+
+        fullframe = 1;
+
+    }else{
+
+        fullframe = 0;
+
+    }
+
+    // Set UNBINNED coords
+    PrimaryCCD.setFrame(x_1, y_1, w, h);
+
+    int nbuf;
+    nbuf = (bin_width * bin_height * PrimaryCCD.getBPP() / 8); //  this is pixel count
+
+    // Three planes when debayered
+    if (DebayerS[0].s != ISS_ON)
+    {
+        nbuf *= 3;
+    }
+
+    nbuf += 512;                                               //  leave a little extra at the end
+    PrimaryCCD.setFrameBufferSize(nbuf);
+    PrimaryCCD.setNAxis(DebayerS[0].s != ISS_ON || superpixelBinning() ? 3 : 2);
+
+    LOGF_DEBUG("Setting frame buffer size to %d bytes.", nbuf);
+
+    return true;
+}
+
+bool PiCameraCCD::UpdateCCDBin(int binx, int biny)
+{
+    /**********************************************************
+   *
+   *
+   *
+   *  IMPORRANT: Put here your CCD Binning call
+   *  If there is an error, report it back to client
+   *  e.g.
+   *  LOG_INFO( "Error, unable to set binning to ...");
+   *  return false;
+   *
+   *
+   **********************************************************/
+
+    // Binning of the previous image is still in progress
+    finalizeWait();
+
+    if ((binx == 1) && (biny == 1))
+    {
+        // Is binned
+
+        binned = 0;
+
+    }else{
+
+        binned = 1;
+
+    }
+
+
+    PrimaryCCD.setBin(binx, biny);
+
+    return UpdateCCDFrame(PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(), PrimaryCCD.getSubH());
+}
+
+float PiCameraCCD::CalcTimeLeft()
+{
+    double timesince;
+    double timeleft;
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+
+    timesince = (double)(now.tv_sec * 1000.0 + now.tv_usec / 1000) -
+                (double)(ExpStart.tv_sec * 1000.0 + ExpStart.tv_usec / 1000);
+    timesince = timesince / 1000;
+
+    timeleft = ExposureRequest - timesince;
+
+    return timeleft;
+}
+
+
+
+int PiCameraCCD::getFrame(unsigned short *image){
+
+    size_t result = 0;
+    int loopcount = 0;
+    int received = 0;
+
+
+        ///LOG_INFO("getFrame called");
+
+        // -----------------------------------------
+        if(!frameReader.isOpen()){   // pipe is not open
+
+            return 0;
+
+        }
+        // -----------------------------------------
+
+        if (lowMemory)
+        {
+            return getFrameLowMemory();
+        }
+
+        do{
+
+                loopcount++;
+
+        // Copy the file into the buffer. A part frame is kept in frameOffset
+        // until the rest arrives, so this returns as soon as the capture thread has no more.
+        result = frameReader.read(pData + frameOffset, sensor->blocksize - frameOffset);
+
+             file_length = frameOffset = result + frameOffset;
+
+             // ============================================================
+             //  Unpack raw file
+
+             if(file_length == sensor->blocksize){ // Retrieved all of image
+
+                ///LOGF_INFO("loopcount = %i", loopcount);
+
+                ///LOGF_INFO("... Frame received. -> %li bytes. ", file_length);
+
+                //Reset in buffer
+                frameOffset = 0;
+                received = 1;
+
+                frameArrived();
+
+                struct timeval frameTime;
+                gettimeofday(&frameTime, nullptr);
+
+                // Between exposures frames are only read for the guide star,
+                // the focus metric and recording, so only the rows they use are unpacked.
+                // Frames carried into the next exposure are summed whole.
+                int row_1 = 0;
+                int row_2 = sensor->height;
+
+                if (!InExposure && !carrying)
+                {
+                    guideRows(&row_1, &row_2);
+
+                    if (FocusS[0].s == ISS_ON || LiveStackS[0].s == ISS_ON || ShmS[SHM_FRAMES].s == ISS_ON)
+                    {
+                        // From the even row above, where the live stack starts
+                        int sub_1 = PrimaryCCD.getSubY() & ~1;
+                        int sub_2 = PrimaryCCD.getSubY() + PrimaryCCD.getSubH();
+
+                        row_1 = (row_1 < row_2) ? std::min(row_1, sub_1) : sub_1;
+                        row_2 = std::max(row_2, sub_2);
+                    }
+
+                    if (guideExposing)
+                    {
+                        row_1 = (row_1 < row_2) ? std::min(row_1, guideHeadY) : guideHeadY;
+                        row_2 = std::max(row_2, guideHeadY + guideHeadH);
+                    }
+
+                    if (recorder.isOpen())
+                    {
+                        int rec_1 = recorder.y();
+                        int rec_2 = recorder.y() + recorder.height();
+
+                        row_1 = (row_1 < row_2) ? std::min(row_1, rec_1) : rec_1;
+                        row_2 = std::max(row_2, rec_2);
+                    }
+                }
+
+                // Unpacked, calibrated and summed in one pass. The last frame of an
+                // exposure also counts the final sums of the subframe.
+                bool sum   = (InExposure || carrying) && LuckyS[0].s != ISS_ON;
+                bool stats = framecount + 1 == (InExposure ? numOfFrames : carryLimit);
+
+                framePipeline((const unsigned char *)pData + sensor->header, 0, imageNeeded() ? image : nullptr, 0, row_1,
+                              row_2, sum, stats);
+
+                ///LOG_INFO("Raw Data Unpacked");
+
+                if (recorder.isOpen())
+                {
+                    recordFrame(image, &frameTime);
+                }
+
+                if (ShmS[SHM_FRAMES].s == ISS_ON)
+                {
+                    shmFrame(image, &frameTime);
+                }
+
+                if (guideExposing)
+                {
+                    guideHeadFrame(image);
+                }
+
+                if (LiveStackS[0].s == ISS_ON)
+                {
+                    liveFrame(image);
+                }
+
+                if (GuideCentroidS[0].s == ISS_ON)
+                {
+                    guideCentroid(image);
+                }
+
+                if (FocusS[0].s == ISS_ON)
+                {
+                    focusFrame(image);
+                }
+
+                if (InExposure || carrying)
+                {
+                    // Increment frame count
+                    framecount ++;
+
+                    if (InExposure)
+                    {
+                        LOGF_INFO("Frame %i of %i", framecount, numOfFrames);
+
+                        if (framecount == 1)
+                        {
+                            gettimeofday(&timingFirstFrame, nullptr);
+                        }
+                    }else{
+                        LOGF_DEBUG("Frame %i summed for the next exposure", framecount);
+                    }
+
+                    // ************** Perform Image Operations *****************
+                    // such as summing, averaging, noise clip, etc
+
+                    processFrame(image);
+
+                    // *********************************************************
+
+                    if (InExposure && PreviewS[0].s == ISS_ON)
+                    {
+                        previewCheck();
+                    }
+                }
+/*
+                // ************** Perform Image Operations *****************
+                // For video streaming
+
+                // Summming operation
+                for (long pixel=0; pixel < (long)sensor->width * sensor->height; pixel++) {  // iterate over pixels
+
+                        buffer[pixel] = image[pixel]; // To Do: Change to memcopy
+
+                }
+                // *********************************************************
+*/
+
+            }
+
+
+            // ============================================================
+
+
+        }while(result > 0 && !received);
+
+    return received;
+
+}
+
+
+int PiCameraCCD::addtosum(unsigned short *image, unsigned short *buffer){
+
+    // Summming operation
+    for (long pixel=0; pixel < (long)sensor->width * sensor->height; pixel++) {  // iterate over pixels
+            buffer[pixel] += image[pixel];
+    }
+
+  return 0;
+
+}
+
+
+
+int PiCameraCCD::getFrameLowMemory(){
+
+    // Raw data is read a few rows at a time, and each chunk is unpacked and
+    // summed as soon as it is complete. The full frame is never held in memory.
+
+    long chunkbytes = stagingSize;
+    long framebytes = sensor->blocksize;
+    long header     = sensor->header;
+    size_t result   = 0;
+
+    do{
+
+        // The header is read through the staging buffer and dropped
+        if (frameOffset < header)
+        {
+            result = frameReader.read(pData, std::min(chunkbytes, header - frameOffset));
+            frameOffset += result;
+            continue;
+        }
+
+        // Chunks are counted from the first row
+        long rowOffset  = frameOffset - header;
+        long chunkstart = (rowOffset / chunkbytes) * chunkbytes;
+        long chunkend   = std::min(chunkstart + chunkbytes, framebytes - header);
+
+        // Copy the next part of the chunk into the staging buffer:
+        result = frameReader.read(pData + (rowOffset - chunkstart), chunkend - rowOffset);
+
+        frameOffset += result;
+
+        if(frameOffset - header == chunkend){ // Retrieved all of chunk
+
+            // Rows past the image height (padding at the end of the frame) are skipped
+            int row_1 = chunkstart / sensor->stride;
+            int row_2 = std::min((long)sensor->height, chunkend / sensor->stride);
+
+            if (InExposure && row_2 > row_1)
+            {
+                framePipeline((const unsigned char *)pData, row_1, image, row_1, row_1, row_2, true,
+                              framecount + 1 == numOfFrames);
+            }
+
+            if(frameOffset == framebytes){ // Retrieved all of image
+
+                frameOffset = 0;
+
+                frameArrived();
+
+                if (InExposure)
+                {
+                    // Increment frame count
+                    framecount ++;
+
+                    LOGF_INFO("Frame %i of %i", framecount, numOfFrames);
+
+                    if (framecount == 1)
+                    {
+                        gettimeofday(&timingFirstFrame, nullptr);
+                    }
+
+                    // The buffer holds just the first frame at this point
+                    if (skyPending && framecount == 1)
+                    {
+                        measureSky(buffer);
+                    }
+                    skyPending = false;
+
+                    if (PreviewS[0].s == ISS_ON)
+                    {
+                        previewCheck();
+                    }
+                }
+
+                return 1;
+            }
+        }
+
+    // A part frame is kept in frameOffset until the rest arrives
+    }while(result > 0);
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::updateDiagnostics(){
+
+    // Resident and peak resident memory of the driver
+    FILE *status = fopen("/proc/self/status", "r");
+
+    if (!status)
+        return 0;
+
+    char line[128];
+    long kb;
+
+    while (fgets(line, sizeof(line), status))
+    {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            DiagnosticsN[DIAG_RSS].value = kb / 1024.0;
+        else if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+            DiagnosticsN[DIAG_PEAK_RSS].value = kb / 1024.0;
+    }
+
+    fclose(status);
+
+    // Frame delivery since the last update
+    if (jitterCount > 0)
+    {
+        DiagnosticsN[DIAG_JITTER_RMS].value = sqrt(jitterSum2 / jitterCount) * 1000;
+        DiagnosticsN[DIAG_JITTER_MAX].value = jitterMax * 1000;
+        DiagnosticsN[DIAG_BACKLOG].value    = (double)backlogMax / sensor->blocksize;
+
+        jitterSum2  = 0;
+        jitterMax   = 0;
+        jitterCount = 0;
+        backlogMax  = 0;
+    }
+
+    DiagnosticsNP.s = IPS_OK;
+    IDSetNumber(&DiagnosticsNP, nullptr);
+
+    return 1;
+
+}
+
+
+void PiCameraCCD::frameArrived(){
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // Frames should come one frame period apart, late ones and ones that
+    // waited for the event loop both show up as deviations
+    if (frameLastValid)
+    {
+        double interval  = (now.tv_sec - frameLast.tv_sec) + (now.tv_nsec - frameLast.tv_nsec) / 1e9;
+        double deviation = fabs(interval - streamSubLength);
+
+        jitterSum2 += deviation * deviation;
+        jitterMax   = std::max(jitterMax, deviation);
+        jitterCount++;
+    }
+
+    frameLast      = now;
+    frameLastValid = true;
+
+    // Held by the capture thread, the event loop is behind by this much
+    backlogMax = std::max(backlogMax, (int)frameReader.queued());
+
+    // During exposures they are updated as each image is finished
+    if (!InExposure && jitterCount >= JITTER_FRAMES)
+    {
+        updateDiagnostics();
+    }
+
+}
+
+
+int PiCameraCCD::applyThreads(){
+
+    bool valid = true;
+
+    for (int r = 0; r < CPU_ROLES; r++) {
+
+        if (cpuRoleSet(r, CpusT[r].text) != 0)
+        {
+            LOGF_ERROR("Error: \"%s\" is not a list of CPUs of this Pi, e.g. 3 or 0-2.", CpusT[r].text);
+            valid = false;
+        }
+    }
+
+    cpuCaptureFifo(CapturePriorityN[0].value);
+
+    // The capture thread of a running stream moves now, the next one starts
+    // on them. The event loop and raspiraw keep normal scheduling.
+    int rc = frameReader.applyRole(CPU_ROLE_CAPTURE);
+
+    if (rc != 0)
+    {
+        LOGF_WARN("Cannot set the capture thread CPUs or priority (%s). SCHED_FIFO needs CAP_SYS_NICE or an rtprio limit.",
+                  strerror(rc));
+    }
+
+    CpusTP.s            = valid ? IPS_OK : IPS_ALERT;
+    CapturePriorityNP.s = rc == 0 ? IPS_OK : IPS_ALERT;
+    IDSetText(&CpusTP, nullptr);
+    IDSetNumber(&CapturePriorityNP, nullptr);
+
+    return valid && rc == 0 ? 0 : -1;
+
+}
+
+
+int PiCameraCCD::framePipeline(const unsigned char *raw, int rawRow, unsigned short *image, int imageRow, int row_1,
+                               int row_2, bool sum, bool stats){
+
+    PipelineJob job {};
+
+    job.raw      = raw;
+    job.rawRow   = rawRow;
+    job.image    = image;
+    job.imageRow = imageRow;
+    job.row_1    = row_1;
+    job.row_2    = row_2;
+
+    if (!image)
+    {
+        pipelineScratch.resize(PIPELINE_TILE_BYTES / sizeof(unsigned short));
+        job.scratch = pipelineScratch.data();
+    }
+
+    // Calibration only with a master dark of this mode
+    if (CalibrationS[CALIBRATION_DARK].s == ISS_ON)
+    {
+        job.dark = calibrationDark();
+    }
+
+    if (CalibrationS[CALIBRATION_DEFECTS].s == ISS_ON && !hotPixels.empty() &&
+        (long)masterDark.size() == (long)sensor->width * sensor->height)
+    {
+        job.defects     = hotPixels.data();
+        job.defectCount = hotPixels.size();
+    }
+
+    if (sum)
+    {
+        job.sum = buffer;
+
+        if (stats)
+        {
+            if (row_1 == 0)
+            {
+                statsHistogram.assign(65536, 0);
+            }
+
+            // Rows of the subframe are counted while their sums are in cache
+            job.histogram = statsHistogram.data();
+            job.x_1       = PrimaryCCD.getSubX();
+            job.x_2       = PrimaryCCD.getSubX() + PrimaryCCD.getSubW();
+            job.y_1       = PrimaryCCD.getSubY();
+            job.y_2       = PrimaryCCD.getSubY() + PrimaryCCD.getSubH();
+        }
+
+        statsCollected = stats;
+    }
+
+    sensor->pipeline(job);
+
+    return 0;
+
+}
+
+
+bool PiCameraCCD::imageNeeded(){
+
+    // Between exposures the unpacked rows are all there is. Otherwise only
+    // these read the frame after the pass, without them it is never stored.
+    return !(InExposure || carrying) || LuckyS[0].s == ISS_ON || (skyPending && InExposure) || recorder.isOpen() ||
+           ShmS[SHM_FRAMES].s == ISS_ON || guideExposing || LiveStackS[0].s == ISS_ON ||
+           GuideCentroidS[0].s == ISS_ON || FocusS[0].s == ISS_ON;
+
+}
+
+
+int PiCameraCCD::statsPublish(int frames){
+
+    int x_1 = PrimaryCCD.getSubX();
+    int y_1 = PrimaryCCD.getSubY();
+    int w   = PrimaryCCD.getSubW();
+    int h   = PrimaryCCD.getSubH();
+
+    // Only when no pass made the final sums, e.g. a sequence that carried frames
+    // past the exposure's frame count, is the subframe counted separately
+    if (!statsCollected)
+    {
+        statsHistogram.assign(65536, 0);
+
+        for (int row = y_1; row < y_1 + h; row++) {
+
+            const unsigned short *src = buffer + (long)row * sensor->width + x_1;
+
+            for (int col = 0; col < w; col++) {
+                statsHistogram[src[col]]++;
+            }
+        }
+    }
+
+    statsCollected = false;
+
+    // Everything else follows from the histogram
+    long count = (long)w * h;
+
+    if (count <= 0 || statsHistogram.size() != 65536)
+        return 0;
+
+    int saturation = std::min(65535L, (long)std::max(frames, 1) * ((1 << sensor->bits) - 1));
+
+    int minimum = -1, maximum = 0, median = -1;
+    long total = 0, saturated = 0;
+    double sum = 0, sumsq = 0;
+    double bins[STATS_BINS] = { 0 };
+
+    for (int v = 0; v < 65536; v++) {
+
+        uint32_t n = statsHistogram[v];
+
+        if (n == 0)
+            continue;
+
+        if (minimum < 0)
+            minimum = v;
+        maximum = v;
+
+        total += n;
+        if (median < 0 && total > count / 2)
+            median = v;
+
+        sum += (double)n * v;
+        sumsq += (double)n * v * v;
+
+        if (v >= saturation)
+            saturated += n;
+
+        bins[std::min(STATS_BINS - 1, (int)((long)v * STATS_BINS / (saturation + 1)))] += n;
+    }
+
+    double mean = sum / count;
+
+    StatsN[STATS_MIN].value           = std::max(minimum, 0);
+    StatsN[STATS_MAX].value           = maximum;
+    StatsN[STATS_MEAN].value          = mean;
+    StatsN[STATS_MEDIAN].value        = std::max(median, 0);
+    StatsN[STATS_STDDEV].value        = sqrt(std::max(0.0, sumsq / count - mean * mean));
+    StatsN[STATS_SATURATED].value     = saturated;
+    StatsN[STATS_SATURATED_PCT].value = 100.0 * saturated / count;
+
+    StatsNP.s = IPS_OK;
+    IDSetNumber(&StatsNP, nullptr);
+
+    for (int i = 0; i < STATS_BINS; i++) {
+        HistogramN[i].value = 100.0 * bins[i] / count;
+    }
+
+    HistogramNP.s = IPS_OK;
+    IDSetNumber(&HistogramNP, nullptr);
+
+    return 1;
+
+}
+
+
+int PiCameraCCD::processFrame(unsigned short *image){
+
+    if (skyPending && InExposure)
+    {
+        measureSky(image);
+        skyPending = false;
+    }
+
+    if (LuckyS[0].s == ISS_ON)
+    {
+        // Lucky imaging - keep the frame only if it is among the sharpest so far
+        double score = luckyScore(image);
+
+        LOGF_DEBUG("Frame %i sharpness %.2f", framecount, score);
+
+        luckyKeep(image, score);
+    }
+
+    // Other frames were summed as they were unpacked
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::planSubs(float duration, double *sub, int *frames){
+
+    // Read noise adds to the sky noise in quadrature, once per sub. It raises the
+    // total noise by the tolerance when sky * t = k * rn^2, k = 1 / ((1 + tol)^2 - 1),
+    // with both in electrons. Longer subs gain little more SNR but cost dynamic range,
+    // so that is the length used, limited by the sky filling the pixel range and the max sub.
+    double rn  = SubPlanN[PLAN_READ_NOISE].value;
+    double sky = skyRate * sensor->egain;
+    double tol = SubPlanN[PLAN_TOLERANCE].value / 100.0;
+    double k   = 1.0 / (((1 + tol) * (1 + tol)) - 1);
+
+    double minsub = SubPlanN[PLAN_MIN_SUB].value;
+    double maxsub = SubPlanN[PLAN_MAX_SUB].value;
+
+    double length = 1.0;
+
+    if (skyRate > 0)
+    {
+        length = (k * rn * rn / sky) / EXPOSURE_DUTY;
+
+        double range = (1 << sensor->bits) - 1 - sensor->black;
+        length = std::min(length, (SKY_MAX_FILL * range / skyRate) / EXPOSURE_DUTY);
+
+        length = std::min(std::max(length, minsub), maxsub);
+    }
+
+    // Whole number of equal subs, none longer than planned
+    *frames = std::max(1, (int)ceil(duration / length - 0.001));
+    *sub    = duration / *frames;
+
+    PlanN[PLAN_SKY_RATE].value = skyRate;
+    PlanN[PLAN_SUB].value      = *sub;
+    PlanN[PLAN_FRAMES].value   = *frames;
+    PlanNP.s = IPS_OK;
+    IDSetNumber(&PlanNP, nullptr);
+
+    LOGF_INFO("Sub planner: %i x %.2f s subs (sky %.2f ADU/s, %.2f e-/s).", *frames, *sub, skyRate, sky);
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::measureSky(const unsigned short *image){
+
+    // Median of a sparse grid over the subframe. Stars and hot pixels barely move it.
+    std::vector<unsigned short> samples;
+    samples.reserve(16384);
+
+    int x_1 = PrimaryCCD.getSubX();
+    int y_1 = PrimaryCCD.getSubY();
+    int x_2 = x_1 + PrimaryCCD.getSubW();
+    int y_2 = y_1 + PrimaryCCD.getSubH();
+
+    // Odd step so every Bayer colour is sampled
+    int step = std::max(1, (int)sqrt((double)PrimaryCCD.getSubW() * PrimaryCCD.getSubH() / 16384)) | 1;
+
+    for (int row = y_1; row < y_2; row += step) {
+
+        const unsigned short *r = image + (long)row * sensor->width;
+
+        for (int col = x_1; col < x_2; col += step) {
+            samples.push_back(r[col]);
+        }
+    }
+
+    if (samples.empty())
+        return 0;
+
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+
+    double level = std::max(0, samples[samples.size() / 2] - sensor->black);
+
+    skyRate = level / (streamSubLength * EXPOSURE_DUTY);
+
+    PlanN[PLAN_SKY_RATE].value = skyRate;
+    IDSetNumber(&PlanNP, nullptr);
+
+    LOGF_DEBUG("Sky background %.1f ADU, %.2f ADU/s.", level, skyRate);
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::luckyBegin(){
+
+    // Kept frames are cropped to the subframe, so the pool only grows with the ROI
+    luckyX = PrimaryCCD.getSubX();
+    luckyY = PrimaryCCD.getSubY();
+    luckyW = PrimaryCCD.getSubW();
+    luckyH = PrimaryCCD.getSubH();
+
+    long slotsize = (long)luckyW * luckyH;
+
+    luckySlots = LuckyN[LUCKY_KEEP].value;
+
+    if (luckySlots * slotsize * (long)sizeof(unsigned short) > LUCKY_POOL_MAX)
+    {
+        luckySlots = std::max(1L, LUCKY_POOL_MAX / (slotsize * (long)sizeof(unsigned short)));
+        LOGF_WARN("Lucky imaging: only %i frames fit in memory at this subframe size.", luckySlots);
+    }
+
+    luckyPool.resize(luckySlots * slotsize);
+    luckyHeap.clear();
+    luckyHeap.reserve(luckySlots);
+
+    return 0;
+
+}
+
+
+double PiCameraCCD::luckyScore(const unsigned short *image){
+
+    // Variance of the Laplacian over a window centred on the subframe.
+    // Neighbours are taken two photosites away so each term compares the same Bayer colour.
+    int win = LuckyN[LUCKY_WINDOW].value;
+
+    int w = std::min(win, luckyW);
+    int h = std::min(win, luckyH);
+
+    int x_1 = std::max(2, luckyX + (luckyW - w) / 2);
+    int y_1 = std::max(2, luckyY + (luckyH - h) / 2);
+    int width = sensor->width;
+
+    int x_2 = std::min(width - 2, x_1 + w);
+    int y_2 = std::min(sensor->height - 2, y_1 + h);
+
+    if (x_2 <= x_1 || y_2 <= y_1)
+        return 0;
+
+    int64_t sum = 0;
+    int64_t sumsq = 0;
+
+    for (int row = y_1; row < y_2; row++) {
+
+        const unsigned short *c = image + row * width;
+        const unsigned short *u = c - 2 * width;
+        const unsigned short *d = c + 2 * width;
+
+        // Branch free so the compiler can vectorize the row
+        int32_t rowsum = 0;
+        int64_t rowsq = 0;
+
+        for (int col = x_1; col < x_2; col++) {
+            int32_t lap = (4 * c[col]) - c[col - 2] - c[col + 2] - u[col] - d[col];
+            rowsum += lap;
+            rowsq += lap * lap;
+        }
+
+        sum += rowsum;
+        sumsq += rowsq;
+    }
+
+    double n = (double)(x_2 - x_1) * (y_2 - y_1);
+    double mean = sum / n;
+
+    return (sumsq / n) - (mean * mean);
+
+}
+
+
+int PiCameraCCD::luckyKeep(const unsigned short *image, double score){
+
+    int slot;
+
+    if ((int)luckyHeap.size() < luckySlots)
+    {
+        slot = luckyHeap.size();
+    }
+    else
+    {
+        // Worse than every kept frame
+        if (score <= luckyHeap.front().first)
+            return 0;
+
+        // Replace the worst kept frame
+        std::pop_heap(luckyHeap.begin(), luckyHeap.end(), std::greater<std::pair<double, int>>());
+        slot = luckyHeap.back().second;
+        luckyHeap.pop_back();
+    }
+
+    unsigned short *dst = luckyPool.data() + (long)slot * luckyW * luckyH;
+
+    for (int row = luckyY; row < luckyY + luckyH; row++) {
+
+        const unsigned short *src = image + (row * sensor->width) + luckyX;
+
+        memcpy(dst, src, luckyW * sizeof(unsigned short));
+        dst += luckyW;
+    }
+
+    luckyHeap.push_back(std::make_pair(score, slot));
+    std::push_heap(luckyHeap.begin(), luckyHeap.end(), std::greater<std::pair<double, int>>());
+
+    return 1;
+
+}
+
+
+int PiCameraCCD::luckyStack(unsigned short *buffer){
+
+    if (luckyHeap.empty())
+    {
+        LOG_WARN("Lucky imaging: no frames were kept.");
+        return 0;
+    }
+
+    double best = luckyHeap.front().first;
+
+    // The stacking pass makes the final sums, so they are counted here
+    statsHistogram.assign(65536, 0);
+    bool last = false;
+
+    for (size_t i = 0; i < luckyHeap.size(); i++) {
+
+        last = (i + 1 == luckyHeap.size());
+
+        const unsigned short *src = luckyPool.data() + (long)luckyHeap[i].second * luckyW * luckyH;
+
+        best = std::max(best, luckyHeap[i].first);
+
+        for (int row = luckyY; row < luckyY + luckyH; row++) {
+
+            unsigned short *dst = buffer + (row * sensor->width) + luckyX;
+
+            for (int col = 0; col < luckyW; col++) {
+                uint32_t v = dst[col] + *src++;
+                dst[col] = v > 65535 ? 65535 : v;
+            }
+
+            if (last) {
+                for (int col = 0; col < luckyW; col++) {
+                    statsHistogram[dst[col]]++;
+                }
+            }
+        }
+    }
+
+    statsCollected = true;
+
+    LOGF_INFO("Lucky imaging: stacked %i of %i frames (sharpness %.1f - %.1f).", (int)luckyHeap.size(), framecount,
+              luckyHeap.front().first, best);
+
+    return luckyHeap.size();
+
+}
+
+
+int PiCameraCCD::calibrationLoad(){
+
+    masterDark.clear();
+    darkFrame.clear();
+    hotPixels.clear();
+
+    const char *path = CalibrationT[0].text;
+
+    if (!path || !path[0])
+    {
+        LOG_WARN("Calibration: no master dark file is set.");
+        return -1;
+    }
+
+    fitsfile *fptr = nullptr;
+    int status = 0, naxis = 0, anynul = 0;
+    long naxes[3] = { 0, 0, 0 };
+    double exposure = 0;
+
+    fits_open_diskfile(&fptr, path, READONLY, &status);
+    fits_get_img_dim(fptr, &naxis, &status);
+    fits_get_img_size(fptr, 3, naxes, &status);
+
+    // A raw frame of this mode, as saved by the driver with debayering off
+    if (status == 0 && (naxis != 2 || naxes[0] != sensor->width || naxes[1] != sensor->height))
+    {
+        LOGF_WARN("Calibration: %s is not a %dx%d raw frame.", path, sensor->width, sensor->height);
+        fits_close_file(fptr, &status);
+        return -1;
+    }
+
+    fits_read_key(fptr, TDOUBLE, "EXPTIME", &exposure, nullptr, &status);
+
+    std::vector<unsigned short> dark((long)sensor->width * sensor->height);
+    fits_read_img(fptr, TUSHORT, 1, dark.size(), nullptr, dark.data(), &anynul, &status);
+
+    if (fptr)
+    {
+        int closeStatus = 0;
+        fits_close_file(fptr, &closeStatus);
+    }
+
+    if (status)
+    {
+        char error_status[FLEN_ERRMSG];
+        fits_get_errstatus(status, error_status);
+        LOGF_ERROR("Calibration: %s: %s", path, error_status);
+        return -1;
+    }
+
+    if (exposure <= 0)
+    {
+        LOGF_WARN("Calibration: %s has no exposure time.", path);
+        return -1;
+    }
+
+    masterDark.swap(dark);
+    masterDarkExposure = exposure;
+
+    LOGF_INFO("Calibration: master dark %s, %g s.", path, exposure);
+
+    calibrationDefects();
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::calibrationDefects(){
+
+    hotPixels.clear();
+
+    if (masterDark.empty())
+        return 0;
+
+    // Median of the dark, from its histogram
+    std::vector<uint32_t> histogram(65536, 0);
+
+    for (size_t i = 0; i < masterDark.size(); i++) {
+        histogram[masterDark[i]]++;
+    }
+
+    long half = masterDark.size() / 2, total = 0;
+    int median = 0;
+
+    for (; median < 65535; median++) {
+
+        total += histogram[median];
+
+        if (total > half)
+            break;
+    }
+
+    // Found in scan order, so already sorted
+    int level = median + (int)CalibrationN[0].value;
+
+    for (size_t i = 0; i < masterDark.size(); i++) {
+        if (masterDark[i] > level)
+            hotPixels.push_back(i);
+    }
+
+    LOGF_INFO("Calibration: %i hot pixels over %i ADU.", (int)hotPixels.size(), level);
+
+    return hotPixels.size();
+
+}
+
+
+const unsigned short *PiCameraCCD::calibrationDark(){
+
+    long count = (long)sensor->width * sensor->height;
+
+    if ((long)masterDark.size() != count)
+        return nullptr;
+
+    // The dark signal above the black level grows with the exposure, so it is
+    // scaled from the master dark to the frame period once per sub length
+    if ((long)darkFrame.size() != count || darkFrameSub != streamSubLength)
+    {
+        double scale = streamSubLength / masterDarkExposure;
+
+        darkFrame.resize(count);
+
+        for (long i = 0; i < count; i++) {
+
+            long v = masterDark[i] > sensor->black ? lround((masterDark[i] - sensor->black) * scale) : 0;
+            darkFrame[i] = std::min(v, 65535L);
+        }
+
+        darkFrameSub = streamSubLength;
+    }
+
+    return darkFrame.data();
+
+}
+
+
+void PiCameraCCD::guideHeadPlan(){
+
+    // Whole frames of the running stream, at least one. A stream restarted at
+    // another period starts the sum again, so its frames are all one length.
+    guideHeadSum.assign((long)guideHeadW * guideHeadH, 0);
+    guideHeadFrames = 0;
+    guideHeadNeeded = std::max(1L, lround(GuideExposureRequest / streamSubLength));
+
+    if (GuideExposureRequest < streamSubLength - 0.001)
+        LOGF_WARN("Guide exposure of %g s is shorter than the %g s frames of the running stream, one frame is used.",
+                  GuideExposureRequest, streamSubLength);
+
+    LOGF_DEBUG("Guide exposure of %g s, %d frames of %g s.", GuideExposureRequest, guideHeadNeeded, streamSubLength);
+
+}
+
+
+int PiCameraCCD::guideHeadFrame(const unsigned short *image){
+
+    // Summed at the sensor resolution, binned once at the end
+    for (int j = 0; j < guideHeadH; j++) {
+
+        const unsigned short *src = image + (long)(guideHeadY + j) * sensor->width + guideHeadX;
+        uint32_t *sum             = guideHeadSum.data() + (long)j * guideHeadW;
+
+        for (int i = 0; i < guideHeadW; i++) {
+            sum[i] += src[i];
+        }
+    }
+
+    guideHeadFrames++;
+
+    if (guideHeadFrames < guideHeadNeeded)
+    {
+        GuideCCD.setExposureLeft(std::max(0.0, GuideExposureRequest - guideHeadFrames * streamSubLength));
+        return 0;
+    }
+
+    return guideHeadComplete();
+
+}
+
+
+int PiCameraCCD::guideHeadComplete(){
+
+    guideExposing = false;
+
+    int bx = guideHeadBinX;
+    int by = guideHeadBinY;
+    int ow = guideHeadW / bx;
+    int oh = guideHeadH / by;
+
+    unsigned short *out = (unsigned short *)GuideCCD.getFrameBuffer();
+
+    for (int j = 0; j < oh; j++) {
+        for (int i = 0; i < ow; i++) {
+
+            uint32_t v = 0;
+
+            for (int y = 0; y < by; y++) {
+
+                const uint32_t *sum = guideHeadSum.data() + (long)(j * by + y) * guideHeadW + i * bx;
+
+                for (int x = 0; x < bx; x++) {
+                    v += sum[x];
+                }
+            }
+
+            out[(long)j * ow + i] = std::min(v, (uint32_t)65535);
+        }
+    }
+
+    GuideCCD.setExposureLeft(0);
+
+    LOGF_DEBUG("Guide frame of %d frames, %dx%d.", guideHeadFrames, ow, oh);
+
+    if (GuideFormatS[GUIDE_FORMAT_FITS].s == ISS_ON)
+    {
+        ExposureComplete(&GuideCCD);
+        return 1;
+    }
+
+    // ---------------------------------------------------------------------------
+    // Compact frame, without FITS or the image pipeline of ExposureComplete
+
+    std::vector<unsigned char> frame;
+
+    if (guideEncoder.encode(out, ow, oh, guideHeadX, guideHeadY, bx, by, GuideExposureRequest,
+                            GuideFormatS[GUIDE_FORMAT_DELTA].s == ISS_ON, frame) != 0)
+    {
+        LOG_ERROR("Error: failed to encode the guide frame.");
+        GuideCCD.setExposureFailed();
+        return -1;
+    }
+
+    GuideCompactB[0].blob    = frame.data();
+    GuideCompactB[0].bloblen = frame.size();
+    GuideCompactB[0].size    = frame.size();
+    strncpy(GuideCompactB[0].format, ".pcg", MAXINDIBLOBFMT);
+
+    GuideCompactBP.s = IPS_OK;
+    IDSetBLOB(&GuideCompactBP, nullptr);
+
+    GuideCCD.setExposureComplete();
+
+    LOGF_DEBUG("Compact guide frame %zu bytes, %.1f%% of 16 bit.", frame.size(), 100.0 * frame.size() / (2.0 * ow * oh));
+
+    return 1;
+
+}
+
+
+int PiCameraCCD::guideRows(int *row_1, int *row_2){
+
+    if (GuideCentroidS[0].s != ISS_ON)
+    {
+        *row_1 = *row_2 = 0;
+        return 0;
+    }
+
+    if (!guideLocked)
+    {
+        // Searching - unpack the whole subframe
+        *row_1 = PrimaryCCD.getSubY();
+        *row_2 = PrimaryCCD.getSubY() + PrimaryCCD.getSubH();
+        return 0;
+    }
+
+    // Exactly the rows of the window guideCentroid measures
+    int x_1, y_1;
+    guideWindow(&x_1, &y_1);
+
+    *row_1 = y_1;
+    *row_2 = y_1 + (int)GuideCentroidN[GUIDE_WINDOW].value;
+
+    return 0;
+
+}
+
+
+void PiCameraCCD::guideWindow(int *x_1, int *y_1){
+
+    // Centred on the star, moved inside the sensor near its edges
+    int win  = GuideCentroidN[GUIDE_WINDOW].value;
+    int half = win / 2;
+
+    *x_1 = std::min(std::max(0, (int)lround(guideX) - half), sensor->width - win);
+    *y_1 = std::min(std::max(0, (int)lround(guideY) - half), sensor->height - win);
+
+}
+
+
+bool PiCameraCCD::guideSearch(const unsigned short *image){
+
+    // Brightest 2x2 Bayer quad in the subframe. Summing the quad gives a
+    // luminance value and keeps single hot pixels from winning.
+    int half = GuideCentroidN[GUIDE_WINDOW].value / 2;
+
+    int x_1 = std::max(half, PrimaryCCD.getSubX()) & ~1;
+    int y_1 = std::max(half, PrimaryCCD.getSubY()) & ~1;
+    int width = sensor->width;
+
+    int x_2 = std::min(width - half, PrimaryCCD.getSubX() + PrimaryCCD.getSubW()) - 1;
+    int y_2 = std::min(sensor->height - half, PrimaryCCD.getSubY() + PrimaryCCD.getSubH()) - 1;
+
+    int best = -1;
+
+    for (int row = y_1; row < y_2; row += 2) {
+
+        const unsigned short *r0 = image + row * width;
+        const unsigned short *r1 = r0 + width;
+
+        for (int col = x_1; col < x_2; col += 2) {
+
+            int quad = r0[col] + r0[col + 1] + r1[col] + r1[col + 1];
+
+            if (quad > best)
+            {
+                best  = quad;
+                guideX = col + 0.5;
+                guideY = row + 0.5;
+            }
+        }
+    }
+
+    return best >= 0;
+
+}
+
+
+bool PiCameraCCD::guideCentroid(const unsigned short *image){
+
+    if (!guideLocked && !guideSearch(image))
+    {
+        return false;
+    }
+
+    int win   = GuideCentroidN[GUIDE_WINDOW].value;
+    int width = sensor->width;
+
+    int x_1, y_1;
+    guideWindow(&x_1, &y_1);
+
+    // ---------------------------------------------------------------------------
+    // Background and noise from the window border
+
+    std::vector<int> border;
+    border.reserve(4 * win);
+
+    for (int i = 0; i < win; i++) {
+        border.push_back(image[(y_1 * width) + x_1 + i]);
+        border.push_back(image[((y_1 + win - 1) * width) + x_1 + i]);
+    }
+    for (int i = 1; i < win - 1; i++) {
+        border.push_back(image[((y_1 + i) * width) + x_1]);
+        border.push_back(image[((y_1 + i) * width) + x_1 + win - 1]);
+    }
+
+    std::nth_element(border.begin(), border.begin() + border.size() / 2, border.end());
+    double bg = border[border.size() / 2];
+
+    for (size_t i = 0; i < border.size(); i++) {
+        border[i] = abs(border[i] - (int)bg);
+    }
+
+    std::nth_element(border.begin(), border.begin() + border.size() / 2, border.end());
+    double sigma = std::max(1.0, 1.4826 * border[border.size() / 2]);   // MAD to standard deviation
+
+    // ---------------------------------------------------------------------------
+    // Background subtracted centroid of the pixels above the noise
+
+    double threshold = 3 * sigma;
+    double flux = 0, sx = 0, sy = 0;
+    int npix = 0;
+
+    for (int row = y_1; row < y_1 + win; row++) {
+
+        const unsigned short *r = image + (row * width) + x_1;
+
+        for (int col = 0; col < win; col++) {
+
+            double v = r[col] - bg;
+
+            if (v > threshold)
+            {
+                flux += v;
+                sx   += v * (x_1 + col);
+                sy   += v * row;
+                npix++;
+            }
+        }
+    }
+
+    double snr = (flux > 0) ? flux / sqrt(flux + npix * sigma * sigma) : 0;
+
+    if (snr < GuideCentroidN[GUIDE_MIN_SNR].value)
+    {
+        if (guideLocked)
+        {
+            LOGF_WARN("Guide star lost (SNR %.1f).", snr);
+        }
+
+        guideLocked = false;
+
+        GuideStarN[GUIDE_STAR_SNR].value = snr;
+        GuideStarNP.s = IPS_ALERT;
+        IDSetNumber(&GuideStarNP, nullptr);
+
+        return false;
+    }
+
+    double cx = sx / flux;
+    double cy = sy / flux;
+
+    // ---------------------------------------------------------------------------
+    // Half flux radius, flux weighted mean distance from the centroid
+
+    double sr = 0;
+
+    for (int row = y_1; row < y_1 + win; row++) {
+
+        const unsigned short *r = image + (row * width) + x_1;
+
+        for (int col = 0; col < win; col++) {
+
+            double v = r[col] - bg;
+
+            if (v > threshold)
+            {
+                double dx = (x_1 + col) - cx;
+                double dy = row - cy;
+                sr += v * sqrt(dx * dx + dy * dy);
+            }
+        }
+    }
+
+    // Track the star in the next frame
+    guideX      = cx;
+    guideY      = cy;
+    guideLocked = true;
+
+    GuideStarN[GUIDE_STAR_X].value    = cx;
+    GuideStarN[GUIDE_STAR_Y].value    = cy;
+    GuideStarN[GUIDE_STAR_SNR].value  = snr;
+    GuideStarN[GUIDE_STAR_HFR].value  = sr / flux;
+    GuideStarN[GUIDE_STAR_FLUX].value = flux;
+    GuideStarNP.s = IPS_OK;
+    IDSetNumber(&GuideStarNP, nullptr);
+
+    return true;
+
+}
+
+
+int PiCameraCCD::focusFrame(const unsigned short *image){
+
+    // Stars in the subframe of a single frame, so a focuser can step at the frame rate
+    FocusResult result;
+
+    int nthreads   = cpuWorkerThreads();
+    int saturation = (1 << sensor->bits) - 1;
+
+    focusMeasure(image, sensor->width, PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(),
+                 PrimaryCCD.getSubH(), FocusN[FOCUS_SIGMA].value, saturation, FocusN[FOCUS_MAX_STARS].value, nthreads,
+                 &result);
+
+    focusFrames++;
+
+    FocusValuesN[FOCUS_HFR].value   = result.hfr;
+    FocusValuesN[FOCUS_FWHM].value  = result.fwhm;
+    FocusValuesN[FOCUS_STARS].value = result.stars;
+    FocusValuesN[FOCUS_FRAME].value = focusFrames;
+    FocusValuesNP.s = result.stars > 0 ? IPS_OK : IPS_ALERT;
+    IDSetNumber(&FocusValuesNP, nullptr);
+
+    LOGF_DEBUG("Focus frame %i: %i stars, HFR %.2f, FWHM %.2f", focusFrames, result.stars, result.hfr, result.fwhm);
+
+    return result.stars;
+
+}
+
+
+int PiCameraCCD::recordOpen(){
+
+    char stamp[32];
+    time_t now = time(nullptr);
+    struct tm local;
+    localtime_r(&now, &local);
+    strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &local);
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s_%s.ser", RecordT[0].text, RecordT[1].text, stamp);
+
+    // Raw Bayer frames of the subframe at the sensor resolution
+    int x     = PrimaryCCD.getSubX();
+    int y     = PrimaryCCD.getSubY();
+    int w     = PrimaryCCD.getSubW();
+    int h     = PrimaryCCD.getSubH();
+    int depth = RecordDepthS[0].s == ISS_ON ? 8 : 16;
+
+    if (recorder.open(path, x, y, w, h, sensor->bits, depth, serColorId(BayerT[2].text, x, y), sensor->label) != 0)
+    {
+        LOGF_ERROR("Cannot record to %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    gettimeofday(&recordTime, nullptr);
+    recordStatusTime = recordTime;
+
+    recordStatus(true);
+
+    LOGF_INFO("Recording %dx%d %d bit frames to %s.", w, h, depth, path);
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::recordClose(){
+
+    if (!recorder.isOpen())
+        return 0;
+
+    recordStatus(true);
+
+    long frames  = recorder.frames();
+    long dropped = recorder.dropped();
+
+    if (recorder.close() != 0)
+    {
+        RecordNP.s = IPS_ALERT;
+        IDSetNumber(&RecordNP, nullptr);
+
+        LOG_ERROR("The recording could not be written completely.");
+        return -1;
+    }
+
+    RecordNP.s = IPS_OK;
+    IDSetNumber(&RecordNP, nullptr);
+
+    LOGF_INFO("Recording stopped, %ld frames written, %ld dropped.", frames, dropped);
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::recordFrame(const unsigned short *image, const struct timeval *time){
+
+    if (!recorder.addFrame(image, sensor->width, time))
+    {
+        LOGF_DEBUG("Frame dropped from the recording, %ld so far.", recorder.dropped());
+    }
+
+    if (recorder.failed())
+    {
+        LOG_ERROR("Writing the recording failed, recording stopped.");
+
+        recordClose();
+
+        IUResetSwitch(&RecordSP);
+        RecordS[1].s = ISS_ON;
+        RecordSP.s = IPS_ALERT;
+        IDSetSwitch(&RecordSP, nullptr);
+
+        return -1;
+    }
+
+    recordStatus(false);
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::recordStatus(bool force){
+
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+
+    // About once a second, frames may come much faster
+    double since = (now.tv_sec - recordStatusTime.tv_sec) + (now.tv_usec - recordStatusTime.tv_usec) / 1e6;
+
+    if (!force && since < 1)
+        return 0;
+
+    recordStatusTime = now;
+
+    double elapsed = (now.tv_sec - recordTime.tv_sec) + (now.tv_usec - recordTime.tv_usec) / 1e6;
+
+    RecordN[RECORD_FRAMES].value  = recorder.frames();
+    RecordN[RECORD_DROPPED].value = recorder.dropped();
+    RecordN[RECORD_SIZE].value    = recorder.megabytes();
+    RecordN[RECORD_RATE].value    = elapsed > 0 ? recorder.frames() / elapsed : 0;
+
+    RecordNP.s = recorder.dropped() > 0 ? IPS_ALERT : IPS_BUSY;
+    IDSetNumber(&RecordNP, nullptr);
+
+    return 1;
+
+}
+
+
+int PiCameraCCD::shmOpen(){
+
+    bool images = ShmS[SHM_IMAGES].s == ISS_ON;
+
+    // Room for a whole frame, or a debayered image. Pages only count once used.
+    long bytes = (long)sensor->width * sensor->height * sizeof(unsigned short) * (images ? 3 : 1);
+    int slots  = ShmN[0].value;
+
+    if (shmExport.open(ShmT[0].text, slots, bytes) != 0)
+    {
+        LOGF_ERROR("Error: cannot create shared memory %s (%s). Names start with /, e.g. /indi_picamera.", ShmT[0].text,
+                   strerror(errno));
+        return -1;
+    }
+
+    LOGF_INFO("Exporting %s to /dev/shm%s, %d slots of %.1f MB.", images ? "images" : "frames", ShmT[0].text, slots,
+              bytes / 1048576.0);
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::shmFrame(const unsigned short *image, const struct timeval *time){
+
+    // The subframe from an even row and column, as the live stack
+    int x = PrimaryCCD.getSubX() & ~1;
+    int y = PrimaryCCD.getSubY() & ~1;
+
+    char pattern[8] = "";
+    if (bayer)
+        shmPattern(BayerT[2].text, x, y, pattern);
+
+    ShmItem item {};
+    item.kind      = SHM_KIND_FRAME;
+    item.width     = (PrimaryCCD.getSubX() + PrimaryCCD.getSubW() - x) & ~1;
+    item.height    = (PrimaryCCD.getSubY() + PrimaryCCD.getSubH() - y) & ~1;
+    item.planes    = 1;
+    item.bits      = sensor->bits;
+    item.x         = x;
+    item.y         = y;
+    item.binX      = 1;
+    item.binY      = 1;
+    item.pattern   = pattern;
+    item.timestamp = (uint64_t)time->tv_sec * 1000000ULL + time->tv_usec;
+    item.exposure  = streamSubLength;
+
+    shmExport.publish(item, image + (long)y * sensor->width + x, sensor->width, 0);
+
+    shmStatus(false);
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::shmImage(INDI::CCDChip *targetChip){
+
+    int w = targetChip->getSubW() / targetChip->getBinX();
+    int h = targetChip->getSubH() / targetChip->getBinY();
+
+    // Pattern of the image origin, when it is still a Bayer image
+    char pattern[8] = "";
+    if (GetCCDCapability() & CCD_HAS_BAYER)
+        shmPattern(BayerT[2].text, atoi(BayerT[0].text), atoi(BayerT[1].text), pattern);
+
+    ShmItem item {};
+    item.kind      = SHM_KIND_IMAGE;
+    item.width     = w;
+    item.height    = h;
+    item.planes    = targetChip->getNAxis() == 3 ? 3 : 1;
+    item.bits      = 16;
+    item.x         = targetChip->getSubX();
+    item.y         = targetChip->getSubY();
+    item.binX      = targetChip->getBinX();
+    item.binY      = targetChip->getBinY();
+    item.pattern   = pattern;
+    item.timestamp = (uint64_t)finalTiming[1].tv_sec * 1000000ULL + finalTiming[1].tv_usec;
+    item.exposure  = targetChip->getExposureDuration();
+
+    if (!shmExport.publish(item, (const unsigned short *)targetChip->getFrameBuffer(), w, (long)w * h))
+    {
+        LOG_WARN("Image not exported, it does not fit the shared memory slots.");
+    }
+
+    shmStatus(true);
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::shmStatus(bool force){
+
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+
+    // About once a second, frames may come much faster
+    double since = (now.tv_sec - shmStatusTime.tv_sec) + (now.tv_usec - shmStatusTime.tv_usec) / 1e6;
+
+    if (!force && since < 1)
+        return 0;
+
+    shmStatusTime = now;
+
+    ShmStatusN[0].value = shmExport.published();
+    ShmStatusNP.s       = shmExport.isOpen() ? IPS_BUSY : IPS_IDLE;
+    IDSetNumber(&ShmStatusNP, nullptr);
+
+    return 1;
+
+}
+
+
+static double secondsBetween(const struct timeval *from, const struct timeval *to)
+{
+    return std::max(0.0, (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6);
+}
+
+
+int PiCameraCCD::timingPublish(const struct timeval *finalized, const struct timeval *sent){
+
+    // The worker's copy is not touched by the next exposure until finalizePending is cleared
+    TimingN[TIMING_STARTUP].value     = secondsBetween(&finalTiming[0], &finalTiming[1]);
+    TimingN[TIMING_INTEGRATION].value = secondsBetween(&finalTiming[1], &finalTiming[2]);
+    TimingN[TIMING_FINALIZE].value    = secondsBetween(&finalTiming[2], finalized);
+    TimingN[TIMING_SEND].value        = secondsBetween(finalized, sent);
+    TimingN[TIMING_TOTAL].value       = secondsBetween(&finalTiming[0], sent);
+
+    LOGF_DEBUG("Timing: start %.3f s, integration %.3f s, finalize %.3f s, send %.3f s",
+               TimingN[TIMING_STARTUP].value, TimingN[TIMING_INTEGRATION].value, TimingN[TIMING_FINALIZE].value,
+               TimingN[TIMING_SEND].value);
+
+    TimingNP.s = IPS_OK;
+    IDSetNumber(&TimingNP, nullptr);
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::finalizeStart(){
+
+    // The previous image is sent first, its frame buffer is written again
+    finalizeWait();
+
+    // Everything the worker needs, so it reads no properties and no chip state
+    FinalizeJob &job = finalJob;
+
+    job.frame        = (unsigned short *)PrimaryCCD.getFrameBuffer();
+    job.x            = PrimaryCCD.getSubX();
+    job.y            = PrimaryCCD.getSubY();
+    job.w            = PrimaryCCD.getSubW();
+    job.h            = PrimaryCCD.getSubH();
+    job.binX         = PrimaryCCD.getBinX();
+    job.binY         = PrimaryCCD.getBinY();
+    job.planes       = PrimaryCCD.getNAxis() == 3 ? 3 : 1;
+    job.debayer      = DebayerS[0].s != ISS_ON;
+    job.edge         = DebayerS[2].s == ISS_ON;
+    job.cfaBin       = binned && CfaBinS[CFA_BIN_OFF].s != ISS_ON;
+    job.superpixel   = superpixelBinning();
+    job.rice         = RiceS[0].s == ISS_ON;
+    job.preview      = IUFindOnSwitchIndex(&FinalPreviewSP);
+    job.previewWidth = PreviewN[PREVIEW_WIDTH].value;
+
+    strncpy(job.pattern, BayerT[2].text, sizeof(job.pattern) - 1);
+    job.pattern[sizeof(job.pattern) - 1] = 0;
+
+    pthread_mutex_lock(&finalizeMutex);
+
+    // The worker takes the finished accumulator and the next exposure
+    // sums into the other one
+    std::swap(buffer, finalbuffer);
+
+    finalTiming[0] = timingRequest;
+    finalTiming[1] = timingFirstFrame;
+    finalTiming[2] = timingLastFrame;
+
+    finalizePending = true;
+    pthread_cond_broadcast(&finalizeCv);
+
+    pthread_mutex_unlock(&finalizeMutex);
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::finalizeWait(){
+
+    pthread_mutex_lock(&finalizeMutex);
+
+    while (finalizePending)
+    {
+        pthread_cond_wait(&finalizeCv, &finalizeMutex);
+    }
+
+    pthread_mutex_unlock(&finalizeMutex);
+
+    // Only called on the event loop, so the image can be sent from here
+    finalizePublish();
+
+    return 0;
+
+}
+
+
+int PiCameraCCD::finalizeStop(){
+
+    pthread_mutex_lock(&finalizeMutex);
+    finalizeTerminate = true;
+    pthread_cond_broadcast(&finalizeCv);
+    pthread_mutex_unlock(&finalizeMutex);
+
+    pthread_join(finalize_thread, nullptr);
+
+    // A pending image is still sent
+    finalizePublish();
+
+    if (finalizeCallbackID >= 0)
+    {
+        IERmCallback(finalizeCallbackID);
+        finalizeCallbackID = -1;
+    }
+
+    close(finalizeNotify);
+    finalizeNotify = -1;
+
+    return 0;
+
+}
+
+
+void *PiCameraCCD::finalizeHelper(void *context)
+{
+    return ((PiCameraCCD *)context)->finalizeWorker();
+}
+
+
+void *PiCameraCCD::finalizeWorker()
+{
+    pthread_mutex_lock(&finalizeMutex);
+
+    while (true)
+    {
+        while (!finalizePending && !finalizeTerminate)
+        {
+            pthread_cond_wait(&finalizeCv, &finalizeMutex);
+        }
+
+        // A pending image is still finalized when terminating
+        if (!finalizePending)
+            break;
+
+        // release finalizeMutex
+        pthread_mutex_unlock(&finalizeMutex);
+
+        // The CPUs of the encoder role may have changed since the last image
+        cpuRoleApply(CPU_ROLE_ENCODER);
+
+        finalizeCompute(finalJob);
+
+        // Ready for the next swap, so a following exposure can sum into it straight away
+        memset(finalbuffer, 0, ((long)sensor->width * sensor->height) * sizeof(unsigned short));
+
+        pthread_mutex_lock(&finalizeMutex);
+
+        finalizePending = false;
+        finalizeReady   = true;
+        pthread_cond_broadcast(&finalizeCv);
+
+        // The image is sent from the event loop
+        uint64_t one = 1;
+        if (write(finalizeNotify, &one, sizeof(one)) < 0) {
+        }
+    }
+
+    pthread_mutex_unlock(&finalizeMutex);
+    return 0;
+}
+
+
+int PiCameraCCD::finalizeCompute(FinalizeJob &job){
+
+    // =========================================================================
+    // Subframe, bin or debayer into the frame buffer
+
+    job.unknownPattern = false;
+
+    if (job.debayer)
+    {
+        // **** Demosaic subframe, then bin each colour ****
+        debayerImage(job, finalbuffer, job.frame);
+    }
+    else if (job.cfaBin)
+    {
+        // **** Subframe and bin by colour in one pass ****
+        cfaBinImage(job, finalbuffer, job.frame);
+    }else{
+
+        // **** Perform subframe ****
+        subFrame(job, finalbuffer, job.frame);
+
+        // Binning
+        binFrame(job.frame, job.w, job.h, job.binX, job.binY);
+    }
+
+    gettimeofday(&job.finalized, nullptr);
+
+    // =========================================================================
+    // Encode on all cores, the event loop only sends
+
+    int w        = job.w / job.binX;
+    int h        = job.h / job.binY;
+    int planes   = job.planes;
+    int nthreads = cpuWorkerThreads();
+
+    job.tiles.clear();
+    job.png.clear();
+
+    if (job.rice && job.preview != FINAL_PREVIEW_ONLY)
+    {
+        riceCompressRows(job.frame, w, h * planes, nthreads, job.tiles);
+    }
+
+    if (job.preview != FINAL_PREVIEW_OFF)
+    {
+        std::vector<unsigned char> pixels;
+        int pw = 0, ph = 0;
+
+        if (stretchPreview(job.frame, w, h, planes, job.previewWidth, nthreads, pixels, &pw, &ph) < 0 ||
+            pngEncode(pixels.data(), pw, ph, planes, job.png) < 0)
+        {
+            job.png.clear();
+        }
+    }
+
+    return 0;
+
+}
+
+
+void PiCameraCCD::finalizeReadyHelper(int fd, void *context)
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0) {
+    }
+
+    ((PiCameraCCD *)context)->finalizePublish();
+}
+
+
+int PiCameraCCD::finalizePublish(){
+
+    pthread_mutex_lock(&finalizeMutex);
+    bool ready    = finalizeReady;
+    finalizeReady = false;
+    pthread_mutex_unlock(&finalizeMutex);
+
+    if (!ready)
+        return 0;
+
+    if (finalJob.unknownPattern)
+    {
+        LOGF_WARN("Unknown Bayer pattern %s, %s.", finalJob.pattern,
+                  finalJob.debayer ? "image is not debayered" : "binning by colour instead");
+    }
+
+    // =========================================================================
+    // Send/write image
+
+    // Local programs get the image before it is sent to the client
+    if (ShmS[SHM_IMAGES].s == ISS_ON)
+    {
+        shmImage(&PrimaryCCD);
+    }
+
+    if (finalJob.preview == FINAL_PREVIEW_ONLY)
+    {
+        pngExposureComplete(&PrimaryCCD, true);
+    }
+    else if (finalJob.rice)
+    {
+        riceExposureComplete(&PrimaryCCD);
+    }else{
+        ExposureComplete(&PrimaryCCD);
+    }
+
+    if (finalJob.preview == FINAL_PREVIEW_WITH_FITS)
+    {
+        pngExposureComplete(&PrimaryCCD, false);
+    }
+
+    struct timeval sent;
+    gettimeofday(&sent, nullptr);
+    timingPublish(&finalJob.finalized, &sent);
+
+    LOG_INFO("Image complete.");
+
+    return 1;
+
+}
+
+
+int PiCameraCCD::subFrame(const FinalizeJob &job, unsigned short *image, unsigned short *subframe){
+
+    // Subframe parameters
+    int x_1 = job.x;
+    int y_1 = job.y;
+    int x_2 = x_1 + job.w;
+    int y_2 = y_1 + job.h;
+
+    long pixcount = 0;
+
+    for(int v = y_1; v < y_2; v++){
+
+        for(int h = x_1; h < x_2; h++){
+
+            subframe[pixcount] = image[(v*sensor->width)+h];
+            pixcount++;
+
+        }
+
+    }
+
+
+    ///LOG_INFO("Subframe Completed");
+
+    return 0;
+}
+
+
+int PiCameraCCD::debayerImage(FinalizeJob &job, unsigned short *image, unsigned short *rgb){
+
+    // The colours of a subframe follow from its position on the sensor, so
+    // the sensor's own pattern is used with the full frame coordinates
+    int w = job.w;
+    int h = job.h;
+
+    DebayerMethod method = job.edge ? DEBAYER_EDGE : DEBAYER_BILINEAR;
+    int nthreads = cpuWorkerThreads();
+
+    if (debayerFrame(image, sensor->width, sensor->height, job.x, job.y, w, h, job.pattern, method, nthreads, rgb) < 0)
+    {
+        job.unknownPattern = true;
+
+        // Grey planes keep the frame the shape the client expects
+        subFrame(job, image, rgb);
+        memcpy(rgb + (long)w * h, rgb, (long)w * h * sizeof(unsigned short));
+        memcpy(rgb + 2L * w * h, rgb, (long)w * h * sizeof(unsigned short));
+    }
+
+    int binx = job.binX;
+    int biny = job.binY;
+
+    if (binx > 1 || biny > 1)
+    {
+        long plane  = (long)w * h;
+        long binned = (long)(w / binx) * (h / biny);
+
+        // Each plane is binned in place, then the planes are closed up
+        for (int c = 0; c < 3; c++)
+        {
+            binFrame(rgb + c * plane, w, h, binx, biny);
+            memmove(rgb + c * binned, rgb + c * plane, binned * sizeof(unsigned short));
+        }
+    }
+
+    return 0;
+}
+
+
+bool PiCameraCCD::superpixelBinning(){
+
+    // Superpixels need whole 2x2 cells, and a debayered image is already RGB
+    return CfaBinS[CFA_BIN_SUPERPIXEL].s == ISS_ON && DebayerS[0].s == ISS_ON && binned &&
+           PrimaryCCD.getBinX() % 2 == 0 && PrimaryCCD.getBinY() % 2 == 0;
+}
+
+
+int PiCameraCCD::cfaBinImage(FinalizeJob &job, unsigned short *image, unsigned short *output){
+
+    if (job.superpixel)
+    {
+        if (superpixelFrame(image, sensor->width, job.x, job.y, job.w, job.h, job.binX, job.binY, job.pattern,
+                            output) == 0)
+        {
+            return 0;
+        }
+
+        job.unknownPattern = true;
+
+        // The client still expects three planes
+        long plane = (long)(job.w / job.binX) * (job.h / job.binY);
+        cfaBinFrame(image, sensor->width, job.x, job.y, job.w, job.h, job.binX, job.binY, output);
+        memcpy(output + plane, output, plane * sizeof(unsigned short));
+        memcpy(output + 2 * plane, output, plane * sizeof(unsigned short));
+        return 0;
+    }
+
+    // Same colour, also used for superpixel with odd binning
+    cfaBinFrame(image, sensor->width, job.x, job.y, job.w, job.h, job.binX, job.binY, output);
+
+    return 0;
+}
+
+
+void PiCameraCCD::TimerHit()
+{
+    // The timer has fired and is gone
+    timerID = -1;
+
+    //  No need to reset timer if we are not connected anymore
+    if (!isConnected())
+        return;
+
+    streamUpdate();
+}
+
+
+void PiCameraCCD::streamCallbackHelper(int fd, void *context)
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0) {
+    }
+
+    PiCameraCCD *camera = (PiCameraCCD *)context;
+
+    camera->streamUpdate();
+
+    // raspiraw has closed its output and every frame was read
+    if (camera->FrameStreamIsRunning && camera->frameReader.isOpen() && camera->frameReader.ended())
+    {
+        camera->streamEnded();
+    }
+}
+
+
+void PiCameraCCD::streamEnded()
+{
+    LOG_ERROR("Runtime Error - raspiraw has stopped! Please Check Camera");
+
+    bool exposing = InExposure;
+
+    terminateFrameStream();
+
+    if (exposing)
+    {
+        PrimaryCCD.setExposureFailed();
+    }
+
+    // Tracking, focusing or recording try again from the timer
+    streamSchedule(POLLMS);
+}
+
+
+int PiCameraCCD::sensorInitStart()
+{
+    pthread_mutex_lock(&sensorMutex);
+
+    // Once powered the sensor stays set up, so a reconnect skips camera_i2c
+    if (sensorState == SENSOR_STARTING || sensorState == SENSOR_READY)
+    {
+        pthread_mutex_unlock(&sensorMutex);
+        return 0;
+    }
+
+    if (sensorNotify[0] < 0)
+    {
+        if (pipe(sensorNotify) != 0)
+        {
+            pthread_mutex_unlock(&sensorMutex);
+            LOGF_ERROR("Error: cannot start the sensor set up (%s).", strerror(errno));
+            return -1;
+        }
+
+        fcntl(sensorNotify[0], F_SETFL, O_NONBLOCK);
+
+        // Stays registered, the driver process keeps the one sensor
+        IEAddCallback(sensorNotify[0], &sensorReadyHelper, this);
+    }
+
+    sensorState = SENSOR_STARTING;
+    gettimeofday(&sensorStart, nullptr);
+
+    if (pthread_create(&sensor_thread, nullptr, &sensorInitHelper, this) != 0)
+    {
+        sensorState = SENSOR_FAILED;
+        pthread_mutex_unlock(&sensorMutex);
+        LOG_ERROR("Error: cannot start the sensor set up thread.");
+        return -1;
+    }
+
+    pthread_detach(sensor_thread);
+    pthread_mutex_unlock(&sensorMutex);
+
+    LOG_INFO("Starting the sensor...");
+
+    return 0;
+}
+
+
+int PiCameraCCD::sensorInitState()
+{
+    pthread_mutex_lock(&sensorMutex);
+    int state = sensorState;
+    pthread_mutex_unlock(&sensorMutex);
+
+    return state;
+}
+
+
+void *PiCameraCCD::sensorInitHelper(void *context)
+{
+    return ((PiCameraCCD *)context)->sensorInit();
+}
+
+
+void *PiCameraCCD::sensorInit()
+{
+    int status = 0;
+
+    if(!testing){
+        status = system("camera_i2c");
+    }
+
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+
+    pthread_mutex_lock(&sensorMutex);
+    sensorStatus  = status;
+    sensorSeconds = secondsBetween(&sensorStart, &now);
+    sensorState   = status == 0 ? SENSOR_READY : SENSOR_FAILED;
+    pthread_mutex_unlock(&sensorMutex);
+
+    // The rest is done on the INDI event loop
+    char done = 1;
+    while (write(sensorNotify[1], &done, 1) < 0 && errno == EINTR) {
+    }
+
+    return nullptr;
+}
+
+
+void PiCameraCCD::sensorReadyHelper(int fd, void *context)
+{
+    char done[16];
+    while (read(fd, done, sizeof(done)) > 0) {
+    }
+
+    ((PiCameraCCD *)context)->sensorReady();
+}
+
+
+void PiCameraCCD::sensorReady()
+{
+    pthread_mutex_lock(&sensorMutex);
+    int state     = sensorState;
+    int status    = sensorStatus;
+    double length = sensorSeconds;
+    pthread_mutex_unlock(&sensorMutex);
+
+    if (state == SENSOR_READY)
+    {
+        LOGF_INFO("Sensor ready after %.1f s.", length);
+    }else{
+        // As before, raspiraw is still tried, the script may not be needed
+        LOGF_WARN("camera_i2c failed (status %d), the sensor may not be powered.", status);
+    }
+
+    if (!isConnected())
+        return;
+
+    sensorPublish();
+
+    // Open the stream an exposure or a reader is waiting for
+    if (streamDeferred && FrameStreamIsRunning)
+    {
+        streamDeferred       = false;
+        FrameStreamIsRunning = false;
+        startFrameStream();
+        FrameStreamIsRunning = true;
+
+        // Exposures are timed from the first possible frame
+        if (InExposure && framecount == 0)
+        {
+            gettimeofday(&ExpStart, nullptr);
+            previewTime = ExpStart;
+        }
+
+        streamSchedule(POLLMS);
+    }
+}
+
+
+void PiCameraCCD::sensorPublish()
+{
+    pthread_mutex_lock(&sensorMutex);
+    int state     = sensorState;
+    double length = sensorSeconds;
+    pthread_mutex_unlock(&sensorMutex);
+
+    char text[64];
+
+    switch (state)
+    {
+        case SENSOR_STARTING:
+            snprintf(text, sizeof(text), "Starting");
+            SensorStateTP.s = IPS_BUSY;
+            break;
+        case SENSOR_READY:
+            snprintf(text, sizeof(text), "Ready (%.1f s)", length);
+            SensorStateTP.s = IPS_OK;
+            break;
+        case SENSOR_FAILED:
+            snprintf(text, sizeof(text), "camera_i2c failed");
+            SensorStateTP.s = IPS_ALERT;
+            break;
+        default:
+            snprintf(text, sizeof(text), "Off");
+            SensorStateTP.s = IPS_IDLE;
+            break;
+    }
+
+    IUSaveText(&SensorStateT[0], text);
+    IDSetText(&SensorStateTP, nullptr);
+}
+
 
-    if(FrameStreamIsRunning){
-        return 0;
+void PiCameraCCD::streamSchedule(uint32_t ms)
+{
+    // Stop watching the capture thread while the frames of an exposure are all
+    // in and it only waits for its end time, and leave the next frames queued
+    bool watch = FrameStreamIsRunning && frameReader.isOpen() && !(InExposure && framecount >= numOfFrames);
+
+    if (watch && streamCallbackID < 0)
+    {
+        streamCallbackID = IEAddCallback(frameReader.notifyFd(), &streamCallbackHelper, this);
+    }
+    else if (!watch && streamCallbackID >= 0)
+    {
+        IERmCallback(streamCallbackID);
+        streamCallbackID = -1;
     }
 
-    // ---------------------------------------------------------------------------
-    // ===================================================================================
-    // For Raspi
+    // The timer updates the time left and ends exposures. Between exposures it
+    // only runs to restart the stream for tracking, focusing, recording or exporting.
+    bool reading = GuideCentroidS[0].s == ISS_ON || FocusS[0].s == ISS_ON || RecordS[0].s == ISS_ON ||
+                   LiveStackS[0].s == ISS_ON || ShmS[SHM_FRAMES].s == ISS_ON || guideExposing;
+    bool timer   = InExposure || (reading && !FrameStreamIsRunning);
 
-    if(!testing){
+    if (timerID >= 0)
+    {
+        rmTimer(timerID);
+        timerID = -1;
+    }
 
-        // Create command
-        ostringstream cmd;
+    if (timer)
+    {
+        timerID = SetTimer(ms);
+    }
+}
 
-        cmd << "raspiraw -md 2 -o /dev/stdout -t 9999999 -sr 1 -eus 950000 -g 230 -f 1";
 
-        ///LOGF_INFO("cmd : %s\n", cmd.str().c_str());
+void PiCameraCCD::streamUpdate()
+{
+    uint32_t nextTimer = POLLMS;
 
-        imageFileStreamPipe = popen(cmd.str().c_str(), "r");
+    if (InExposure)
+    {
 
+    if (AbortPrimaryFrame)
+    {
+        InExposure        = false;
+        AbortPrimaryFrame = false;
     }
+    else
+    {
+        float timeleft;
+        timeleft = CalcTimeLeft();
 
-    // --------------------------------------------------------------------------------------
-    // For testing
+        if (timeleft < 0)
+            timeleft = 0;
 
-    if(testing){
+        PrimaryCCD.setExposureLeft(timeleft);
 
-        const char* command = "'/home/jdhill/Link to Pictures/Astro/rawtest/test1/./streamraw'";
+        // =========================================================================
+        // Get next frame, process, and add to buffer
 
-        imageFileStreamPipe = popen(command, "r"); // used for testing with cat file
+        // Grab frame
+        if(framecount < numOfFrames){
 
-    }
+            getFrame(image);
 
-    // ===================================================================================
+        }
 
-    // set pipe as non blocking
-    int d = fileno(imageFileStreamPipe);
-    fcntl(d, F_SETFL, O_NONBLOCK);
+        // =========================================================================
 
-    // Check pipe
-    if (!imageFileStreamPipe){
 
-        LOG_INFO("Runtime Error - popen failed! Please Check Camera");
+        if (timeleft < 1.0)
+        {
+            if (timeleft <= 0.001)
+            {
 
-    }else{
+            // =========================================================================
+            // Get last frame & collect missing frames
 
-        LOG_INFO("Pipe Opened!");
+            ///LOGF_INFO("%i frames were skipped of %i", (numOfFrames - framecount), numOfFrames);
+            ///LOG_INFO("Hit - Exposure done. Final getFrame calls.");
 
-    }
+            if(framecount < numOfFrames)
+            {
 
-    // ===================================================================================
+                  getFrame(image);
 
+            }else{
 
-    return 0;
+                InExposure = false;
+                gettimeofday(&timingLastFrame, nullptr);
 
-}
+                // =========================================================================
+                // Finalize, convert, and send/write image
 
-bool PiCameraCCD::AbortExposure()
-{
-    /**********************************************************
-   *
-   *
-   *
-   *  IMPORRANT: Put here your CCD abort exposure here
-   *  If there is an error, report it back to client
-   *  e.g.
-   *  LOG_INFO( "Error, unable to abort exposure due to ...");
-   *  return false;
-   *
-   *
-   **********************************************************/
+                // **** Stack kept frames ****
+                if (LuckyS[0].s == ISS_ON)
+                {
+                    luckyStack(buffer);
+                }
 
-    InExposure = false;
+                // **** Statistics of the final sums ****
+                statsPublish(LuckyS[0].s == ISS_ON ? luckyHeap.size() : framecount);
 
-    terminateFrameStream();
+                // **** Subframe, bin and send on the finalization worker ****
+                finalizeStart();
 
-    return true;
-}
+                updateDiagnostics();
 
+                // **** Sequence - the next frame goes into the other accumulator ****
+                if (SequenceS[0].s == ISS_ON && LuckyS[0].s != ISS_ON && !lowMemory)
+                {
+                    carrying   = true;
+                    carryLimit = numOfFrames;
+                    framecount = 0;
+                    gettimeofday(&carryStart, nullptr);
+                }
 
-bool PiCameraCCD::UpdateCCDFrameType(INDI::CCDChip::CCD_FRAME fType)
-{
-    INDI::CCDChip::CCD_FRAME imageFrameType = PrimaryCCD.getFrameType();
+                // =========================================================================
 
-    if (fType == imageFrameType)
-        return true;
+                }
 
-    switch (imageFrameType)
-    {
-        case INDI::CCDChip::BIAS_FRAME:
-        case INDI::CCDChip::DARK_FRAME:
-            /**********************************************************
-     *
-     *
-     *
-     *  IMPORRANT: Put here your CCD Frame type here
-     *  BIAS and DARK are taken with shutter closed, so _usually_
-     *  most CCD this is a call to let the CCD know next exposure shutter
-     *  must be closed. Customize as appropiate for the hardware
-     *  If there is an error, report it back to client
-     *  e.g.
-     *  LOG_INFO( "Error, unable to set frame type to ...");
-     *  return false;
-     *
-     *
-     **********************************************************/
-            break;
+            }else{
+
+                //  set a shorter timer
+                nextTimer = timeleft * 1000;
+            }
+
+        }
 
-        case INDI::CCDChip::LIGHT_FRAME:
-        case INDI::CCDChip::FLAT_FRAME:
-            /**********************************************************
-     *
-     *
-     *
-     *  IMPORRANT: Put here your CCD Frame type here
-     *  LIGHT and FLAT are taken with shutter open, so _usually_
-     *  most CCD this is a call to let the CCD know next exposure shutter
-     *  must be open. Customize as appropiate for the hardware
-     *  If there is an error, report it back to client
-     *  e.g.
-     *  LOG_INFO( "Error, unable to set frame type to ...");
-     *  return false;
-     *
-     *
-     **********************************************************/
-            break;
     }
 
-    PrimaryCCD.setFrameType(fType);
+    }else{
 
-    return true;
-}
+        if(carrying){
 
-bool PiCameraCCD::UpdateCCDFrame(int x, int y, int w, int h)
-{
-    /* Add the X and Y offsets */
-    long x_1 = x;
-    long y_1 = y;
+        // ******************************************************************************************
+        // Sequence - sum frames for the next exposure until it is requested
 
-    long bin_width  = x_1 + (w/* / PrimaryCCD.getBinX()*/);
-    long bin_height = y_1 + (h/* / PrimaryCCD.getBinY()*/);
+            if(framecount < carryLimit){
 
-    if (bin_width > PrimaryCCD.getXRes()/* / PrimaryCCD.getBinX()*/)
-    {
-        LOGF_INFO("Error: invalid width requested %d", w);
-        return false;
-    }
-    else if (bin_height > PrimaryCCD.getYRes()/* / PrimaryCCD.getBinY()*/)
-    {
-        LOGF_INFO("Error: invalid height request %d", h);
-        return false;
-    }
+                getFrame(image);
 
-    /**********************************************************
-   *
-   *
-   *
-   *  IMPORRANT: Put here your CCD Frame dimension call
-   *  The values calculated above are BINNED width and height
-   *  which is what most CCD APIs require, but in case your
-   *  CCD API implementation is different, don't forget to change
-   *  the above calculations.
-   *  If there is an error, report it back to client
-   *  e.g.
-   *  LOG_INFO( "Error, unable to set frame to ...");
-   *  return false;
-   *
-   *
-   **********************************************************/
+            }else{
 
-    if ((x_1 == 0) && (y_1 == 0) && (w == 3280) && (h == 2464))
-    {
-        // Is fullframe image
+                // No exposure followed, stop as after a single exposure
+                carrying   = false;
+                framecount = 0;
 
-        fullframe = 1;
+                LOG_INFO("Sequence ended.");
+            }
 
-    }else{
+        // ******************************************************************************************
 
-        fullframe = 0;
+        }else if(GuideCentroidS[0].s == ISS_ON || FocusS[0].s == ISS_ON || RecordS[0].s == ISS_ON ||
+                 LiveStackS[0].s == ISS_ON || ShmS[SHM_FRAMES].s == ISS_ON || guideExposing){
 
-    }
+        // ******************************************************************************************
+        // Keep reading frames for the guide star, the focus metric, recording, live stacking, export
+        // and the guide head
 
-    // Set UNBINNED coords
-    PrimaryCCD.setFrame(x_1, y_1, w, h);
+            if(!FrameStreamIsRunning){
+                startFrameStream();
+                FrameStreamIsRunning = true;
+            }
 
-    int nbuf;
-    nbuf = (bin_width * bin_height * PrimaryCCD.getBPP() / 8); //  this is pixel count
-    nbuf += 512;                                               //  leave a little extra at the end
-    PrimaryCCD.setFrameBufferSize(nbuf);
+            if (recorder.isOpen())
+            {
+                // Every frame is recorded, so frames queued in the pipe are read now
+                for (int i = 0; i < RECORD_DRAIN && getFrame(image) > 0; i++) {
+                }
+            }else{
+                getFrame(image);
+            }
 
-    LOGF_DEBUG("Setting frame buffer size to %d bytes.", nbuf);
+        // ******************************************************************************************
 
-    return true;
-}
+        }else if(FrameStreamIsRunning && frameReader.isOpen()){ // '
 
-bool PiCameraCCD::UpdateCCDBin(int binx, int biny)
-{
-    /**********************************************************
-   *
-   *
-   *
-   *  IMPORRANT: Put here your CCD Binning call
-   *  If there is an error, report it back to client
-   *  e.g.
-   *  LOG_INFO( "Error, unable to set binning to ...");
-   *  return false;
-   *
-   *
-   **********************************************************/
+        // ******************************************************************************************
+        // Frames are no longer used. The pipe is closed without draining it, so a
+        // part frame never holds the event loop until the rest arrives.
 
-    if ((binx == 1) && (biny == 1))
-    {
-        // Is binned
+        framecount     = 0;
+        frameLastValid = false;
 
-        binned = 0;
+        // =========================================================================
+        // Terminate frame stream and close pipe
 
-    }else{
+            terminateFrameStream();
 
-        binned = 1;
+        // =========================================================================
 
-    }
 
+          }
 
-    PrimaryCCD.setBin(binx, biny);
 
-    return UpdateCCDFrame(PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(), PrimaryCCD.getSubH());
+     }
+
+
+    streamSchedule(nextTimer);
 }
 
-float PiCameraCCD::CalcTimeLeft()
+
+
+
+
+
+// Screen stretch to 8 bits of block sums of pixels pixels each, on their
+// means, with the same parameters as the other previews.
+static void autoStretch(const uint32_t *in, long count, uint32_t pixels, unsigned char *out)
 {
-    double timesince;
-    double timeleft;
-    struct timeval now;
-    gettimeofday(&now, nullptr);
+    if (count <= 0)
+        return;
 
-    timesince = (double)(now.tv_sec * 1000.0 + now.tv_usec / 1000) -
-                (double)(ExpStart.tv_sec * 1000.0 + ExpStart.tv_usec / 1000);
-    timesince = timesince / 1000;
+    std::vector<uint32_t> hist(65536, 0);
+
+    for (long i = 0; i < count; i++) {
+        hist[std::min(in[i] / pixels, 65535u)]++;
+    }
+
+    double black, top, m;
+    stretchParameters(hist.data(), count, &black, &top, &m);
+
+    // Every 16 bit level has its own entry, so the faint end is not lost
+    std::vector<unsigned char> lut(65536);
+    double scale = 1.0 / (top - black);
 
-    timeleft = ExposureRequest - timesince;
+    for (int v = 0; v < 65536; v++) {
+        lut[v] = (unsigned char)(255 * midtonesTransfer(m, (v - black) * scale) + 0.5);
+    }
 
-    return timeleft;
+    for (long i = 0; i < count; i++) {
+        out[i] = lut[std::min(in[i] / pixels, 65535u)];
+    }
 }
 
 
+int PiCameraCCD::previewCheck(){
 
-int PiCameraCCD::getFrame(unsigned short *image){
-
-    size_t result = 0;
-    long int totalBytesread = 0;
-    int loopcount = 0;
-    int recheck = 0;
+    bool due = false;
 
+    int frames = PreviewN[PREVIEW_FRAMES].value;
+    if (frames > 0 && framecount - previewFrame >= frames)
+        due = true;
 
-        ///LOG_INFO("getFrame called");
+    double seconds = PreviewN[PREVIEW_SECONDS].value;
+    if (seconds > 0)
+    {
+        struct timeval now;
+        gettimeofday(&now, nullptr);
 
-        // -----------------------------------------
-        if(!imageFileStreamPipe){   // pipe is not open
+        double elapsed = (now.tv_sec - previewTime.tv_sec) + (now.tv_usec - previewTime.tv_usec) / 1e6;
 
-            return 0;
+        if (elapsed >= seconds)
+            due = true;
+    }
 
-        }
-        // -----------------------------------------
+    // The complete image follows the last frame anyway
+    if (!due || framecount >= numOfFrames)
+        return 0;
 
+    // Kept lucky frames are only summed at the end, so there is nothing to show yet
+    if (LuckyS[0].s == ISS_ON)
+        return 0;
 
-        do{
+    previewFrame = framecount;
+    gettimeofday(&previewTime, nullptr);
 
-                loopcount++;
+    return previewSend();
 
-        // Copy the file into the buffer:
-        result = fread (pData + totalBytesread,1,RAWBLOCKSIZE,imageFileStreamPipe);
+}
 
-             file_length = totalBytesread = result + totalBytesread;
 
-             // ============================================================
-             //  Unpack raw file
+int PiCameraCCD::previewSend(){
 
-             if(file_length == RAWBLOCKSIZE){ // Retrieved all of image
+    // ---------------------------------------------------------------------------
+    // Downscale the subframe of the accumulator. Blocks are a whole number of
+    // Bayer quads, so each preview pixel is a luminance sum. This is the only
+    // pass over the accumulator and takes a few milliseconds.
 
-                recheck = 0;
+    int x_1 = PrimaryCCD.getSubX();
+    int y_1 = PrimaryCCD.getSubY();
 
-                ///LOGF_INFO("loopcount = %i", loopcount);
+    int factor = (PrimaryCCD.getSubW() + (int)PreviewN[PREVIEW_WIDTH].value - 1) / (int)PreviewN[PREVIEW_WIDTH].value;
+    factor = std::max(2, (factor + 1) & ~1);
 
-                ///LOGF_INFO("... Frame received. -> %li bytes. ", file_length);
+    int w = PrimaryCCD.getSubW() / factor;
+    int h = PrimaryCCD.getSubH() / factor;
 
-                unsigned long offset;  // offset into file to start reading pixel data
-                unsigned char split;        // single byte with 4 pairs of low-order bits
+    if (w <= 0 || h <= 0)
+        return 0;
 
-                offset = (file_length - RAWBLOCKSIZE) + HEADERSIZE;  // location in file the raw pixel data starts
+    previewSum.assign((long)w * h, 0);
+    previewImage.resize((long)w * h);
 
-                unsigned long p; // position in pData (incrementer)
-                unsigned long iPos; // position in image (incrementer)
+    for (int row = 0; row < h * factor; row++) {
 
-                p = offset; // set to beginning of raw data block
+        const unsigned short *src = buffer + ((y_1 + row) * sensor->width) + x_1;
+        uint32_t *dst = previewSum.data() + (long)(row / factor) * w;
 
-                for (int row=0; row < VPIXELS; row++) {  // iterate over pixel rows
+        for (int x = 0; x < w; x++) {
 
-                    for (int col = 0; col < HPIXELS; col+= 4) {  // iterate over pixel columns
+            uint32_t sum = 0;
 
-                        iPos = (row * HPIXELS) + col;
+            for (int i = 0; i < factor; i++) {
+                sum += src[i];
+            }
 
-                        image[iPos+0] = pData[p++] << 8;
-                        image[iPos+1] = pData[p++] << 8;
-                        image[iPos+2] = pData[p++] << 8;
-                        image[iPos+3] = pData[p++] << 8;
-                        split = pData[p++];    // low-order packed bits from previous 4 pixels
-                        image[iPos+0] += (split & 0b11000000);  // unpack them bits, add to 16-bit values, left-justified
-                        image[iPos+1] += (split & 0b00110000)<<2;
-                        image[iPos+2] += (split & 0b00001100)<<4;
-                        image[iPos+3] += (split & 0b00000011)<<6;
+            dst[x] += sum;
+            src += factor;
+        }
+    }
 
-                    }
+    autoStretch(previewSum.data(), (long)w * h, (uint32_t)(factor * factor), previewImage.data());
 
-                p+= 28; // Extra bytes at end of each row
+    // ---------------------------------------------------------------------------
+    // 8 bit FITS
 
-                } // end
+    fitsfile *fptr = nullptr;
+    int status = 0;
 
-                ///LOG_INFO("Raw Data Unpacked");
+    size_t memsize = 2880;
+    void *memptr = malloc(memsize);
 
-                // Increment frame count
-                framecount ++;
+    if (!memptr)
+        return 0;
 
-                LOGF_INFO("Frame %i of %i", framecount, numOfFrames);
+    long naxes[2] = { w, h };
 
-                //Reset in buffer
-                totalBytesread = 0;
+    fits_create_memfile(&fptr, &memptr, &memsize, 2880, realloc, &status);
+    fits_create_img(fptr, BYTE_IMG, 2, naxes, &status);
+    fits_update_key(fptr, TINT, "FRAMES", &framecount, "Frames summed so far", &status);
+    fits_write_img(fptr, TBYTE, 1, (long)w * h, previewImage.data(), &status);
+    fits_close_file(fptr, &status);
 
+    if (status)
+    {
+        char error_status[FLEN_ERRMSG];
+        fits_get_errstatus(status, error_status);
+        LOGF_ERROR("FITS Error: %s", error_status);
+        free(memptr);
+        return 0;
+    }
 
-                // ************** Perform Image Operations *****************
-                // such as summing, averaging, noise clip, etc
+    previewBlobSend(memptr, memsize, ".fits");
 
-                // Summming operation
-                for (int pixel=0; pixel < HPIXELS * VPIXELS; pixel++) {  // iterate over pixels
-                        buffer[pixel] += image[pixel] >> 6; // remove shift created during image unpacking
-                }
-                // *********************************************************
-/*
-                // ************** Perform Image Operations *****************
-                // For video streaming
+    free(memptr);
 
-                // Summming operation
-                for (int pixel=0; pixel < HPIXELS * VPIXELS; pixel++) {  // iterate over pixels
+    LOGF_DEBUG("Preview %dx%d after %i frames.", w, h, framecount);
 
-                        buffer[pixel] = image[pixel]; // To Do: Change to memcopy
+    return 1;
 
-                }
-                // *********************************************************
-*/
+}
 
-            }
 
+int PiCameraCCD::previewBlobSend(void *data, size_t size, const char *format){
 
-            // ============================================================
+    // Streamed previews and the final PNG share CCD_PREVIEW. Both are sent
+    // from the event loop only, and the BLOB keeps no pointer to data its
+    // owner frees or the worker writes again.
+    PreviewB[0].blob    = data;
+    PreviewB[0].bloblen = size;
+    PreviewB[0].size    = size;
+    strncpy(PreviewB[0].format, format, MAXINDIBLOBFMT);
 
+    PreviewBP.s = IPS_OK;
+    IDSetBLOB(&PreviewBP, nullptr);
 
-        }while(totalBytesread > 0);
+    PreviewB[0].blob    = nullptr;
+    PreviewB[0].bloblen = 0;
+    PreviewB[0].size    = 0;
 
     return 0;
 
 }
 
 
-int PiCameraCCD::addtosum(unsigned short *image, unsigned short *buffer){
+int PiCameraCCD::liveBegin(){
 
-    // Summming operation
-    for (int pixel=0; pixel < HPIXELS * VPIXELS; pixel++) {  // iterate over pixels
-            buffer[pixel] += image[pixel];
+    // The window starts on an even row and column, so it keeps the sensor's
+    // Bayer pattern and can be debayered as it is
+    liveX = PrimaryCCD.getSubX() & ~1;
+    liveY = PrimaryCCD.getSubY() & ~1;
+    liveW = (PrimaryCCD.getSubX() + PrimaryCCD.getSubW() - liveX) & ~1;
+    liveH = (PrimaryCCD.getSubY() + PrimaryCCD.getSubH() - liveY) & ~1;
+
+    long plane = (long)liveW * liveH;
+
+    liveSlots = LiveStackN[LIVE_WINDOW].value;
+
+    if (liveSlots * plane * (long)sizeof(unsigned short) > LIVE_POOL_MAX)
+    {
+        liveSlots = std::max(1L, LIVE_POOL_MAX / (plane * (long)sizeof(unsigned short)));
+        LOGF_WARN("Live stacking: only %i frames fit in memory at this subframe size.", liveSlots);
     }
 
-  return 0;
+    // Empty slots are zero, so the first frames subtract nothing
+    liveRing.assign(liveSlots * plane, 0);
+    liveSum.assign(plane, 0);
+    liveImage.resize(plane);
 
-}
+    liveCount = 0;
+    liveNext  = 0;
+    liveSince = 0;
 
+    return 0;
 
+}
 
-int PiCameraCCD::subFrame(unsigned short *image, unsigned short *subframe){
 
-    // Subframe parameters
-    int x_1 = PrimaryCCD.getSubX();
-    int y_1 = PrimaryCCD.getSubY();
-    int x_2 = x_1 + PrimaryCCD.getSubW();
-    int y_2 = y_1 + PrimaryCCD.getSubH();
+int PiCameraCCD::liveFrame(const unsigned short *image){
 
-    long pixcount = 0;
+    // Restart when the subframe has moved
+    if ((PrimaryCCD.getSubX() & ~1) != liveX || (PrimaryCCD.getSubY() & ~1) != liveY ||
+        ((PrimaryCCD.getSubX() + PrimaryCCD.getSubW() - liveX) & ~1) != liveW ||
+        ((PrimaryCCD.getSubY() + PrimaryCCD.getSubH() - liveY) & ~1) != liveH || liveSum.empty())
+    {
+        liveBegin();
+    }
 
-    for(int v = y_1; v < y_2; v++){
+    // The new frame takes the place of the oldest in the ring and in the
+    // sum, so each frame costs the same whatever the window length
+    unsigned short *slot = liveRing.data() + (long)liveNext * liveW * liveH;
 
-        for(int h = x_1; h < x_2; h++){
+    for (int j = 0; j < liveH; j++) {
 
-            subframe[pixcount] = image[(v*HPIXELS)+h];
-            pixcount++;
+        const unsigned short *src = image + (long)(liveY + j) * sensor->width + liveX;
+        unsigned short *old       = slot + (long)j * liveW;
+        uint32_t *sum             = liveSum.data() + (long)j * liveW;
 
+        for (int i = 0; i < liveW; i++) {
+            sum[i] += (uint32_t)src[i] - old[i];
+            old[i]  = src[i];
         }
-
     }
 
+    liveNext  = (liveNext + 1) % liveSlots;
+    liveCount = std::min(liveCount + 1, liveSlots);
 
-    ///LOG_INFO("Subframe Completed");
+    if (++liveSince >= LiveStackN[LIVE_EVERY].value)
+    {
+        liveSend();
+        liveSince = 0;
+    }
 
     return 0;
-}
 
+}
 
-void PiCameraCCD::TimerHit()
-{
-    uint32_t nextTimer = POLLMS;
 
-    //  No need to reset timer if we are not connected anymore
-    if (!isConnected())
-        return;
+int PiCameraCCD::liveSend(){
 
-    if (InExposure)
-    {
+    long plane = (long)liveW * liveH;
 
-    if (AbortPrimaryFrame)
-    {
-        InExposure        = false;
-        AbortPrimaryFrame = false;
-    }
-    else
+    if (LiveModeS[LIVE_MEAN].s == ISS_ON)
     {
-        float timeleft;
-        timeleft = CalcTimeLeft();
+        uint32_t count = liveCount;
 
-        if (timeleft < 0)
-            timeleft = 0;
+        for (long i = 0; i < plane; i++) {
+            liveImage[i] = (liveSum[i] + count / 2) / count;
+        }
+    }else{
 
-        PrimaryCCD.setExposureLeft(timeleft);
+        for (long i = 0; i < plane; i++) {
+            liveImage[i] = std::min(liveSum[i], (uint32_t)65535);
+        }
+    }
 
-        // =========================================================================
-        // Get next frame, process, and add to buffer
+    int nthreads = cpuWorkerThreads();
 
-        // Grab frame
-        if(framecount < numOfFrames){
+    // In colour when the driver debayers
+    std::vector<unsigned short> rgb;
+    const unsigned short *stack = liveImage.data();
+    int planes = 1;
 
-            getFrame(image);
+    if (DebayerS[0].s != ISS_ON)
+    {
+        DebayerMethod method = DebayerS[2].s == ISS_ON ? DEBAYER_EDGE : DEBAYER_BILINEAR;
+        rgb.resize(3 * plane);
 
+        if (debayerFrame(liveImage.data(), liveW, liveH, 0, 0, liveW, liveH, BayerT[2].text, method, nthreads,
+                         rgb.data()) == 0)
+        {
+            stack  = rgb.data();
+            planes = 3;
         }
+    }
 
-        // =========================================================================
+    std::vector<unsigned char> pixels, png;
+    int pw = 0, ph = 0;
 
+    if (stretchPreview(stack, liveW, liveH, planes, PreviewN[PREVIEW_WIDTH].value, nthreads, pixels, &pw, &ph) < 0 ||
+        pngEncode(pixels.data(), pw, ph, planes, png) < 0)
+    {
+        LOG_ERROR("Error: failed to make the live stack image.");
+        return -1;
+    }
 
-        if (timeleft < 1.0)
-        {
-            if (timeleft <= 0.001)
-            {
+    LiveB[0].blob    = png.data();
+    LiveB[0].bloblen = png.size();
+    LiveB[0].size    = png.size();
+    strncpy(LiveB[0].format, ".png", MAXINDIBLOBFMT);
 
-            // =========================================================================
-            // Get last frame & collect missing frames
+    LiveBP.s = IPS_OK;
+    IDSetBLOB(&LiveBP, nullptr);
 
-            ///LOGF_INFO("%i frames were skipped of %i", (numOfFrames - framecount), numOfFrames);
-            ///LOG_INFO("Hit - Exposure done. Final getFrame calls.");
+    LOGF_DEBUG("Live stack of %i frames sent, %dx%d.", liveCount, pw, ph);
 
-            if(framecount < numOfFrames)
-            {
+    return 0;
 
-                  getFrame(image);
+}
 
-            }else{
 
-                InExposure = false;
+bool PiCameraCCD::pngExposureComplete(INDI::CCDChip *targetChip, bool replace)
+{
+    // Stretched, downscaled 8 bit PNG of the finalized frame buffer, made by
+    // the worker. Sent in place of the FITS, or on the preview BLOB after it.
 
-                // =========================================================================
-                // Finalize, convert, and send/write image
+    std::vector<unsigned char> &png = finalJob.png;
 
-                // **** Perform subframe ****
-                subFrame(buffer, (unsigned short *)PrimaryCCD.getFrameBuffer());
+    if (png.empty())
+    {
+        LOG_ERROR("Error: failed to make the PNG preview.");
+        return replace ? ExposureComplete(targetChip) : false;
+    }
 
-                // Binning
-                PrimaryCCD.binFrame();
+    LOGF_DEBUG("PNG preview of %d bytes.", (int)png.size());
 
-                ExposureComplete(&PrimaryCCD);
+    if (!replace)
+    {
+        previewBlobSend(png.data(), png.size(), ".png");
+        return true;
+    }
 
-                LOG_INFO("Image complete.");
+    // ---------------------------------------------------------------------------
+    // Upload in place of the frame buffer
 
-                // =========================================================================
+    uint8_t *frameBuffer = targetChip->getFrameBuffer();
+    int frameBufferSize  = targetChip->getFrameBufferSize();
+    std::string extension = targetChip->getImageExtension();
 
-                }
+    targetChip->setFrameBuffer(png.data());
+    targetChip->setFrameBufferSize(png.size(), false);
+    targetChip->setImageExtension("png");
 
-            }else{
+    bool rc = ExposureComplete(targetChip);
 
-                //  set a shorter timer
-                nextTimer = timeleft * 1000;
-            }
+    targetChip->setImageExtension(extension.c_str());
+    targetChip->setFrameBufferSize(frameBufferSize, false);
+    targetChip->setFrameBuffer(frameBuffer);
 
-        }
+    return rc;
+}
 
-    }
 
-    }else{
+bool PiCameraCCD::riceExposureComplete(INDI::CCDChip *targetChip)
+{
+    // Tile compressed FITS (RICE_1, one tile per row). The worker compressed
+    // the tiles on all cores straight from the finalized frame buffer, here
+    // they are written out and sent in place of the frame buffer with the
+    // fpack extension.
 
-        if(FrameStreamIsRunning){ // '
+    int w = finalJob.w / finalJob.binX;
+    int h = finalJob.h / finalJob.binY;
 
-        // ******************************************************************************************
-        // Read and dispose of unused frame
+    // Debayered images are three planes, still one tile per row
+    int planes = finalJob.planes;
+    int rows   = h * planes;
 
-        size_t result = 0;
-        long int totalBytesread = 0;
-        int loopcount = 0;
+    std::vector<std::vector<unsigned char>> &tiles = finalJob.tiles;
 
-        do{
+    if ((int)tiles.size() != rows)
+    {
+        LOG_ERROR("Error: Rice tiles missing.");
+        return ExposureComplete(targetChip);
+    }
 
-            loopcount++;
+    // ---------------------------------------------------------------------------
+    // Write compressed image HDU
 
-            // Copy the file into the buffer:
-            result = fread (pData + totalBytesread,1,RAWBLOCKSIZE,imageFileStreamPipe);
+    fitsfile *fptr = nullptr;
+    int status = 0;
 
-            file_length = totalBytesread = result + totalBytesread;
+    size_t memsize = 2880;
+    void *memptr = malloc(memsize);
 
-            if(file_length == RAWBLOCKSIZE){ // Retrieved all of frame
+    if (!memptr)
+    {
+        LOG_ERROR("Error: failed to allocate memory for Rice FITS.");
+        return ExposureComplete(targetChip);
+    }
 
-                ///LOGF_INFO("... Frame received and deleted. -> %li bytes. ", file_length);
+    fits_create_memfile(&fptr, &memptr, &memsize, 2880, realloc, &status);
+
+    // Empty primary HDU
+    fits_create_img(fptr, BYTE_IMG, 0, nullptr, &status);
+
+    char ttype[] = "COMPRESSED_DATA";
+    char tform[] = "1PB";
+    char *ttypes[] = { ttype };
+    char *tforms[] = { tform };
+
+    fits_create_tbl(fptr, BINARY_TBL, rows, 1, ttypes, tforms, nullptr, "COMPRESSED_IMAGE", &status);
+
+    int zimage = 1, zbitpix = 16, znaxis = planes == 3 ? 3 : 2, blocksize = RICE_BLOCKSIZE, bytepix = 2, bscale = 1;
+    long znaxis1 = w, znaxis2 = h, znaxis3 = planes, ztile2 = 1, ztile3 = 1, bzero = 32768;
+    char zcmptype[] = "RICE_1";
+    char zname1[] = "BLOCKSIZE";
+    char zname2[] = "BYTEPIX";
+
+    fits_update_key(fptr, TLOGICAL, "ZIMAGE", &zimage, "extension contains compressed image", &status);
+    fits_update_key(fptr, TINT, "ZBITPIX", &zbitpix, "data type of original image", &status);
+    fits_update_key(fptr, TINT, "ZNAXIS", &znaxis, "dimension of original image", &status);
+    fits_update_key(fptr, TLONG, "ZNAXIS1", &znaxis1, "length of original image axis", &status);
+    fits_update_key(fptr, TLONG, "ZNAXIS2", &znaxis2, "length of original image axis", &status);
+    if (planes == 3)
+        fits_update_key(fptr, TLONG, "ZNAXIS3", &znaxis3, "length of original image axis", &status);
+    fits_update_key(fptr, TLONG, "ZTILE1", &znaxis1, "size of tiles to be compressed", &status);
+    fits_update_key(fptr, TLONG, "ZTILE2", &ztile2, "size of tiles to be compressed", &status);
+    if (planes == 3)
+        fits_update_key(fptr, TLONG, "ZTILE3", &ztile3, "size of tiles to be compressed", &status);
+    fits_update_key(fptr, TSTRING, "ZCMPTYPE", zcmptype, "compression algorithm", &status);
+    fits_update_key(fptr, TSTRING, "ZNAME1", zname1, "compression block size", &status);
+    fits_update_key(fptr, TINT, "ZVAL1", &blocksize, "pixels per block", &status);
+    fits_update_key(fptr, TSTRING, "ZNAME2", zname2, "bytes per pixel (1, 2, 4, or 8)", &status);
+    fits_update_key(fptr, TINT, "ZVAL2", &bytepix, "bytes per pixel (1, 2, 4, or 8)", &status);
+    fits_update_key(fptr, TINT, "BSCALE", &bscale, "default scaling factor", &status);
+    fits_update_key(fptr, TLONG, "BZERO", &bzero, "offset data range to that of unsigned short", &status);
+
+    addFITSKeywords(fptr, targetChip);
+
+    for (int row = 0; row < rows && !status; row++) {
+        fits_write_col(fptr, TBYTE, 1, row + 1, 1, tiles[row].size(), tiles[row].data(), &status);
+    }
 
-                //Reset in buffer
-                totalBytesread = 0;
+    fits_close_file(fptr, &status);
 
-                }
+    if (status)
+    {
+        char error_status[FLEN_ERRMSG];
+        fits_get_errstatus(status, error_status);
+        LOGF_ERROR("FITS Error: %s", error_status);
+        free(memptr);
+        return ExposureComplete(targetChip);
+    }
 
-            }while(totalBytesread > 0);
+    LOGF_DEBUG("Rice FITS %d bytes (%.2fx).", (int)memsize, (2.0 * w * rows) / memsize);
 
-        // ******************************************************************************************
+    // ---------------------------------------------------------------------------
+    // Upload in place of the frame buffer
 
-        framecount = 0;
+    uint8_t *frameBuffer = targetChip->getFrameBuffer();
+    int frameBufferSize  = targetChip->getFrameBufferSize();
+    std::string extension = targetChip->getImageExtension();
 
-        // =========================================================================
-        // Terminate frame stream and close pipe
+    targetChip->setFrameBuffer((uint8_t *)memptr);
+    targetChip->setFrameBufferSize(memsize, false);
+    targetChip->setImageExtension("fits.fz");
 
-            terminateFrameStream();
+    bool rc = ExposureComplete(targetChip);
 
-        // =========================================================================
+    targetChip->setImageExtension(extension.c_str());
+    targetChip->setFrameBufferSize(frameBufferSize, false);
+    targetChip->setFrameBuffer(frameBuffer);
 
+    free(memptr);
 
-          }
+    return rc;
+}
 
+IPState PiCameraCCD::GuideNorth(uint32_t ms)
+{
+    return guidePulse(PULSE_NORTH, ms);
+}
 
-     }
+IPState PiCameraCCD::GuideSouth(uint32_t ms)
+{
+    return guidePulse(PULSE_SOUTH, ms);
+}
 
+IPState PiCameraCCD::GuideEast(uint32_t ms)
+{
+    return guidePulse(PULSE_EAST, ms);
+}
 
-    SetTimer(nextTimer);
+IPState PiCameraCCD::GuideWest(uint32_t ms)
+{
+    return guidePulse(PULSE_WEST, ms);
 }
 
+int PiCameraCCD::guidePortOpen()
+{
+    int offsets[4];
 
+    for (int i = 0; i < 4; i++) {
+        offsets[i] = GpioN[i].value;
+    }
 
+    if (guider.open(GpioT[0].text, offsets, GpioActiveS[1].s == ISS_ON) != 0)
+    {
+        LOGF_WARN("Guide port: cannot open lines %d, %d, %d, %d of %s (%s).", offsets[0], offsets[1], offsets[2],
+                  offsets[3], GpioT[0].text, strerror(errno));
+        return -1;
+    }
 
+    LOGF_INFO("Guide port on %s, lines N %d S %d E %d W %d, active %s.", GpioT[0].text, offsets[0], offsets[1],
+              offsets[2], offsets[3], GpioActiveS[1].s == ISS_ON ? "low" : "high");
 
+    return 0;
+}
 
-IPState PiCameraCCD::GuideNorth(uint32_t ms)
+IPState PiCameraCCD::guidePulse(PulseDirection direction, uint32_t ms)
 {
-    INDI_UNUSED(ms);
-    /**********************************************************
-   *
-   *
-   *
-   *  IMPORRANT: Put here your CCD Guide call
-   *  Some CCD API support pulse guiding directly (i.e. without timers)
-   *  Others implement GUIDE_ON and GUIDE_OFF for each direction, and you
-   *  will have to start a timer and then stop it after the 'ms' milliseconds
-   *  For an example on timer usage, please refer to indi-sx and indi-gpusb drivers
-   *  available in INDI 3rd party repository
-   *  If there is an error, report it back to client
-   *  e.g.
-   *  LOG_INFO( "Error, unable to guide due ...");
-   *  return IPS_ALERT;
-   *
-   *
-   **********************************************************/
+    if (!guider.isOpen())
+    {
+        LOG_ERROR("Guide port is not open.");
+        return IPS_ALERT;
+    }
 
-    return IPS_OK;
-}
+    if (ms == 0)
+        return IPS_OK;
 
-IPState PiCameraCCD::GuideSouth(uint32_t ms)
-{
-    INDI_UNUSED(ms);
-    /**********************************************************
-     *
-     *
-     *
-     *  IMPORRANT: Put here your CCD Guide call
-     *  Some CCD API support pulse guiding directly (i.e. without timers)
-     *  Others implement GUIDE_ON and GUIDE_OFF for each direction, and you
-     *  will have to start a timer and then stop it after the 'ms' milliseconds
-     *  For an example on timer usage, please refer to indi-sx and indi-gpusb drivers
-     *  available in INDI 3rd party repository
-     *  If there is an error, report it back to client
-     *  e.g.
-     *  LOG_INFO( "Error, unable to guide due ...");
-     *  return IPS_ALERT;
-     *
-     *
-     **********************************************************/
+    if (guider.pulse(direction, ms) != 0)
+    {
+        LOGF_ERROR("Guide pulse failed (%s).", strerror(errno));
+        return IPS_ALERT;
+    }
 
-    return IPS_OK;
+    // Completed from guidePulseDone when the scheduler has ended it
+    return IPS_BUSY;
 }
 
-IPState PiCameraCCD::GuideEast(uint32_t ms)
+void PiCameraCCD::guidePulseHelper(int fd, void *context)
 {
-    INDI_UNUSED(ms);
-    /**********************************************************
-     *
-     *
-     *
-     *  IMPORRANT: Put here your CCD Guide call
-     *  Some CCD API support pulse guiding directly (i.e. without timers)
-     *  Others implement GUIDE_ON and GUIDE_OFF for each direction, and you
-     *  will have to start a timer and then stop it after the 'ms' milliseconds
-     *  For an example on timer usage, please refer to indi-sx and indi-gpusb drivers
-     *  available in INDI 3rd party repository
-     *  If there is an error, report it back to client
-     *  e.g.
-     *  LOG_INFO( "Error, unable to guide due ...");
-     *  return IPS_ALERT;
-     *
-     *
-     **********************************************************/
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0) {
+    }
 
-    return IPS_OK;
+    ((PiCameraCCD *)context)->guidePulseDone();
 }
 
-IPState PiCameraCCD::GuideWest(uint32_t ms)
+void PiCameraCCD::guidePulseDone()
 {
-    INDI_UNUSED(ms);
-    /**********************************************************
-     *
-     *
-     *
-     *  IMPORRANT: Put here your CCD Guide call
-     *  Some CCD API support pulse guiding directly (i.e. without timers)
-     *  Others implement GUIDE_ON and GUIDE_OFF for each direction, and you
-     *  will have to start a timer and then stop it after the 'ms' milliseconds
-     *  For an example on timer usage, please refer to indi-sx and indi-gpusb drivers
-     *  available in INDI 3rd party repository
-     *  If there is an error, report it back to client
-     *  e.g.
-     *  LOG_INFO( "Error, unable to guide due ...");
-     *  return IPS_ALERT;
-     *
-     *
-     **********************************************************/
+    static const char *directions[] = { "North", "South", "East", "West" };
+
+    std::vector<PulseResult> results;
+    guider.completed(results);
+
+    for (size_t i = 0; i < results.size(); i++) {
+
+        const PulseResult &r = results[i];
+
+        // A pulse cut short by the next one on its axis is completed by that one
+        if (r.cut)
+        {
+            LOGF_DEBUG("Guide pulse %s %u ms cut short at %.3f ms.", directions[r.direction], r.requested, r.width);
+            continue;
+        }
+
+        // Ended by stop or close, the axis is finished but the width says nothing of the timing
+        if (r.stopped)
+        {
+            LOGF_INFO("Guide pulse %s %u ms stopped at %.3f ms.", directions[r.direction], r.requested, r.width);
+            GuideComplete(r.axis == PULSE_RA ? AXIS_RA : AXIS_DE);
+            continue;
+        }
+
+        double error = r.width - r.requested;
+
+        pulseSum2 += error * error;
+        pulseMax = std::max(pulseMax, fabs(error));
+        pulseCount++;
+
+        if (fabs(error) > PULSE_WARN)
+        {
+            LOGF_WARN("Guide pulse %s %u ms was %.3f ms.", directions[r.direction], r.requested, r.width);
+        }else{
+            LOGF_DEBUG("Guide pulse %s %u ms was %.3f ms.", directions[r.direction], r.requested, r.width);
+        }
+
+        PulseN[PULSE_LAST].value  = error;
+        PulseN[PULSE_RMS].value   = sqrt(pulseSum2 / pulseCount);
+        PulseN[PULSE_MAX].value   = pulseMax;
+        PulseN[PULSE_COUNT].value = pulseCount;
 
-    return IPS_OK;
+        GuideComplete(r.axis == PULSE_RA ? AXIS_RA : AXIS_DE);
+    }
+
+    if (isConnected() && !results.empty())
+    {
+        PulseNP.s = IPS_OK;
+        IDSetNumber(&PulseNP, nullptr);
+    }
 }
 
 // *****************************************************************************************
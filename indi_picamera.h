@@ -26,6 +26,14 @@
 
 #include <indiccd.h>
 #include <iostream>
+#include <vector>
+
+#include "sensor_modes.h"
+#include "ser_recorder.h"
+#include "shm_export.h"
+#include "guide_frame.h"
+#include "pulse_guide.h"
+#include "frame_reader.h"
 
 using namespace std;
 
@@ -43,6 +51,10 @@ class PiCameraCCD : public INDI::CCD
     void ISGetProperties(const char *dev);
     bool updateProperties();
 
+    bool ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n);
+    bool ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n);
+    bool ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n);
+
     bool Connect();
     bool Disconnect();
 
@@ -50,12 +62,15 @@ class PiCameraCCD : public INDI::CCD
     bool StartExposure(float duration);
     bool AbortExposure();
 
-//    bool StartGuideExposure(float) override;
-//    bool AbortGuideExposure() override;
+    bool StartGuideExposure(float duration);
+    bool AbortGuideExposure();
 
     static void *streamVideoHelper(void *context);
     void *streamVideo();
 
+    static void *finalizeHelper(void *context);
+    void *finalizeWorker();
+
 
     char * pData;
     unsigned short *image;
@@ -63,12 +78,15 @@ class PiCameraCCD : public INDI::CCD
     unsigned short *guideoutputframe;
     unsigned short *subframe;
     unsigned short *buffer;
+    unsigned short *finalbuffer;
 
   protected:
     void TimerHit();
     virtual bool UpdateCCDFrame(int x, int y, int w, int h);
     virtual bool UpdateCCDBin(int binx, int biny);
     virtual bool UpdateCCDFrameType(INDI::CCDChip::CCD_FRAME fType);
+    virtual bool UpdateGuiderFrame(int x, int y, int w, int h);
+    virtual bool UpdateGuiderBin(int binx, int biny);
 
     // Guide Port
     virtual IPState GuideNorth(uint32_t ms);
@@ -82,6 +100,8 @@ class PiCameraCCD : public INDI::CCD
     virtual bool StartStreaming();
     virtual bool StopStreaming();
 
+    virtual bool saveConfigItems(FILE *fp);
+
   private:
     DEVICE device;
     char name[32];
@@ -90,7 +110,7 @@ class PiCameraCCD : public INDI::CCD
     double minDuration;
     unsigned short *imageBuffer;
 
-    int timerID;
+    int timerID { -1 };
 
     INDI::CCDChip::CCD_FRAME imageFrameType;
 
@@ -99,7 +119,7 @@ class PiCameraCCD : public INDI::CCD
     float ExposureRequest;
     float TemperatureRequest;
 
-//    float GuideExposureRequest { 0 };
+    float GuideExposureRequest { 0 };
 
 //    bool AbortGuideFrame { false };
     bool AbortPrimaryFrame { false };
@@ -108,17 +128,414 @@ class PiCameraCCD : public INDI::CCD
 
     float CalcTimeLeft();
 
+    // Sensor mode
+    std::vector<ISwitch> SensorS;
+    ISwitchVectorProperty SensorSP;
+    const SensorMode *sensor { &sensorModes[0] };
+
+    // Low memory streaming
+    ISwitch LowMemoryS[2];
+    ISwitchVectorProperty LowMemorySP;
+
+    bool lowMemory { false };
+    long stagingSize { 0 };     // bytes of raw data held in pData
+    long frameOffset { 0 };     // bytes of the current frame read so far
+
+    int getFrameLowMemory();
+
+    // Diagnostics
+    enum { DIAG_RSS, DIAG_PEAK_RSS, DIAG_JITTER_RMS, DIAG_JITTER_MAX, DIAG_BACKLOG };
+    INumber DiagnosticsN[5];
+    INumberVectorProperty DiagnosticsNP;
+
+    int updateDiagnostics();
+
+    // Frame delivery, the deviation of the time between frames from the frame
+    // period, and the bytes left in the pipe when a frame is read
+    struct timespec frameLast;
+    bool frameLastValid { false };
+    double jitterSum2 { 0 };
+    double jitterMax { 0 };
+    long jitterCount { 0 };
+    int backlogMax { 0 };
+
+    void frameArrived();
+
+    // Thread CPUs and capture priority
+    enum { CPUS_CAPTURE, CPUS_WORKERS, CPUS_ENCODER };
+    IText CpusT[3] {};
+    ITextVectorProperty CpusTP;
+    INumber CapturePriorityN[1];
+    INumberVectorProperty CapturePriorityNP;
+
+    int applyThreads();
+
+    // Exposure timing, from the request to the image sent
+    enum { TIMING_STARTUP, TIMING_INTEGRATION, TIMING_FINALIZE, TIMING_SEND, TIMING_TOTAL };
+    INumber TimingN[5];
+    INumberVectorProperty TimingNP;
+
+    struct timeval timingRequest;       // exposure requested
+    struct timeval timingFirstFrame;    // first frame of the exposure read
+    struct timeval timingLastFrame;     // last frame of the exposure read
+    struct timeval finalTiming[3];      // the same, for the image on the finalization worker
+
+    int timingPublish(const struct timeval *finalized, const struct timeval *sent);
+
+    // Image statistics
+    enum { STATS_MIN, STATS_MAX, STATS_MEAN, STATS_MEDIAN, STATS_STDDEV, STATS_SATURATED, STATS_SATURATED_PCT };
+    INumber StatsN[7];
+    INumberVectorProperty StatsNP;
+    INumber HistogramN[16];
+    INumberVectorProperty HistogramNP;
+
+    std::vector<uint32_t> statsHistogram;   // summed values of the subframe, one bin per level
+    bool statsCollected { false };          // histogram holds the final sums of this exposure
+
+    int statsPublish(int frames);
+
+    // An image on the finalization worker. Settings and geometry are copied
+    // into it on the event loop, the worker only computes from them, and the
+    // image is sent from the event loop once finalizeNotify is written.
+    struct FinalizeJob
+    {
+        unsigned short *frame;          // PrimaryCCD frame buffer
+        int x, y, w, h, binX, binY;
+        int planes;
+        bool debayer;                   // to three planes
+        bool edge;                      // edge aware, otherwise bilinear
+        bool cfaBin;                    // bin by colour
+        bool superpixel;
+        char pattern[MAXINDINAME];      // sensor CFA pattern
+        bool rice;
+        int preview;                    // FINAL_PREVIEW_*
+        int previewWidth;
+
+        bool unknownPattern;            // results
+        std::vector<std::vector<unsigned char>> tiles;
+        std::vector<unsigned char> png;
+        struct timeval finalized;
+    };
+
+    // Frame pipeline. Rows [row_1, row_2) of a raw frame are unpacked (into
+    // image, or only a tile at a time without it), calibrated and, with sum,
+    // added to the buffer in one pass. stats also counts the final sums.
+    std::vector<unsigned short> pipelineScratch;
+
+    int framePipeline(const unsigned char *raw, int rawRow, unsigned short *image, int imageRow, int row_1, int row_2,
+                      bool sum, bool stats);
+    bool imageNeeded();
+
     int getFrame(unsigned short *image);
-    int subFrame(unsigned short *image, unsigned short *subframe);
+    int subFrame(const FinalizeJob &job, unsigned short *image, unsigned short *subframe);
     int addtosum(unsigned short *image, unsigned short *buffer);
+    int processFrame(unsigned short *image);
+
+    // Lucky imaging
+    ISwitch LuckyS[2];
+    ISwitchVectorProperty LuckySP;
+    enum { LUCKY_KEEP, LUCKY_WINDOW };
+    INumber LuckyN[2];
+    INumberVectorProperty LuckyNP;
+
+    std::vector<unsigned short> luckyPool;          // kept ROI frames, one slot each
+    std::vector<std::pair<double, int>> luckyHeap; // (score, slot), worst score on top
+    int luckySlots { 0 };
+    int luckyX { 0 }, luckyY { 0 }, luckyW { 0 }, luckyH { 0 };
+
+    int luckyBegin();
+    double luckyScore(const unsigned short *image);
+    int luckyKeep(const unsigned short *image, double score);
+    int luckyStack(unsigned short *buffer);
+
+    // Calibration - a master dark and the hot pixels found in it
+    enum { CALIBRATION_DARK, CALIBRATION_DEFECTS };
+    ISwitch CalibrationS[2];
+    ISwitchVectorProperty CalibrationSP;
+    IText CalibrationT[1] {};
+    ITextVectorProperty CalibrationTP;
+    INumber CalibrationN[1];
+    INumberVectorProperty CalibrationNP;
+
+    std::vector<unsigned short> masterDark;     // as read, whole frame
+    double masterDarkExposure { 0 };            // its EXPTIME (s)
+    std::vector<unsigned short> darkFrame;      // dark signal of one frame at darkFrameSub
+    double darkFrameSub { 0 };
+    std::vector<uint32_t> hotPixels;            // row * width + col, sorted
+
+    int calibrationLoad();
+    int calibrationDefects();
+    const unsigned short *calibrationDark();
+
+    // Guide star centroiding
+    ISwitch GuideCentroidS[2];
+    ISwitchVectorProperty GuideCentroidSP;
+    enum { GUIDE_WINDOW, GUIDE_MIN_SNR };
+    INumber GuideCentroidN[2];
+    INumberVectorProperty GuideCentroidNP;
+    enum { GUIDE_STAR_X, GUIDE_STAR_Y, GUIDE_STAR_SNR, GUIDE_STAR_HFR, GUIDE_STAR_FLUX };
+    INumber GuideStarN[5];
+    INumberVectorProperty GuideStarNP;
+
+    bool guideLocked { false };
+    double guideX { 0 }, guideY { 0 };
+
+    int guideRows(int *row_1, int *row_2);
+    void guideWindow(int *x_1, int *y_1);
+
+    // Virtual guide head. Its exposures sum its own region of the frames
+    // streamed for the primary chip, so both expose at once from one sensor.
+    bool guideExposing { false };
+    int guideHeadX { 0 }, guideHeadY { 0 }, guideHeadW { 0 }, guideHeadH { 0 };
+    int guideHeadBinX { 1 }, guideHeadBinY { 1 };
+    std::vector<uint32_t> guideHeadSum;
+    int guideHeadFrames { 0 };
+    int guideHeadNeeded { 1 };
+    struct timeval guideHeadStart;
+
+    void guideHeadPlan();
+    int guideHeadFrame(const unsigned short *image);
+    int guideHeadComplete();
+
+    // Guide head frames as FITS, or compact 8 bit frames on their own BLOB
+    enum { GUIDE_FORMAT_FITS, GUIDE_FORMAT_COMPACT, GUIDE_FORMAT_DELTA };
+    ISwitch GuideFormatS[3];
+    ISwitchVectorProperty GuideFormatSP;
+    IBLOB GuideCompactB[1];
+    IBLOBVectorProperty GuideCompactBP;
+
+    GuideFrameEncoder guideEncoder;
+
+    // ST-4 guide port on GPIO lines
+    IText GpioT[1] {};
+    ITextVectorProperty GpioTP;
+    enum { GPIO_NORTH, GPIO_SOUTH, GPIO_EAST, GPIO_WEST };
+    INumber GpioN[4];
+    INumberVectorProperty GpioNP;
+    ISwitch GpioActiveS[2];
+    ISwitchVectorProperty GpioActiveSP;
+    enum { PULSE_LAST, PULSE_RMS, PULSE_MAX, PULSE_COUNT };
+    INumber PulseN[4];
+    INumberVectorProperty PulseNP;
+
+    PulseGuider guider;
+    double pulseSum2 { 0 };
+    double pulseMax { 0 };
+    long pulseCount { 0 };
+
+    int guidePortOpen();
+    IPState guidePulse(PulseDirection direction, uint32_t ms);
+    static void guidePulseHelper(int fd, void *context);
+    void guidePulseDone();
+    bool guideSearch(const unsigned short *image);
+    bool guideCentroid(const unsigned short *image);
+
+    // Focus metric
+    ISwitch FocusS[2];
+    ISwitchVectorProperty FocusSP;
+    enum { FOCUS_SIGMA, FOCUS_MAX_STARS };
+    INumber FocusN[2];
+    INumberVectorProperty FocusNP;
+    enum { FOCUS_HFR, FOCUS_FWHM, FOCUS_STARS, FOCUS_FRAME };
+    INumber FocusValuesN[4];
+    INumberVectorProperty FocusValuesNP;
+
+    int focusFrames { 0 };
+
+    int focusFrame(const unsigned short *image);
+
+    // SER recording
+    ISwitch RecordS[2];
+    ISwitchVectorProperty RecordSP;
+    ISwitch RecordDepthS[2];
+    ISwitchVectorProperty RecordDepthSP;
+    IText RecordT[2] {};
+    ITextVectorProperty RecordTP;
+    enum { RECORD_FRAMES, RECORD_DROPPED, RECORD_SIZE, RECORD_RATE };
+    INumber RecordN[4];
+    INumberVectorProperty RecordNP;
+
+    SerRecorder recorder;
+    struct timeval recordTime;          // recording started
+    struct timeval recordStatusTime;    // RECORD_STATUS last sent
+
+    int recordOpen();
+    int recordClose();
+    int recordFrame(const unsigned short *image, const struct timeval *time);
+    int recordStatus(bool force);
+
+    // Shared memory export for programs on the same Pi
+    enum { SHM_OFF, SHM_FRAMES, SHM_IMAGES };
+    ISwitch ShmS[3];
+    ISwitchVectorProperty ShmSP;
+    IText ShmT[1] {};
+    ITextVectorProperty ShmTP;
+    INumber ShmN[1];
+    INumberVectorProperty ShmNP;
+    INumber ShmStatusN[1];
+    INumberVectorProperty ShmStatusNP;
+
+    ShmExport shmExport;
+    struct timeval shmStatusTime;       // SHM_STATUS last sent
+
+    int shmOpen();
+    int shmFrame(const unsigned short *image, const struct timeval *time);
+    int shmImage(INDI::CCDChip *targetChip);
+    int shmStatus(bool force);
+
+    // Tile compressed FITS
+    ISwitch RiceS[2];
+    ISwitchVectorProperty RiceSP;
+
+    bool riceExposureComplete(INDI::CCDChip *targetChip);
+
+    // Demosaicing
+    ISwitch DebayerS[3];
+    ISwitchVectorProperty DebayerSP;
+
+    int debayerImage(FinalizeJob &job, unsigned short *image, unsigned short *rgb);
+
+    // Colour binning
+    enum { CFA_BIN_OFF, CFA_BIN_SAME, CFA_BIN_SUPERPIXEL };
+    ISwitch CfaBinS[3];
+    ISwitchVectorProperty CfaBinSP;
+
+    bool superpixelBinning();
+    int cfaBinImage(FinalizeJob &job, unsigned short *image, unsigned short *output);
+
+    // Progressive preview
+    ISwitch PreviewS[2];
+    ISwitchVectorProperty PreviewSP;
+    enum { PREVIEW_FRAMES, PREVIEW_SECONDS, PREVIEW_WIDTH };
+    INumber PreviewN[3];
+    INumberVectorProperty PreviewNP;
+    enum { FINAL_PREVIEW_OFF, FINAL_PREVIEW_WITH_FITS, FINAL_PREVIEW_ONLY };
+    ISwitch FinalPreviewS[3];
+    ISwitchVectorProperty FinalPreviewSP;
+    IBLOB PreviewB[1];
+    IBLOBVectorProperty PreviewBP;
+
+    std::vector<uint32_t> previewSum;
+    std::vector<unsigned char> previewImage;
+    int previewFrame { 0 };
+    struct timeval previewTime;
+
+    int previewCheck();
+    int previewSend();
+    int previewBlobSend(void *data, size_t size, const char *format);
+    bool pngExposureComplete(INDI::CCDChip *targetChip, bool replace);
+
+    // Live stacking
+    ISwitch LiveStackS[2];
+    ISwitchVectorProperty LiveStackSP;
+    enum { LIVE_SUM, LIVE_MEAN };
+    ISwitch LiveModeS[2];
+    ISwitchVectorProperty LiveModeSP;
+    enum { LIVE_WINDOW, LIVE_EVERY };
+    INumber LiveStackN[2];
+    INumberVectorProperty LiveStackNP;
+    IBLOB LiveB[1];
+    IBLOBVectorProperty LiveBP;
+
+    std::vector<unsigned short> liveRing;   // the frames of the window, cropped, one slot each
+    std::vector<uint32_t> liveSum;          // sum of the frames in the ring
+    std::vector<unsigned short> liveImage;  // sum or mean, as sent
+    int liveX { 0 }, liveY { 0 }, liveW { 0 }, liveH { 0 };
+    int liveSlots { 0 };
+    int liveCount { 0 };    // frames in the window
+    int liveNext { 0 };     // slot of the next frame, holding the oldest
+    int liveSince { 0 };    // frames since the stack was last sent
+
+    int liveBegin();
+    int liveFrame(const unsigned short *image);
+    int liveSend();
+
+    // Back to back sequences
+    ISwitch SequenceS[2];
+    ISwitchVectorProperty SequenceSP;
+
+    bool carrying { false };    // frames are summed for an exposure not yet requested
+    int carryLimit { 0 };
+    struct timeval carryStart;
+
+    // Sub-exposure planner
+    ISwitch SubPlanS[2];
+    ISwitchVectorProperty SubPlanSP;
+    enum { PLAN_READ_NOISE, PLAN_TOLERANCE, PLAN_MIN_SUB, PLAN_MAX_SUB };
+    INumber SubPlanN[4];
+    INumberVectorProperty SubPlanNP;
+    enum { PLAN_SKY_RATE, PLAN_SUB, PLAN_FRAMES };
+    INumber PlanN[3];
+    INumberVectorProperty PlanNP;
+
+    double subLength { 1.0 };       // frame period of the next stream (s)
+    double streamSubLength { 1.0 }; // frame period of the running stream (s)
+    double skyRate { 0 };           // sky background (ADU/s per pixel above black)
+    bool skyPending { false };
+
+    int planSubs(float duration, double *sub, int *frames);
+    int measureSky(const unsigned short *image);
 
     int startFrameStream();
     int terminateFrameStream();
 
+    // raspiraw and the capture thread reading its frames
+    FrameReader frameReader;
+
+    // Frames are read when the capture thread has data, the timer only runs during exposures
+    int streamCallbackID { -1 };    // fd callback on the frame reader, -1 when not watched
+
+    static void streamCallbackHelper(int fd, void *context);
+    void streamUpdate();
+    void streamSchedule(uint32_t ms);
+    void streamEnded();
+
+    // Sensor power up and I2C set up (camera_i2c). Run once per driver process
+    // on its own thread, so Connect returns at once and the buffers are set up
+    // meanwhile. The stream opens when the sensor is ready.
+    enum { SENSOR_OFF, SENSOR_STARTING, SENSOR_READY, SENSOR_FAILED };
+
+    IText SensorStateT[1] {};
+    ITextVectorProperty SensorStateTP;
+
+    pthread_t sensor_thread;
+    pthread_mutex_t sensorMutex = PTHREAD_MUTEX_INITIALIZER;
+    int sensorState { SENSOR_OFF };
+    int sensorStatus { 0 };             // exit status of camera_i2c
+    int sensorNotify[2] { -1, -1 };     // the thread writes a byte when it is done
+    struct timeval sensorStart;
+    double sensorSeconds { 0 };
+    bool streamDeferred { false };      // a stream was asked for before the sensor was ready
+
+    int sensorInitStart();
+    int sensorInitState();
+    void sensorPublish();
+
+    static void *sensorInitHelper(void *context);
+    void *sensorInit();
+    static void sensorReadyHelper(int fd, void *context);
+    void sensorReady();
+
     int streamPredicate;
     pthread_t primary_thread;
     bool terminateThread;
 
+    // Finalization worker
+    pthread_t finalize_thread;
+    bool finalizePending { false };     // with the worker
+    bool finalizeReady { false };       // computed, waiting to be sent
+    bool finalizeTerminate { false };
+    FinalizeJob finalJob;
+    int finalizeNotify { -1 };          // eventfd
+    int finalizeCallbackID { -1 };
+
+    int finalizeStart();
+    int finalizeWait();
+    int finalizeStop();
+    int finalizeCompute(FinalizeJob &job);
+    int finalizePublish();
+    static void finalizeReadyHelper(int fd, void *context);
+
         bool setupParams();
         bool sim;
 
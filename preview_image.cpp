@@ -0,0 +1,331 @@
+/*
+ Stretched 8 bit preview images
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "preview_image.h"
+#include "cpu_affinity.h"
+
+#define LEVELS 65536
+
+double midtonesTransfer(double m, double x)
+{
+    if (x <= 0)
+        return 0;
+    if (x >= 1)
+        return 1;
+
+    return ((m - 1) * x) / (((2 * m - 1) * x) - m);
+}
+
+// -------------------------------------------------------------------------------------------
+// Histogram. Each thread counts a contiguous share of the pixels into its own
+// histogram, and the histograms are added at the end.
+
+struct HistogramJob
+{
+    const unsigned short *pixels;
+    long count;
+    std::vector<uint32_t> histogram;
+};
+
+static void *histogramWorker(void *context){
+
+    HistogramJob *job = (HistogramJob *)context;
+
+    job->histogram.assign(LEVELS, 0);
+
+    uint32_t *histogram = job->histogram.data();
+
+    for (long i = 0; i < job->count; i++) {
+        histogram[job->pixels[i]]++;
+    }
+
+    return nullptr;
+
+}
+
+static void histogram(const unsigned short *pixels, long count, int nthreads, std::vector<uint32_t> &out){
+
+    if (nthreads < 1)
+        nthreads = 1;
+
+    std::vector<HistogramJob> jobs(nthreads);
+    std::vector<pthread_t> threads(nthreads);
+
+    for (int t = 0; t < nthreads; t++) {
+
+        long first = count * t / nthreads;
+        long last  = count * (t + 1) / nthreads;
+
+        jobs[t].pixels = pixels + first;
+        jobs[t].count  = last - first;
+    }
+
+    // The calling thread takes the first share
+    int started = 1;
+
+    for (int t = 1; t < nthreads; t++) {
+
+        if (cpuWorkerCreate(&threads[t], &histogramWorker, &jobs[t]) != 0)
+            break;
+
+        started++;
+    }
+
+    // Shares whose thread could not be started are done here
+    for (int t = started; t < nthreads; t++) {
+        histogramWorker(&jobs[t]);
+    }
+
+    histogramWorker(&jobs[0]);
+
+    for (int t = 1; t < started; t++) {
+        pthread_join(threads[t], nullptr);
+    }
+
+    out.swap(jobs[0].histogram);
+
+    for (int t = 1; t < nthreads; t++) {
+        for (int v = 0; v < LEVELS; v++) {
+            out[v] += jobs[t].histogram[v];
+        }
+    }
+
+}
+
+// -------------------------------------------------------------------------------------------
+// Screen stretch: shadows clipped 2.8 MAD below the median and the median
+// moved to a quarter of full scale with the midtones transfer function.
+
+void stretchParameters(const uint32_t *hist, long count, double *black, double *top, double *m){
+
+    long half  = count / 2;
+    long total = 0;
+    int median = 0;
+
+    while (median < LEVELS - 1 && total + hist[median] <= half) {
+        total += hist[median];
+        median++;
+    }
+
+    int white = LEVELS - 1;
+
+    while (white > 0 && hist[white] == 0) {
+        white--;
+    }
+
+    // Median absolute deviation, growing a window around the median
+    int deviation = 0;
+    total = hist[median];
+
+    while (total <= half && deviation < LEVELS) {
+
+        deviation++;
+
+        if (median - deviation >= 0)
+            total += hist[median - deviation];
+        if (median + deviation < LEVELS)
+            total += hist[median + deviation];
+    }
+
+    double mad = 1.4826 * deviation;
+
+    *black = std::max(0.0, median - 2.8 * mad);
+    *top   = std::max((double)white, *black + 1);
+    *m     = midtonesTransfer(0.25, (median - *black) / (*top - *black));
+
+}
+
+// -------------------------------------------------------------------------------------------
+
+int stretchPreview(const unsigned short *image, int width, int height, int planes, int maxwidth, int nthreads,
+                   std::vector<unsigned char> &out, int *outwidth, int *outheight){
+
+    long plane = (long)width * height;
+    long count = plane * planes;
+
+    if (count <= 0 || maxwidth <= 0)
+        return -1;
+
+    // ---------------------------------------------------------------------------
+    // The same stretch is used for all planes, which keeps the colour balance.
+
+    std::vector<uint32_t> hist;
+    histogram(image, count, nthreads, hist);
+
+    double black, top, m;
+    stretchParameters(hist.data(), count, &black, &top, &m);
+
+    // Every 16 bit level has its own entry, so the faint end is not lost
+    std::vector<unsigned char> lut(LEVELS);
+    double scale = 1.0 / (top - black);
+
+    for (int v = 0; v < LEVELS; v++) {
+        lut[v] = (unsigned char)(255 * midtonesTransfer(m, (v - black) * scale) + 0.5);
+    }
+
+    // ---------------------------------------------------------------------------
+    // Downscale by block averages. Rows of a block are summed first, which is a
+    // straight vectorized loop over the row, then the columns of each block.
+
+    int factor = (width + maxwidth - 1) / maxwidth;
+
+    // A single plane may still be a Bayer mosaic
+    if (planes == 1)
+        factor = std::max(2, (factor + 1) & ~1);
+    else
+        factor = std::max(1, factor);
+
+    int w = width / factor;
+    int h = height / factor;
+
+    if (w <= 0 || h <= 0)
+        return -1;
+
+    int used  = w * factor;
+    int block = factor * factor;
+
+    out.resize((long)w * h * planes);
+
+    std::vector<uint32_t> rows(used);
+
+    for (int p = 0; p < planes; p++) {
+
+        const unsigned short *src = image + p * plane;
+
+        for (int y = 0; y < h; y++) {
+
+            std::fill(rows.begin(), rows.end(), 0);
+
+            for (int j = 0; j < factor; j++) {
+
+                const unsigned short *row = src + (long)(y * factor + j) * width;
+
+                for (int x = 0; x < used; x++) {
+                    rows[x] += row[x];
+                }
+            }
+
+            unsigned char *dst = out.data() + (long)y * w * planes + p;
+
+            for (int x = 0; x < w; x++) {
+
+                uint32_t sum = 0;
+
+                for (int i = 0; i < factor; i++) {
+                    sum += rows[x * factor + i];
+                }
+
+                dst[x * planes] = lut[sum / block];
+            }
+        }
+    }
+
+    *outwidth  = w;
+    *outheight = h;
+
+    return 0;
+
+}
+
+// -------------------------------------------------------------------------------------------
+// PNG. Each row uses the Sub filter, which suits smooth sky backgrounds, and
+// is deflated at the fastest level, since the preview is about latency.
+
+static void putWord(std::vector<unsigned char> &out, uint32_t v)
+{
+    out.push_back(v >> 24);
+    out.push_back(v >> 16);
+    out.push_back(v >> 8);
+    out.push_back(v);
+}
+
+static void putChunk(std::vector<unsigned char> &out, const char *type, const unsigned char *data, uint32_t length)
+{
+    putWord(out, length);
+
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + length);
+
+    putWord(out, crc32(crc32(0L, Z_NULL, 0), &out[start], length + 4));
+}
+
+int pngEncode(const unsigned char *pixels, int width, int height, int channels, std::vector<unsigned char> &out){
+
+    long stride = (long)width * channels;
+
+    std::vector<unsigned char> filtered((stride + 1) * height);
+
+    for (int y = 0; y < height; y++) {
+
+        const unsigned char *src = pixels + y * stride;
+        unsigned char *dst       = &filtered[y * (stride + 1)];
+
+        dst[0] = 1;     // Sub
+
+        for (long i = 0; i < channels && i < stride; i++) {
+            dst[1 + i] = src[i];
+        }
+
+        for (long i = channels; i < stride; i++) {
+            dst[1 + i] = src[i] - src[i - channels];
+        }
+    }
+
+    uLongf size = compressBound(filtered.size());
+    std::vector<unsigned char> deflated(size);
+
+    if (compress2(deflated.data(), &size, filtered.data(), filtered.size(), Z_BEST_SPEED) != Z_OK)
+        return -1;
+
+    unsigned char header[13];
+
+    header[0]  = width >> 24;
+    header[1]  = width >> 16;
+    header[2]  = width >> 8;
+    header[3]  = width;
+    header[4]  = height >> 24;
+    header[5]  = height >> 16;
+    header[6]  = height >> 8;
+    header[7]  = height;
+    header[8]  = 8;                         // bit depth
+    header[9]  = channels == 3 ? 2 : 0;     // truecolour or greyscale
+    header[10] = 0;                         // deflate
+    header[11] = 0;                         // adaptive filtering
+    header[12] = 0;                         // no interlace
+
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+    out.assign(signature, signature + 8);
+
+    putChunk(out, "IHDR", header, 13);
+    putChunk(out, "IDAT", deflated.data(), size);
+    putChunk(out, "IEND", nullptr, 0);
+
+    return 0;
+
+}
@@ -0,0 +1,45 @@
+/*
+ Stretched 8 bit preview images
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#ifndef PREVIEW_IMAGE_H
+#define PREVIEW_IMAGE_H
+
+#include <vector>
+#include <stdint.h>
+
+// Midtones transfer function, m is the midtones balance and x in 0..1
+double midtonesTransfer(double m, double x);
+
+// Screen stretch of count pixels from their histogram over 65536 levels.
+// Levels map to 0..1 as midtonesTransfer(m, (v - black) / (top - black)).
+void stretchParameters(const uint32_t *histogram, long count, double *black, double *top, double *m);
+
+// Screen stretch of a 16 bit image of one or three planes (R, G, B) to an
+// 8 bit image about maxwidth pixels wide. The stretch is found from a
+// histogram of the whole image, counted on nthreads threads. The image is
+// downscaled by whole blocks, even sized so each block holds whole Bayer
+// quads, and three planes are interleaved for PNG. Returns 0 on success.
+int stretchPreview(const unsigned short *image, int width, int height, int planes, int maxwidth, int nthreads,
+                   std::vector<unsigned char> &out, int *outwidth, int *outheight);
+
+// Encode an 8 bit grey (channels 1) or RGB (channels 3) image as PNG
+int pngEncode(const unsigned char *pixels, int width, int height, int channels, std::vector<unsigned char> &out);
+
+#endif // PREVIEW_IMAGE_H
@@ -0,0 +1,418 @@
+/*
+ ST-4 pulse guiding on GPIO lines
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "config.h"
+#include "pulse_guide.h"
+#include "cpu_affinity.h"
+
+#ifdef HAVE_GPIOD
+#include <gpiod.h>
+#endif
+
+// -------------------------------------------------------------------------------------------
+// Output lines
+
+class PulseLines
+{
+    public:
+
+    virtual ~PulseLines() {}
+    virtual int set(int direction, bool active) = 0;
+};
+
+// Levels kept in memory, so guiding can be tried without a Pi
+class MockLines : public PulseLines
+{
+    public:
+
+    int set(int direction, bool active)
+    {
+        levels[direction] = active;
+        return 0;
+    }
+
+    private:
+
+    bool levels[4] {};
+};
+
+#ifdef HAVE_GPIOD
+class GpiodLines : public PulseLines
+{
+    public:
+
+    ~GpiodLines()
+    {
+        for (int i = 0; i < 4; i++) {
+            if (requested[i])
+            {
+                gpiod_line_set_value(lines[i], 0);
+                gpiod_line_release(lines[i]);
+            }
+        }
+
+        if (chip)
+            gpiod_chip_close(chip);
+    }
+
+    int open(const char *name, const int offsets[4], bool activeLow)
+    {
+        chip = gpiod_chip_open_lookup(name);
+
+        if (!chip)
+            return -1;
+
+        // Requested inactive, a value of 1 is active whichever level that is
+        int flags = activeLow ? GPIOD_LINE_REQUEST_FLAG_ACTIVE_LOW : 0;
+
+        for (int i = 0; i < 4; i++) {
+
+            lines[i] = gpiod_chip_get_line(chip, offsets[i]);
+
+            if (!lines[i] || gpiod_line_request_output_flags(lines[i], "indi_picamera", flags, 0) != 0)
+                return -1;
+
+            requested[i] = true;
+        }
+
+        return 0;
+    }
+
+    int set(int direction, bool active)
+    {
+        return gpiod_line_set_value(lines[direction], active ? 1 : 0);
+    }
+
+    private:
+
+    struct gpiod_chip *chip { nullptr };
+    struct gpiod_line *lines[4] {};
+    bool requested[4] {};
+};
+#endif
+
+// -------------------------------------------------------------------------------------------
+
+static bool reached(const struct timespec &now, const struct timespec &deadline)
+{
+    return now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+static double milliseconds(const struct timespec &from, const struct timespec &to)
+{
+    return (to.tv_sec - from.tv_sec) * 1e3 + (to.tv_nsec - from.tv_nsec) / 1e6;
+}
+
+PulseGuider::PulseGuider()
+{
+    pthread_mutex_init(&mutex, nullptr);
+
+    // Made once, so the driver keeps one callback on it
+    notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+PulseGuider::~PulseGuider()
+{
+    close();
+
+    if (notify >= 0)
+        ::close(notify);
+
+    pthread_mutex_destroy(&mutex);
+}
+
+int PulseGuider::open(const char *chip, const int offsets[4], bool activeLow)
+{
+    close();
+
+    PulseLines *opened = nullptr;
+
+    if (!strcmp(chip, PULSE_MOCK_CHIP))
+    {
+        opened = new MockLines();
+    }
+    else
+    {
+#ifdef HAVE_GPIOD
+        GpiodLines *gpio = new GpiodLines();
+
+        if (gpio->open(chip, offsets, activeLow) != 0)
+        {
+            int e = errno;
+            delete gpio;
+            errno = e;
+            return -1;
+        }
+
+        opened = gpio;
+#else
+        (void)offsets;
+        (void)activeLow;
+        errno = ENOTSUP;
+        return -1;
+#endif
+    }
+
+    timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wake  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    running = true;
+
+    if (timer < 0 || wake < 0 || pthread_create(&thread, nullptr, &schedulerHelper, this) != 0)
+    {
+        int e = errno;
+
+        running = false;
+        delete opened;
+
+        if (timer >= 0)
+            ::close(timer);
+        if (wake >= 0)
+            ::close(wake);
+        timer = wake = -1;
+
+        errno = e;
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+    lines = opened;
+    pthread_mutex_unlock(&mutex);
+
+    return 0;
+}
+
+void PulseGuider::close()
+{
+    if (!running)
+        return;
+
+    stop();
+
+    pthread_mutex_lock(&mutex);
+    running = false;
+    pthread_mutex_unlock(&mutex);
+
+    uint64_t one = 1;
+    if (write(wake, &one, sizeof(one)) < 0) {
+    }
+
+    pthread_join(thread, nullptr);
+
+    pthread_mutex_lock(&mutex);
+    delete lines;
+    lines = nullptr;
+    pthread_mutex_unlock(&mutex);
+
+    ::close(timer);
+    ::close(wake);
+    timer = wake = -1;
+}
+
+int PulseGuider::pulse(PulseDirection direction, uint32_t ms)
+{
+    int axis = (direction == PULSE_NORTH || direction == PULSE_SOUTH) ? PULSE_DEC : PULSE_RA;
+
+    pthread_mutex_lock(&mutex);
+
+    if (!lines)
+    {
+        pthread_mutex_unlock(&mutex);
+        errno = ENODEV;
+        return -1;
+    }
+
+    // The opposite line of an axis is never on with this one
+    if (pulses[axis].on)
+    {
+        end(axis, true, false);
+        signal();
+    }
+
+    if (lines->set(direction, true) != 0)
+    {
+        int e = errno;
+        pthread_mutex_unlock(&mutex);
+        errno = e;
+        return -1;
+    }
+
+    Pulse &p = pulses[axis];
+
+    // Timed from the line switching, not from the request
+    clock_gettime(CLOCK_MONOTONIC, &p.start);
+
+    p.on        = true;
+    p.direction = direction;
+    p.ms        = ms;
+    p.deadline  = p.start;
+
+    p.deadline.tv_sec += ms / 1000;
+    p.deadline.tv_nsec += (ms % 1000) * 1000000L;
+
+    if (p.deadline.tv_nsec >= 1000000000L)
+    {
+        p.deadline.tv_sec++;
+        p.deadline.tv_nsec -= 1000000000L;
+    }
+
+    arm();
+
+    pthread_mutex_unlock(&mutex);
+
+    return 0;
+}
+
+void PulseGuider::stop()
+{
+    pthread_mutex_lock(&mutex);
+
+    bool ended = false;
+
+    for (int a = 0; a < 2; a++) {
+        if (pulses[a].on)
+        {
+            end(a, false, true);
+            ended = true;
+        }
+    }
+
+    if (ended)
+    {
+        arm();
+        signal();
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+void PulseGuider::completed(std::vector<PulseResult> &out)
+{
+    pthread_mutex_lock(&mutex);
+    out.swap(results);
+    results.clear();
+    pthread_mutex_unlock(&mutex);
+}
+
+void PulseGuider::end(int axis, bool cut, bool stopped)
+{
+    Pulse &p = pulses[axis];
+
+    lines->set(p.direction, false);
+
+    struct timespec off;
+    clock_gettime(CLOCK_MONOTONIC, &off);
+
+    PulseResult r;
+    r.axis      = (PulseAxis)axis;
+    r.direction = p.direction;
+    r.requested = p.ms;
+    r.width     = milliseconds(p.start, off);
+    r.cut       = cut;
+    r.stopped   = stopped;
+
+    results.push_back(r);
+
+    p.on = false;
+}
+
+void PulseGuider::arm()
+{
+    struct itimerspec when {};
+    bool any = false;
+
+    for (int a = 0; a < 2; a++) {
+        if (pulses[a].on && (!any || !reached(pulses[a].deadline, when.it_value)))
+        {
+            when.it_value = pulses[a].deadline;
+            any           = true;
+        }
+    }
+
+    // A zero time disarms the timer, a deadline already passed fires at once
+    timerfd_settime(timer, TFD_TIMER_ABSTIME, &when, nullptr);
+}
+
+void PulseGuider::signal()
+{
+    uint64_t one = 1;
+    if (write(notify, &one, sizeof(one)) < 0) {
+    }
+}
+
+void *PulseGuider::schedulerHelper(void *context)
+{
+    ((PulseGuider *)context)->scheduler();
+    return nullptr;
+}
+
+void PulseGuider::scheduler()
+{
+    // Pulse ends are as time critical as frames, so it runs like capture
+    cpuRoleApply(CPU_ROLE_CAPTURE);
+
+    struct pollfd fds[2] = { { timer, POLLIN, 0 }, { wake, POLLIN, 0 } };
+
+    while (true)
+    {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            break;
+
+        uint64_t count;
+        if (read(timer, &count, sizeof(count)) < 0) {
+        }
+
+        pthread_mutex_lock(&mutex);
+
+        if (!running)
+        {
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        bool ended = false;
+
+        for (int a = 0; a < 2; a++) {
+            if (pulses[a].on && reached(now, pulses[a].deadline))
+            {
+                end(a, false, false);
+                ended = true;
+            }
+        }
+
+        if (ended)
+        {
+            arm();
+            signal();
+        }
+
+        pthread_mutex_unlock(&mutex);
+    }
+}
@@ -0,0 +1,123 @@
+/*
+ ST-4 pulse guiding on GPIO lines
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#ifndef PULSE_GUIDE_H
+#define PULSE_GUIDE_H
+
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define PULSE_MOCK_CHIP "mock"      /* Chip name of lines kept in memory, for use without hardware */
+
+enum PulseDirection
+{
+    PULSE_NORTH,
+    PULSE_SOUTH,
+    PULSE_EAST,
+    PULSE_WEST
+};
+
+enum PulseAxis
+{
+    PULSE_RA,
+    PULSE_DEC
+};
+
+struct PulseResult
+{
+    PulseAxis axis;
+    PulseDirection direction;
+    uint32_t requested;     // ms
+    double width;           // ms, from switching the line on to switching it off
+    bool cut;               // ended early by a new pulse on the axis, which takes its place
+    bool stopped;           // ended early by stop() or close(), the axis is left idle
+};
+
+class PulseLines;
+
+// Drives the four ST-4 lines of a GPIO chip through the libgpiod character
+// device. A pulse is switched on by the caller and off by a scheduler thread
+// waiting on a timerfd for the absolute deadline, so RA and Dec pulses run
+// at the same time and their width does not depend on the caller.
+class PulseGuider
+{
+    public:
+
+    PulseGuider();
+    ~PulseGuider();
+
+    // Request lines offsets (north, south, east, west) of chip, a name, number,
+    // path or label as libgpiod looks it up, or PULSE_MOCK_CHIP. Returns 0, or
+    // -1 with errno set.
+    int open(const char *chip, const int offsets[4], bool activeLow);
+
+    // End pulses, release the lines and stop the scheduler. The ended pulses
+    // are still reported, as stopped.
+    void close();
+
+    bool isOpen() const { return lines != nullptr; }
+
+    // Start a pulse of ms. A pulse already running on the same axis is cut
+    // short first. Returns 0, or -1 with errno set.
+    int pulse(PulseDirection direction, uint32_t ms);
+
+    // End all pulses now. They are reported as stopped.
+    void stop();
+
+    // Readable when pulses have ended. Read the counter, then take the results.
+    int notifyFd() const { return notify; }
+    void completed(std::vector<PulseResult> &out);
+
+    private:
+
+    static void *schedulerHelper(void *context);
+    void scheduler();
+
+    // With mutex held
+    void end(int axis, bool cut, bool stopped);
+    void arm();
+    void signal();
+
+    struct Pulse
+    {
+        bool on;
+        PulseDirection direction;
+        uint32_t ms;
+        struct timespec start;
+        struct timespec deadline;
+    };
+
+    PulseLines *lines { nullptr };
+    Pulse pulses[2] {};
+    std::vector<PulseResult> results;
+
+    pthread_t thread;
+    bool running { false };
+
+    int timer { -1 };       // timerfd, armed for the earliest deadline
+    int wake { -1 };        // eventfd, stops the scheduler
+    int notify { -1 };      // eventfd, counts ended pulses
+
+    pthread_mutex_t mutex;
+};
+
+#endif // PULSE_GUIDE_H
@@ -0,0 +1,135 @@
+/*
+ Sensor modes and pixel kernels for the Raspberry Pi cameras
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#include <vector>
+#include <algorithm>
+
+#include "sensor_modes.h"
+#include "frame_pipeline.h"
+
+// Raw rows are padded to 32 bytes by raspiraw, and frames to a multiple of 16 rows
+#define RAW_STRIDE(width, bits) ((((width) * (bits) / 8) + 31) & ~31)
+#define RAW_ROWS(height) (((height) + 15) & ~15)
+
+// The V1 camera's frames start with a 32 KB header
+#define V1_HEADER 32768
+
+#define SENSOR_MODE(name, label, md, w, h, bits, header, pixelsize, gain, black, egain, minfps, maxfps)             \
+    {                                                                                                               \
+        name, label, md, w, h, bits, RAW_STRIDE(w, bits), header, header + RAW_STRIDE(w, bits) * (long)RAW_ROWS(h), \
+            pixelsize, gain, black, egain, minfps, maxfps, &pipelineRows<bits, w, RAW_STRIDE(w, bits)>              \
+    }
+
+// Mode numbers and frame rate ranges follow the raspistill sensor modes, which raspiraw uses too.
+// The e-/ADU are the full well over the raw range, divided by the analog gain of -g.
+const SensorMode sensorModes[] = {
+    SENSOR_MODE("IMX219_FULL", "V2 IMX219 3280x2464", 2, 3280, 2464, 10, 0, 1.12, 230, 64, 0.45, 0.1, 15),
+    SENSOR_MODE("IMX219_BIN2", "V2 IMX219 1640x1232 bin", 4, 1640, 1232, 10, 0, 2.24, 230, 64, 0.45, 0.1, 40),
+    SENSOR_MODE("OV5647_FULL", "V1 OV5647 2592x1944", 2, 2592, 1944, 10, V1_HEADER, 1.4, 1023, 16, 0.55, 1, 15),
+    SENSOR_MODE("OV5647_BIN2", "V1 OV5647 1296x972 bin", 4, 1296, 972, 10, V1_HEADER, 2.8, 1023, 16, 0.55, 1, 42),
+    SENSOR_MODE("IMX477_FULL", "HQ IMX477 4056x3040", 3, 4056, 3040, 12, 0, 1.55, 978, 256, 0.09, 0.005, 10),
+    SENSOR_MODE("IMX477_BIN2", "HQ IMX477 2028x1520 bin", 2, 2028, 1520, 12, 0, 3.1, 978, 256, 0.09, 0.1, 50),
+};
+
+const int sensorModeCount = sizeof(sensorModes) / sizeof(sensorModes[0]);
+
+double sensorFramePeriod(const SensorMode *mode, double seconds)
+{
+    return std::min(std::max(seconds, 1.0 / mode->maxfps), 1.0 / mode->minfps);
+}
+
+// -------------------------------------------------------------------------------------------
+// Binning. Each output row is summed into a row of 32-bit sums before it is
+// written, which makes binning in place safe.
+
+template <int BX, int BY>
+static void binRows(unsigned short *frame, int w, int h)
+{
+    int bw = w / BX;
+    int bh = h / BY;
+
+    std::vector<uint32_t> row(bw);
+
+    for (int y = 0; y < bh; y++)
+    {
+        std::fill(row.begin(), row.end(), 0);
+
+        for (int j = 0; j < BY; j++)
+        {
+            const unsigned short *src = frame + (long)(y * BY + j) * w;
+
+            for (int x = 0; x < bw; x++)
+            {
+                uint32_t sum = 0;
+
+                for (int i = 0; i < BX; i++)
+                    sum += src[x * BX + i];
+
+                row[x] += sum;
+            }
+        }
+
+        unsigned short *dst = frame + (long)y * bw;
+
+        for (int x = 0; x < bw; x++)
+            dst[x] = row[x] > 65535 ? 65535 : row[x];
+    }
+}
+
+static void binRowsAny(unsigned short *frame, int w, int h, int binx, int biny)
+{
+    int bw = w / binx;
+    int bh = h / biny;
+
+    std::vector<uint32_t> row(bw);
+
+    for (int y = 0; y < bh; y++)
+    {
+        std::fill(row.begin(), row.end(), 0);
+
+        for (int j = 0; j < biny; j++)
+        {
+            const unsigned short *src = frame + (long)(y * biny + j) * w;
+
+            for (int x = 0; x < bw * binx; x++)
+                row[x / binx] += src[x];
+        }
+
+        unsigned short *dst = frame + (long)y * bw;
+
+        for (int x = 0; x < bw; x++)
+            dst[x] = row[x] > 65535 ? 65535 : row[x];
+    }
+}
+
+void binFrame(unsigned short *frame, int w, int h, int binx, int biny)
+{
+    if (binx == 1 && biny == 1)
+        return;
+
+    if (binx == 2 && biny == 2)
+        binRows<2, 2>(frame, w, h);
+    else if (binx == 3 && biny == 3)
+        binRows<3, 3>(frame, w, h);
+    else if (binx == 4 && biny == 4)
+        binRows<4, 4>(frame, w, h);
+    else
+        binRowsAny(frame, w, h, binx, biny);
+}
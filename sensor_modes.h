@@ -0,0 +1,98 @@
+/*
+ Sensor modes and pixel kernels for the Raspberry Pi cameras
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#ifndef SENSOR_MODES_H
+#define SENSOR_MODES_H
+
+#include <stdint.h>
+
+struct PipelineJob;
+
+// Unpack rows of a raw frame and run the enabled stages on them, see frame_pipeline.h
+typedef void (*PipelineKernel)(const PipelineJob &job);
+
+struct SensorMode
+{
+    const char *name;       // switch name of the mode
+    const char *label;
+    int mode;               // raspiraw -md
+    int width;              // pixels
+    int height;
+    int bits;               // 10 or 12 bit raw
+    int stride;             // bytes per raw row, including padding at the end
+    long header;            // bytes before the first row of a frame
+    long blocksize;         // bytes per frame from raspiraw, header and padded rows
+    double pixelsize;       // um, doubled for sensor binned modes
+    int gain;               // raspiraw -g, near maximum analog gain
+    int black;              // black level in ADU
+    double egain;           // e-/ADU at that gain, approximate
+    double minfps;          // frame rates raspiraw -fps can run the mode at
+    double maxfps;
+
+    PipelineKernel pipeline;
+};
+
+extern const SensorMode sensorModes[];
+extern const int sensorModeCount;
+
+// Frame period (s) nearest to seconds that the mode can run at
+double sensorFramePeriod(const SensorMode *mode, double seconds);
+
+// Bin a subframe in place, summing binx x biny blocks and saturating at 65535
+void binFrame(unsigned short *frame, int w, int h, int binx, int biny);
+
+// -------------------------------------------------------------------------------------------
+// Packed raw formats. The per-pixel loops of frame_pipeline.h are
+// instantiated for every bit depth, width and stride in the mode table, so
+// they have no runtime branches and constant trip counts.
+
+template <int BITS>
+struct RawFormat;
+
+// MIPI RAW10 - four pixels in five bytes, low bits of all four in the fifth
+template <>
+struct RawFormat<10>
+{
+    enum { PIXELS = 4, BYTES = 5 };
+
+    static inline void unpack(const unsigned char *p, unsigned short *o)
+    {
+        unsigned char split = p[4];
+        o[0] = (p[0] << 2) | ((split >> 6) & 0x3);
+        o[1] = (p[1] << 2) | ((split >> 4) & 0x3);
+        o[2] = (p[2] << 2) | ((split >> 2) & 0x3);
+        o[3] = (p[3] << 2) | (split & 0x3);
+    }
+};
+
+// MIPI RAW12 - two pixels in three bytes, low nibbles of both in the third
+template <>
+struct RawFormat<12>
+{
+    enum { PIXELS = 2, BYTES = 3 };
+
+    static inline void unpack(const unsigned char *p, unsigned short *o)
+    {
+        o[0] = (p[0] << 4) | (p[2] & 0xF);
+        o[1] = (p[1] << 4) | (p[2] >> 4);
+    }
+};
+
+#endif // SENSOR_MODES_H
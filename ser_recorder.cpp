@@ -0,0 +1,392 @@
+/*
+ SER video recording of raw frames
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ser_recorder.h"
+#include "cpu_affinity.h"
+
+#define SER_ALIGN       4096                    /* O_DIRECT alignment of buffers, offsets and lengths */
+#define SER_UNIX_EPOCH  621355968000000000ULL   /* SER ticks (100 ns since 0001-01-01) at 1970-01-01 */
+
+int serColorId(const char *pattern, int x, int y)
+{
+    if (!pattern || strlen(pattern) != 4)
+        return 0;
+
+    // Pattern at the region origin
+    char shifted[5];
+
+    for (int r = 0; r < 2; r++) {
+        for (int c = 0; c < 2; c++) {
+            shifted[r * 2 + c] = pattern[((r + y) & 1) * 2 + ((c + x) & 1)];
+        }
+    }
+    shifted[4] = 0;
+
+    static const char *patterns[] = { "RGGB", "GRBG", "GBRG", "BGGR" };
+
+    for (int i = 0; i < 4; i++) {
+
+        if (!strcmp(shifted, patterns[i]))
+            return 8 + i;
+    }
+
+    return 0;
+}
+
+static void putInt32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) {
+        p[i] = v >> (8 * i);
+    }
+}
+
+static void putInt64(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++) {
+        p[i] = v >> (8 * i);
+    }
+}
+
+// -------------------------------------------------------------------------------------------
+
+SerRecorder::SerRecorder()
+{
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&cv, nullptr);
+}
+
+SerRecorder::~SerRecorder()
+{
+    close();
+
+    pthread_cond_destroy(&cv);
+    pthread_mutex_destroy(&mutex);
+}
+
+int SerRecorder::open(const char *path, int x, int y, int w, int h, int bits, int depth, int colorId,
+                      const char *instrument)
+{
+    if (fd >= 0)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    frameBytes = (long)w * h * (depth == 8 ? 1 : 2);
+
+    if (w <= 0 || h <= 0 || frameBytes > SER_RING)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (posix_memalign((void **)&ring, SER_ALIGN, SER_RING) != 0)
+    {
+        ring  = nullptr;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Page cache is bypassed where the filesystem allows it
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+
+    if (fd < 0 && errno == EINVAL)
+        fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+    {
+        free(ring);
+        ring = nullptr;
+        return -1;
+    }
+
+    snprintf(this->path, sizeof(this->path), "%s", path);
+    snprintf(this->instrument, sizeof(this->instrument), "%s", instrument);
+
+    roiX          = x;
+    roiY          = y;
+    roiW          = w;
+    roiH          = h;
+    this->bits    = bits;
+    this->depth   = depth;
+    this->colorId = colorId;
+
+    timestamps.clear();
+    timestamps.reserve(100000);
+    startTime     = 0;
+    droppedFrames = 0;
+
+    row.resize(w);
+
+    head      = 0;
+    tail      = 0;
+    allocated = 0;
+    closing   = false;
+    error     = 0;
+
+    // Placeholder, the frame count and times are known when closing
+    memset(ring, 0, SER_HEADER);
+    head   = SER_HEADER;
+    cursor = SER_HEADER;
+
+    if (pthread_create(&writer_thread, nullptr, &writerHelper, this) != 0)
+    {
+        ::close(fd);
+        unlink(path);
+        fd = -1;
+
+        free(ring);
+        ring  = nullptr;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return 0;
+}
+
+void SerRecorder::put(const unsigned char *data, long length)
+{
+    long pos   = cursor % SER_RING;
+    long first = std::min(length, SER_RING - pos);
+
+    memcpy(ring + pos, data, first);
+    memcpy(ring, data + first, length - first);
+
+    cursor += length;
+}
+
+bool SerRecorder::addFrame(const unsigned short *image, int width, const struct timeval *time)
+{
+    if (fd < 0)
+        return false;
+
+    // The writer only moves the tail on, so the free space can only grow after this
+    pthread_mutex_lock(&mutex);
+    long long queued = head - tail;
+    pthread_mutex_unlock(&mutex);
+
+    if (SER_RING - queued < frameBytes)
+    {
+        droppedFrames++;
+        return false;
+    }
+
+    for (int j = 0; j < roiH; j++) {
+
+        const unsigned short *src = image + (long)(roiY + j) * width + roiX;
+
+        if (depth == 8)
+        {
+            int shift = bits - 8;
+
+            for (int i = 0; i < roiW; i++) {
+                row[i] = src[i] >> shift;
+            }
+
+            put(row.data(), roiW);
+        }else{
+
+            // SER 16 bit data is little endian, as the Pi
+            put((const unsigned char *)src, roiW * 2L);
+        }
+    }
+
+    uint64_t ticks = SER_UNIX_EPOCH + (uint64_t)time->tv_sec * 10000000ULL + (uint64_t)time->tv_usec * 10ULL;
+
+    if (timestamps.empty())
+        startTime = ticks;
+
+    timestamps.push_back(ticks);
+
+    // The writer sees the frame once it is whole
+    pthread_mutex_lock(&mutex);
+    head = cursor;
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mutex);
+
+    return true;
+}
+
+double SerRecorder::megabytes() const
+{
+    return cursor / 1048576.0;
+}
+
+// -------------------------------------------------------------------------------------------
+// Writer. Whole blocks are written as soon as they are queued. The ring is a
+// whole number of blocks, so a block never wraps. The last part block is
+// padded to the alignment and the file is cut back when closing.
+
+void *SerRecorder::writerHelper(void *context)
+{
+    return ((SerRecorder *)context)->writer();
+}
+
+void *SerRecorder::writer()
+{
+    // Kept off the CPUs of the capture thread when they are set apart
+    cpuRoleApply(CPU_ROLE_ENCODER);
+
+    pthread_mutex_lock(&mutex);
+
+    while (true)
+    {
+        while (head - tail < SER_BLOCK && !closing)
+        {
+            pthread_cond_wait(&cv, &mutex);
+        }
+
+        long length = std::min(head - tail, (long long)SER_BLOCK);
+        bool last   = length < SER_BLOCK;
+
+        if (length == 0)
+            break;
+
+        pthread_mutex_unlock(&mutex);
+
+        long size = last ? (length + SER_ALIGN - 1) & ~(long)(SER_ALIGN - 1) : length;
+
+        // Extents are reserved well ahead, so the file stays in few pieces
+        // and the filesystem does little work per write
+        while (tail + size > allocated && !error)
+        {
+            if (posix_fallocate(fd, allocated, SER_EXTENT) != 0)
+                break;
+
+            allocated += SER_EXTENT;
+        }
+
+        long done = 0;
+
+        while (done < size && !error)
+        {
+            ssize_t n = pwrite(fd, ring + tail % SER_RING + done, size - done, tail + done);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n <= 0)
+                error = n < 0 ? errno : EIO;
+            else
+                done += n;
+        }
+
+        // After a failed write frames are still taken off the ring, so capture goes on
+        pthread_mutex_lock(&mutex);
+        tail += length;
+
+        if (last)
+            break;
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return nullptr;
+}
+
+// -------------------------------------------------------------------------------------------
+
+void SerRecorder::header(unsigned char *out, int frames)
+{
+    memset(out, 0, SER_HEADER);
+
+    memcpy(out, "LUCAM-RECORDER", 14);
+    putInt32(out + 14, 0);                          // LuID
+    putInt32(out + 18, colorId);
+    putInt32(out + 22, 0);                          // LittleEndian, 0 for little endian data as most readers expect
+    putInt32(out + 26, roiW);
+    putInt32(out + 30, roiH);
+    putInt32(out + 34, depth == 8 ? 8 : bits);      // significant bits per pixel
+    putInt32(out + 38, frames);
+
+    // Observer at 42, Instrument at 82, Telescope at 122
+    memcpy(out + 82, instrument, strnlen(instrument, 40));
+
+    // A file without frames is dated when it is closed
+    if (startTime == 0)
+        startTime = SER_UNIX_EPOCH + (uint64_t)time(nullptr) * 10000000ULL;
+
+    time_t seconds = (startTime - SER_UNIX_EPOCH) / 10000000ULL;
+    struct tm local;
+    localtime_r(&seconds, &local);
+
+    putInt64(out + 162, startTime + (int64_t)local.tm_gmtoff * 10000000LL);
+    putInt64(out + 170, startTime);
+}
+
+int SerRecorder::close()
+{
+    if (fd < 0)
+        return 0;
+
+    pthread_mutex_lock(&mutex);
+    closing = true;
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mutex);
+
+    pthread_join(writer_thread, nullptr);
+
+    ::close(fd);
+    fd = -1;
+
+    free(ring);
+    ring = nullptr;
+
+    int rc = error ? -1 : 0;
+
+    // ---------------------------------------------------------------------------
+    // Cut off the padding and preallocation, then add the frame times and
+    // the header, through the page cache
+
+    int file = ::open(path, O_WRONLY);
+
+    if (file < 0)
+        return -1;
+
+    std::vector<unsigned char> trailer(timestamps.size() * 8);
+
+    for (size_t i = 0; i < timestamps.size(); i++) {
+        putInt64(&trailer[i * 8], timestamps[i]);
+    }
+
+    unsigned char buf[SER_HEADER];
+    header(buf, timestamps.size());
+
+    if (ftruncate(file, head) != 0 ||
+        pwrite(file, trailer.data(), trailer.size(), head) != (ssize_t)trailer.size() ||
+        pwrite(file, buf, SER_HEADER, 0) != SER_HEADER)
+    {
+        rc = -1;
+    }
+
+    if (::close(file) != 0)
+        rc = -1;
+
+    return rc;
+}
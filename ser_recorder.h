@@ -0,0 +1,110 @@
+/*
+ SER video recording of raw frames
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#ifndef SER_RECORDER_H
+#define SER_RECORDER_H
+
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define SER_HEADER  178                 /* Bytes of the SER file header */
+#define SER_BLOCK   (4L << 20)          /* Bytes per write to disk */
+#define SER_RING    (16 * SER_BLOCK)    /* Bytes of frames queued for the writer */
+#define SER_EXTENT  (256L << 20)        /* Bytes preallocated ahead of the writes */
+
+// SER ColorID of the region starting at x, y of a Bayer frame whose top left
+// 2x2 pixels are pattern, e.g. "BGGR". Mono (0) for an unknown pattern.
+int serColorId(const char *pattern, int x, int y);
+
+// Records the region x, y, w, h of every frame given to addFrame to a SER
+// file, at 8 or 16 bits per pixel. Frames are copied into a ring buffer and
+// a writer thread writes it out in SER_BLOCK sized, aligned writes, with
+// O_DIRECT where the filesystem allows it, so capture never waits on the disk.
+// If the writer falls a whole ring behind, frames are dropped and counted.
+class SerRecorder
+{
+    public:
+
+    SerRecorder();
+    ~SerRecorder();
+
+    // Create the file and start the writer. bits is the sensor bit depth.
+    // Returns 0, or -1 with errno set.
+    int open(const char *path, int x, int y, int w, int h, int bits, int depth, int colorId, const char *instrument);
+
+    // Queue the region of a frame of the given width. Called from one thread
+    // only. Returns false if the frame was dropped.
+    bool addFrame(const unsigned short *image, int width, const struct timeval *time);
+
+    // Write what is queued, then the frame timestamps and the final header.
+    // Returns 0, or -1 if anything could not be written.
+    int close();
+
+    bool isOpen() const { return fd >= 0; }
+    bool failed() const { return error != 0; }
+
+    int x() const { return roiX; }
+    int y() const { return roiY; }
+    int height() const { return roiH; }
+
+    long frames() const { return timestamps.size(); }
+    long dropped() const { return droppedFrames; }
+    double megabytes() const;
+
+    private:
+
+    int fd { -1 };
+    char path[1024];
+
+    int roiX { 0 }, roiY { 0 }, roiW { 0 }, roiH { 0 };
+    int bits { 16 };
+    int depth { 16 };
+    int colorId { 0 };
+    char instrument[40];
+    long frameBytes { 0 };
+
+    std::vector<uint64_t> timestamps;   // UTC of each frame written, in SER ticks
+    uint64_t startTime { 0 };           // UTC of the first frame
+    long droppedFrames { 0 };
+
+    // The ring holds the bytes of the file from tail to head
+    unsigned char *ring { nullptr };
+    std::vector<unsigned char> row;     // one converted row, 8 bit depth
+    long long cursor { 0 };             // bytes copied in by the capture thread
+    long long head { 0 };               // bytes queued, published to the writer
+    long long tail { 0 };               // bytes written, by the writer thread
+    long long allocated { 0 };          // bytes preallocated
+    bool closing { false };
+    int error { 0 };
+
+    pthread_t writer_thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+
+    void put(const unsigned char *data, long length);
+    void header(unsigned char *out, int frames);
+
+    static void *writerHelper(void *context);
+    void *writer();
+};
+
+#endif // SER_RECORDER_H
@@ -0,0 +1,217 @@
+/*
+ Shared memory export of frames and images
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm_export.h"
+
+static_assert(sizeof(ShmRing) <= SHM_HEADER, "ring header too large");
+static_assert(sizeof(ShmSlot) <= SHM_SLOT_HEADER, "slot header too large");
+
+void shmPattern(const char *pattern, int x, int y, char *out)
+{
+    out[0] = 0;
+
+    if (!pattern || strlen(pattern) != 4)
+        return;
+
+    for (int r = 0; r < 2; r++) {
+        for (int c = 0; c < 2; c++) {
+            out[r * 2 + c] = pattern[((r + y) & 1) * 2 + ((c + x) & 1)];
+        }
+    }
+    out[4] = 0;
+}
+
+// -------------------------------------------------------------------------------------------
+
+ShmExport::ShmExport()
+{
+    name[0] = 0;
+    pthread_mutex_init(&mutex, nullptr);
+}
+
+ShmExport::~ShmExport()
+{
+    close();
+
+    pthread_mutex_destroy(&mutex);
+}
+
+int ShmExport::open(const char *name, int slots, long itemBytes)
+{
+    close();
+
+    if (slots < 1 || itemBytes <= 0 || name[0] != '/')
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Slots start on page boundaries
+    long slotBytes = (SHM_SLOT_HEADER + itemBytes + 4095) & ~4095L;
+    long bytes     = SHM_HEADER + slots * slotBytes;
+
+    // A ring left by a driver that did not stop cleanly is replaced
+    shm_unlink(name);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+    if (fd < 0)
+        return -1;
+
+    // Pages are only taken as items are written to them
+    if (ftruncate(fd, bytes) != 0)
+    {
+        int e = errno;
+        ::close(fd);
+        shm_unlink(name);
+        errno = e;
+        return -1;
+    }
+
+    void *map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        int e = errno;
+        shm_unlink(name);
+        errno = e;
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    snprintf(this->name, sizeof(this->name), "%s", name);
+    this->slots = slots;
+    capacity    = itemBytes;
+    mapBytes    = bytes;
+    sequence    = 0;
+
+    ring              = (ShmRing *)map;
+    ring->slots       = slots;
+    ring->headerBytes = SHM_HEADER;
+    ring->slotBytes   = slotBytes;
+    ring->version     = SHM_VERSION;
+
+    // Readers check the magic last
+    __atomic_store_n(&ring->magic, (uint32_t)SHM_MAGIC, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&mutex);
+
+    return 0;
+}
+
+void ShmExport::close()
+{
+    pthread_mutex_lock(&mutex);
+
+    if (ring)
+    {
+        __atomic_store_n(&ring->closed, 1u, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&ring->futex, 1u, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &ring->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+
+        munmap(ring, mapBytes);
+        shm_unlink(name);
+
+        ring = nullptr;
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+bool ShmExport::publish(const ShmItem &item, const unsigned short *image, long stride, long planeStride)
+{
+    long rowBytes   = item.width * (long)sizeof(unsigned short);
+    long planeBytes = rowBytes * item.height;
+    long dataBytes  = planeBytes * item.planes;
+
+    pthread_mutex_lock(&mutex);
+
+    if (!ring || dataBytes > capacity)
+    {
+        pthread_mutex_unlock(&mutex);
+        return false;
+    }
+
+    uint64_t n = sequence + 1;
+
+    unsigned char *base = (unsigned char *)ring + SHM_HEADER + ((n - 1) % slots) * ring->slotBytes;
+    ShmSlot *slot       = (ShmSlot *)base;
+    unsigned char *data = base + SHM_SLOT_HEADER;
+
+    // Odd while written, so readers of the item it replaces see it change
+    __atomic_store_n(&slot->sequence, 2 * n - 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->kind      = item.kind;
+    slot->width     = item.width;
+    slot->height    = item.height;
+    slot->planes    = item.planes;
+    slot->bits      = item.bits;
+    slot->x         = item.x;
+    slot->y         = item.y;
+    slot->binX      = item.binX;
+    slot->binY      = item.binY;
+    slot->timestamp = item.timestamp;
+    slot->exposure  = item.exposure;
+    slot->dataBytes = dataBytes;
+
+    memset(slot->pattern, 0, sizeof(slot->pattern));
+    if (item.pattern)
+        strncpy(slot->pattern, item.pattern, sizeof(slot->pattern) - 1);
+
+    for (int p = 0; p < item.planes; p++) {
+
+        const unsigned short *plane = image + p * planeStride;
+
+        if (stride == item.width)
+        {
+            memcpy(data + p * planeBytes, plane, planeBytes);
+            continue;
+        }
+
+        for (int j = 0; j < item.height; j++) {
+            memcpy(data + p * planeBytes + j * rowBytes, plane + j * stride, rowBytes);
+        }
+    }
+
+    __atomic_store_n(&slot->sequence, 2 * n, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->sequence, n, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->futex, (uint32_t)n, __ATOMIC_RELEASE);
+
+    syscall(SYS_futex, &ring->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+
+    sequence = n;
+
+    pthread_mutex_unlock(&mutex);
+
+    return true;
+}
@@ -0,0 +1,134 @@
+/*
+ Shared memory export of frames and images
+ Part of the indi-picamera driver
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#ifndef SHM_EXPORT_H
+#define SHM_EXPORT_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define SHM_MAGIC       0x4d414350      /* "PCAM" */
+#define SHM_VERSION     1
+#define SHM_HEADER      4096            /* Bytes of the ring header, the first slot starts here */
+#define SHM_SLOT_HEADER 128             /* Bytes of each slot header, the pixels follow */
+
+enum ShmKind
+{
+    SHM_KIND_FRAME = 1,     // one unpacked sensor frame
+    SHM_KIND_IMAGE = 2      // a finished exposure, as sent to the client
+};
+
+// The shared memory object is a ShmRing header, then at headerBytes slots of
+// slotBytes bytes each. A slot is a ShmSlot header and, SHM_SLOT_HEADER bytes
+// in, planes of width x height 16 bit pixels. Item n (from 1) goes in slot
+// (n - 1) % slots.
+//
+// Reading, with the __atomic builtins or equivalent:
+//  1. Wait until ring.sequence passes the last item read. futex is the low
+//     32 bits of the sequence and is woken (FUTEX_WAKE, not private) on every
+//     item, so FUTEX_WAIT on it while it holds the last value seen.
+//  2. Read slot.sequence, which is 2n once item n is complete and odd while
+//     a slot is written. Use the pixels in place.
+//  3. Read slot.sequence again. If it changed the item was overwritten while
+//     in use and is dropped.
+// When closed is set the ring is stale: unmap it and open the name again.
+struct ShmRing
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t headerBytes;       // SHM_HEADER
+    uint64_t slotBytes;         // slot header and pixels
+    uint64_t sequence;          // last item published, 0 for none
+    uint32_t futex;
+    uint32_t closed;
+};
+
+struct ShmSlot
+{
+    uint64_t sequence;          // 2n when item n is complete, odd while written
+    uint32_t kind;              // ShmKind
+    uint32_t width;
+    uint32_t height;
+    uint32_t planes;            // 1, or 3 (R, G, B) when debayered
+    uint32_t bits;              // significant bits per pixel
+    int32_t x;                  // region origin on the sensor, unbinned pixels
+    int32_t y;
+    uint32_t binX;
+    uint32_t binY;
+    char pattern[8];            // Bayer pattern at the region origin, e.g. "BGGR", empty if none
+    uint64_t timestamp;         // UTC, microseconds since 1970
+    double exposure;            // frame period or exposure length (s)
+    uint64_t dataBytes;
+};
+
+struct ShmItem
+{
+    ShmKind kind;
+    int width, height, planes, bits;
+    int x, y, binX, binY;
+    const char *pattern;
+    uint64_t timestamp;
+    double exposure;
+};
+
+// Bayer pattern of the region starting at x, y of a frame whose top left 2x2
+// pixels are pattern. out holds at least 5 characters.
+void shmPattern(const char *pattern, int x, int y, char *out);
+
+// Publishes items into a POSIX shared memory ring for processes on the same
+// machine. Items are copied in once, readers use them in place. A slow reader
+// loses items, the driver never waits for readers.
+class ShmExport
+{
+    public:
+
+    ShmExport();
+    ~ShmExport();
+
+    // Create the object name (e.g. "/indi_picamera") with slots of up to
+    // itemBytes of pixels. Returns 0, or -1 with errno set.
+    int open(const char *name, int slots, long itemBytes);
+
+    // Mark the ring closed, wake readers and remove the name.
+    void close();
+
+    bool isOpen() const { return ring != nullptr; }
+    long itemBytes() const { return capacity; }
+    uint64_t published() const { return sequence; }
+
+    // Publish item.planes planes of item.width x item.height pixels. image is
+    // the first pixel, rows are stride pixels apart and planes planeStride.
+    // Returns false if the item does not fit the slots.
+    bool publish(const ShmItem &item, const unsigned short *image, long stride, long planeStride);
+
+    private:
+
+    char name[256];
+    int slots { 0 };
+    long capacity { 0 };
+    long mapBytes { 0 };
+    ShmRing *ring { nullptr };
+    uint64_t sequence { 0 };
+
+    pthread_mutex_t mutex;
+};
+
+#endif // SHM_EXPORT_H